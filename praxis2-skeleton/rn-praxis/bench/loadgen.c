@@ -0,0 +1,593 @@
+/**
+ * Load generator for the webserver and its DHT
+ *
+ * Spawns a ring of webserver nodes on loopback and drives a mix of GET, PUT
+ * and DELETE requests over keep-alive connections from many concurrent
+ * clients. Clients follow redirects and retry on 503 like a browser would.
+ * Reports throughput, latency percentiles, redirects and retries per
+ * request, and the average number of hops a DHT lookup took.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_NODES 4
+#define DEFAULT_CLIENTS 16
+#define DEFAULT_DURATION 5
+#define DEFAULT_KEYS 1000
+#define DEFAULT_VALUE_SIZE 64
+#define DEFAULT_BASE_PORT 5100
+#define MAX_ATTEMPTS 50
+#define RETRY_DELAY_US 5000
+#define RESPONSE_BUFFER 65536
+
+#ifndef WEBSERVER_PATH
+#define WEBSERVER_PATH "./webserver"
+#endif
+
+
+/**
+ * Benchmark configuration and the spawned ring
+ *
+ * `mix`: relative weights of GET, PUT and DELETE requests
+ * `pids`: process of each node
+ * `logs`: file each node's stderr is written to
+ * `deadline`: end of the measurement, in microseconds
+ */
+struct loadgen {
+    size_t n_nodes;
+    size_t n_clients;
+    unsigned duration;
+    size_t n_keys;
+    size_t value_size;
+    unsigned mix[3];
+    uint16_t base_port;
+    unsigned workers;
+    bool park_lookups;
+    const char* webserver;
+
+    pid_t* pids;
+    char (*logs)[64];
+    char* value;
+    pthread_barrier_t start;
+    _Atomic uint64_t deadline;
+};
+
+
+/**
+ * A client, running in a thread of its own
+ *
+ * `socks`: keep-alive connection to each node, opened on first use, or -1
+ * `latencies`: latency of every completed request in microseconds
+ */
+struct client {
+    struct loadgen* loadgen;
+    unsigned seed;
+    size_t index;
+    int* socks;
+    char buffer[RESPONSE_BUFFER];
+
+    uint32_t* latencies;
+    size_t n_latencies;
+    size_t latencies_capacity;
+    size_t n_errors;
+    size_t n_redirects;
+    size_t n_retries;
+};
+
+
+/**
+ * Status and redirect target of a response
+ */
+struct response {
+    int status;
+    uint16_t location_port;
+};
+
+
+static uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/**
+ * Opens a keep-alive connection to the node at `port`, or returns -1.
+ */
+static int connect_node(uint16_t port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    const int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    return sock;
+}
+
+
+/**
+ * Reads a response from `sock`, discarding its body.
+ *
+ * @return Returns false if the connection failed or the response is malformed.
+ */
+static bool read_response(struct client* client, int sock, struct response* response) {
+    size_t n = 0;
+    char* header_end = NULL;
+    while (!header_end) {
+        if (n == sizeof(client->buffer) - 1) {
+            return false;
+        }
+        ssize_t received = recv(sock, client->buffer + n, sizeof(client->buffer) - 1 - n, 0);
+        if (received <= 0) {
+            return false;
+        }
+        n += received;
+        client->buffer[n] = '\0';
+        header_end = strstr(client->buffer, "\r\n\r\n");
+    }
+    *header_end = '\0';
+
+    if (sscanf(client->buffer, "HTTP/1.1 %d", &(response->status)) != 1) {
+        return false;
+    }
+
+    size_t content_length = 0;
+    response->location_port = 0;
+    for (char* line = strstr(client->buffer, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = strtoul(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Location:", 9) == 0) {
+            // Location: http://ip:port/uri
+            char* port = strchr(strstr(line, "//") + 2, ':');
+            if (port) {
+                response->location_port = strtoul(port + 1, NULL, 10);
+            }
+        }
+    }
+
+    // Discard the body, part of which may already be in the buffer
+    size_t received_body = n - (header_end + 4 - client->buffer);
+    while (received_body < content_length) {
+        size_t chunk = content_length - received_body;
+        if (chunk > sizeof(client->buffer)) {
+            chunk = sizeof(client->buffer);
+        }
+        ssize_t received = recv(sock, client->buffer, chunk, 0);
+        if (received <= 0) {
+            return false;
+        }
+        received_body += received;
+    }
+    return true;
+}
+
+
+/**
+ * Sends a request to `node` and reads the response, reconnecting once if
+ * the keep-alive connection was closed meanwhile.
+ */
+static bool exchange(struct client* client, size_t node, const char* method, const char* uri,
+                     const char* body, size_t body_length, struct response* response) {
+    struct loadgen* loadgen = client->loadgen;
+    char header[256];
+    int header_length = snprintf(header, sizeof(header), "%s %s HTTP/1.1\r\nContent-Length: %zu\r\n\r\n",
+                                 method, uri, body_length);
+
+    for (int attempt = 0; attempt < 2; attempt += 1) {
+        if (client->socks[node] == -1) {
+            client->socks[node] = connect_node(loadgen->base_port + node);
+            if (client->socks[node] == -1) {
+                return false;
+            }
+        }
+
+        struct iovec parts[] = {
+            {.iov_base = header, .iov_len = header_length},
+            {.iov_base = (char*) body, .iov_len = body_length},
+        };
+        struct msghdr message = {.msg_iov = parts, .msg_iovlen = body_length ? 2 : 1};
+        ssize_t sent = sendmsg(client->socks[node], &message, MSG_NOSIGNAL);
+        if (sent == (ssize_t) (header_length + body_length) && read_response(client, client->socks[node], response)) {
+            return true;
+        }
+
+        close(client->socks[node]);
+        client->socks[node] = -1;
+    }
+    return false;
+}
+
+
+/**
+ * Performs a request like a client of the DHT: starting at a random node,
+ * following redirects and retrying after 503 until it is answered.
+ */
+static void request(struct client* client, const char* method, size_t key, bool record) {
+    struct loadgen* loadgen = client->loadgen;
+    char uri[64];
+    snprintf(uri, sizeof(uri), "/bench/%zu", key);
+    const char* body = strcmp(method, "PUT") == 0 ? loadgen->value : NULL;
+    size_t body_length = body ? loadgen->value_size : 0;
+
+    uint64_t start = now_us();
+    size_t node = rand_r(&(client->seed)) % loadgen->n_nodes;
+    struct response response;
+
+    for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt += 1) {
+        if (!exchange(client, node, method, uri, body, body_length, &response)) {
+            break;
+        }
+        if (response.status == 303) {
+            node = response.location_port - loadgen->base_port;
+            if (node >= loadgen->n_nodes) {
+                break;
+            }
+            client->n_redirects += record;
+            continue;
+        }
+        if (response.status == 503) {
+            client->n_retries += record;
+            usleep(RETRY_DELAY_US);
+            continue;
+        }
+        if (!record) {
+            return;
+        }
+
+        if (client->n_latencies == client->latencies_capacity) {
+            client->latencies_capacity = client->latencies_capacity ? client->latencies_capacity * 2 : 4096;
+            client->latencies = realloc(client->latencies, client->latencies_capacity * sizeof(uint32_t));
+            if (client->latencies == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        client->latencies[client->n_latencies++] = now_us() - start;
+        return;
+    }
+    client->n_errors += record;
+}
+
+
+static void* client_run(void* arg) {
+    struct client* client = arg;
+    struct loadgen* loadgen = client->loadgen;
+
+    // Populate this client's share of the keys, unmeasured
+    for (size_t key = client->index; key < loadgen->n_keys; key += loadgen->n_clients) {
+        request(client, "PUT", key, false);
+    }
+    // Once all clients are done, the deadline is set in between
+    pthread_barrier_wait(&(loadgen->start));
+    pthread_barrier_wait(&(loadgen->start));
+
+    const unsigned total = loadgen->mix[0] + loadgen->mix[1] + loadgen->mix[2];
+    while (now_us() < loadgen->deadline) {
+        size_t key = rand_r(&(client->seed)) % loadgen->n_keys;
+        unsigned choice = rand_r(&(client->seed)) % total;
+        if (choice < loadgen->mix[0]) {
+            request(client, "GET", key, true);
+        } else if (choice < loadgen->mix[0] + loadgen->mix[1]) {
+            request(client, "PUT", key, true);
+        } else {
+            request(client, "DELETE", key, true);
+        }
+    }
+
+    for (size_t i = 0; i < loadgen->n_nodes; i += 1) {
+        if (client->socks[i] != -1) {
+            close(client->socks[i]);
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Starts all nodes of the ring, with IDs spread evenly
+ */
+static void spawn_ring(struct loadgen* loadgen) {
+    loadgen->pids = calloc(loadgen->n_nodes, sizeof(pid_t));
+    loadgen->logs = calloc(loadgen->n_nodes, sizeof(*loadgen->logs));
+
+    for (size_t i = 0; i < loadgen->n_nodes; i += 1) {
+        size_t pred = (i + loadgen->n_nodes - 1) % loadgen->n_nodes;
+        size_t succ = (i + 1) % loadgen->n_nodes;
+        snprintf(loadgen->logs[i], sizeof(loadgen->logs[i]), "/tmp/loadgen-node%zu-XXXXXX", i);
+        int log = mkstemp(loadgen->logs[i]);
+        if (log == -1) {
+            perror("mkstemp");
+            exit(EXIT_FAILURE);
+        }
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid > 0) {
+            close(log);
+            loadgen->pids[i] = pid;
+            continue;
+        }
+
+        char buffer[6][16];
+        snprintf(buffer[0], sizeof(buffer[0]), "%zu", i * 65536 / loadgen->n_nodes);
+        snprintf(buffer[1], sizeof(buffer[1]), "%zu", pred * 65536 / loadgen->n_nodes);
+        snprintf(buffer[2], sizeof(buffer[2]), "%zu", succ * 65536 / loadgen->n_nodes);
+        snprintf(buffer[3], sizeof(buffer[3]), "%u", loadgen->base_port + (unsigned) i);
+        snprintf(buffer[4], sizeof(buffer[4]), "%u", loadgen->base_port + (unsigned) pred);
+        snprintf(buffer[5], sizeof(buffer[5]), "%u", loadgen->base_port + (unsigned) succ);
+        setenv("PRED_ID", buffer[1], 1);
+        setenv("PRED_IP", "127.0.0.1", 1);
+        setenv("PRED_PORT", buffer[4], 1);
+        setenv("SUCC_ID", buffer[2], 1);
+        setenv("SUCC_IP", "127.0.0.1", 1);
+        setenv("SUCC_PORT", buffer[5], 1);
+
+        char workers[16];
+        snprintf(workers, sizeof(workers), "%u", loadgen->workers);
+        const char* args[10];
+        size_t n_args = 0;
+        args[n_args++] = loadgen->webserver;
+        args[n_args++] = "-w";
+        args[n_args++] = workers;
+        if (loadgen->park_lookups) {
+            args[n_args++] = "-P";
+        }
+        args[n_args++] = "127.0.0.1";
+        args[n_args++] = buffer[3];
+        if (loadgen->n_nodes > 1) {
+            args[n_args++] = buffer[0];
+        }
+        args[n_args] = NULL;
+
+        dup2(log, STDERR_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execv(loadgen->webserver, (char**) args);
+        perror("execv");
+        _exit(EXIT_FAILURE);
+    }
+
+    // Wait until every node accepts connections
+    for (size_t i = 0; i < loadgen->n_nodes; i += 1) {
+        int sock = -1;
+        for (int attempt = 0; attempt < 500 && sock == -1; attempt += 1) {
+            sock = connect_node(loadgen->base_port + i);
+            if (sock == -1) {
+                usleep(10000);
+            }
+        }
+        if (sock == -1) {
+            fprintf(stderr, "Node %zu did not start\n", i);
+            exit(EXIT_FAILURE);
+        }
+        close(sock);
+    }
+}
+
+
+/**
+ * Collects the DHT statistics of all nodes and stops them
+ *
+ * Sums `n_sent`, `n_forwarded` and `n_answered` of the ring, as printed by
+ * each node on SIGUSR1.
+ */
+static void stop_ring(struct loadgen* loadgen, size_t lookups[3]) {
+    for (size_t i = 0; i < loadgen->n_nodes; i += 1) {
+        kill(loadgen->pids[i], SIGUSR1);
+    }
+    usleep(300000);
+
+    lookups[0] = lookups[1] = lookups[2] = 0;
+    for (size_t i = 0; i < loadgen->n_nodes; i += 1) {
+        kill(loadgen->pids[i], SIGTERM);
+        waitpid(loadgen->pids[i], NULL, 0);
+
+        FILE* log = fopen(loadgen->logs[i], "r");
+        char line[512];
+        size_t node[3] = {0};
+        while (log && fgets(line, sizeof(line), log)) {
+            sscanf(line, "DHT: %zu lookups sent, %zu forwarded, %zu answered", &node[0], &node[1], &node[2]);
+        }
+        if (log) {
+            fclose(log);
+        }
+        unlink(loadgen->logs[i]);
+        for (size_t j = 0; j < 3; j += 1) {
+            lookups[j] += node[j];
+        }
+    }
+}
+
+
+static int compare_latencies(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+
+static uint32_t percentile(const uint32_t* sorted, size_t n, double fraction) {
+    if (n == 0) {
+        return 0;
+    }
+    size_t index = (size_t) (fraction * (n - 1) + 0.5);
+    return sorted[index];
+}
+
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [-n nodes] [-c clients] [-d seconds] [-k keys] [-s value_size] [-m get:put:delete]\n"
+            "          [-p base_port] [-w workers] [-P] [-x webserver]\n"
+            "\n"
+            "  -n nodes        webservers forming the ring (default %d)\n"
+            "  -c clients      concurrent clients, each with keep-alive connections to all nodes (default %d)\n"
+            "  -d seconds      duration of the measurement (default %d)\n"
+            "  -k keys         number of distinct keys (default %d)\n"
+            "  -s value_size   bytes per stored value (default %d)\n"
+            "  -m mix          relative weights of GET, PUT and DELETE requests (default 80:15:5)\n"
+            "  -p base_port    port of the first node, the others follow (default %d)\n"
+            "  -w workers      worker threads per node (default 1)\n"
+            "  -P              let nodes hold requests until lookups complete (webserver -P)\n"
+            "  -x webserver    path to the webserver executable (default %s)\n",
+            program, DEFAULT_NODES, DEFAULT_CLIENTS, DEFAULT_DURATION, DEFAULT_KEYS, DEFAULT_VALUE_SIZE,
+            DEFAULT_BASE_PORT, WEBSERVER_PATH);
+}
+
+
+int main(int argc, char** argv) {
+    struct loadgen loadgen = {
+        .n_nodes = DEFAULT_NODES,
+        .n_clients = DEFAULT_CLIENTS,
+        .duration = DEFAULT_DURATION,
+        .n_keys = DEFAULT_KEYS,
+        .value_size = DEFAULT_VALUE_SIZE,
+        .mix = {80, 15, 5},
+        .base_port = DEFAULT_BASE_PORT,
+        .workers = 1,
+        .webserver = WEBSERVER_PATH,
+    };
+
+    int option;
+    while ((option = getopt(argc, argv, "n:c:d:k:s:m:p:w:Px:")) != -1) {
+        switch (option) {
+            case 'n':
+                loadgen.n_nodes = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                loadgen.n_clients = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                loadgen.duration = strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                loadgen.n_keys = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                loadgen.value_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                if (sscanf(optarg, "%u:%u:%u", &loadgen.mix[0], &loadgen.mix[1], &loadgen.mix[2]) != 3) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                loadgen.base_port = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                loadgen.workers = strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                loadgen.park_lookups = true;
+                break;
+            case 'x':
+                loadgen.webserver = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (loadgen.n_nodes == 0 || loadgen.n_clients == 0 || loadgen.n_keys == 0 || loadgen.workers == 0
+        || loadgen.mix[0] + loadgen.mix[1] + loadgen.mix[2] == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    loadgen.value = malloc(loadgen.value_size + 1);
+    memset(loadgen.value, 'x', loadgen.value_size);
+    pthread_barrier_init(&(loadgen.start), NULL, loadgen.n_clients + 1);
+
+    spawn_ring(&loadgen);
+
+    struct client* clients = calloc(loadgen.n_clients, sizeof(struct client));
+    pthread_t* threads = calloc(loadgen.n_clients, sizeof(pthread_t));
+    for (size_t i = 0; i < loadgen.n_clients; i += 1) {
+        clients[i].loadgen = &loadgen;
+        clients[i].index = i;
+        clients[i].seed = i + 1;
+        clients[i].socks = malloc(loadgen.n_nodes * sizeof(int));
+        for (size_t j = 0; j < loadgen.n_nodes; j += 1) {
+            clients[i].socks[j] = -1;
+        }
+        if (pthread_create(&threads[i], NULL, client_run, &clients[i]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Measure from the moment all keys are populated
+    pthread_barrier_wait(&(loadgen.start));
+    uint64_t start = now_us();
+    loadgen.deadline = start + (uint64_t) loadgen.duration * 1000000;
+    pthread_barrier_wait(&(loadgen.start));
+    for (size_t i = 0; i < loadgen.n_clients; i += 1) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (now_us() - start) / 1e6;
+
+    size_t lookups[3];
+    stop_ring(&loadgen, lookups);
+
+    size_t n_requests = 0, n_errors = 0, n_redirects = 0, n_retries = 0;
+    for (size_t i = 0; i < loadgen.n_clients; i += 1) {
+        n_requests += clients[i].n_latencies;
+        n_errors += clients[i].n_errors;
+        n_redirects += clients[i].n_redirects;
+        n_retries += clients[i].n_retries;
+    }
+    uint32_t* latencies = malloc((n_requests ? n_requests : 1) * sizeof(uint32_t));
+    size_t n = 0;
+    for (size_t i = 0; i < loadgen.n_clients; i += 1) {
+        memcpy(latencies + n, clients[i].latencies, clients[i].n_latencies * sizeof(uint32_t));
+        n += clients[i].n_latencies;
+    }
+    qsort(latencies, n, sizeof(uint32_t), compare_latencies);
+
+    double per_request = n_requests ? 1.0 / n_requests : 0;
+    printf("nodes %zu, clients %zu, %.1f s, mix %u:%u:%u, %zu keys of %zu bytes\n",
+           loadgen.n_nodes, loadgen.n_clients, elapsed, loadgen.mix[0], loadgen.mix[1], loadgen.mix[2],
+           loadgen.n_keys, loadgen.value_size);
+    printf("requests   %zu (%.0f/s), %zu errors\n", n_requests, n_requests / elapsed, n_errors);
+    printf("latency    p50 %u us, p99 %u us, p999 %u us, max %u us\n",
+           percentile(latencies, n, .5), percentile(latencies, n, .99), percentile(latencies, n, .999),
+           n ? latencies[n - 1] : 0);
+    printf("redirects  %.3f per request\n", n_redirects * per_request);
+    printf("retries    %.3f per request\n", n_retries * per_request);
+    printf("lookups    %zu sent, %.2f hops on average\n",
+           lookups[0], lookups[0] ? (double) (lookups[1] + lookups[2]) / lookups[0] : 0.0);
+
+    return n_errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,369 @@
+/**
+ * Microbenchmarks of the webserver's hot functions
+ *
+ * Measures `parse_request()` on a small corpus of realistic requests, both
+ * complete and arriving in pieces, `hash()` with and without its memo, `memstr()`, and the store's
+ * `get()`, `set()` and `delete()` at several fill levels. Every benchmark
+ * prints one JSON object per line, so results of different commits can be
+ * compared with standard tools.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../data.h"
+#include "../dht.h"
+#include "../http.h"
+#include "../util.h"
+
+#define DEFAULT_MIN_TIME 0.2
+#define STORE_VALUE "some stored value of moderate size"
+
+
+/**
+ * A benchmark run by `measure()`
+ *
+ * `run` performs `iterations` operations on `context`.
+ */
+struct benchmark {
+    const char* name;
+    void (*run)(void* context, size_t iterations);
+    void* context;
+};
+
+
+static double min_time = DEFAULT_MIN_TIME;
+static const char* filter = NULL;
+
+// Results are written here, so the compiler cannot drop the measured calls
+static volatile size_t sink;
+
+
+static double now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+/**
+ * Runs a benchmark for at least `min_time` seconds and prints its result
+ *
+ * The number of iterations is doubled until a run takes long enough, the
+ * last run is reported.
+ */
+static void measure(const struct benchmark* benchmark) {
+    if (filter && !strstr(benchmark->name, filter)) {
+        return;
+    }
+
+    size_t iterations = 1;
+    double elapsed;
+    while (true) {
+        double start = now();
+        benchmark->run(benchmark->context, iterations);
+        elapsed = now() - start;
+        if (elapsed >= min_time) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    printf("{\"benchmark\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.2f}\n",
+           benchmark->name, iterations, elapsed * 1e9 / iterations);
+    fflush(stdout);
+}
+
+
+/**
+ * A request of the parser corpus, parsed from a copy in `buffer`
+ *
+ * `piece`: number of bytes added per call to `parse_request()`, 0 to parse
+ *          the complete request at once
+ */
+struct parse_context {
+    const char* request;
+    size_t length;
+    size_t piece;
+    char buffer[HTTP_MAX_SIZE];
+};
+
+
+static void run_parse(void* arg, size_t iterations) {
+    struct parse_context* context = arg;
+    struct request request;
+    struct parser parser;
+
+    for (size_t i = 0; i < iterations; i += 1) {
+        memcpy(context->buffer, context->request, context->length);
+        request = (struct request) {.payload_length = -1};
+        parser_reset(&parser);
+
+        if (context->piece == 0) {
+            sink = parse_request(context->buffer, context->length, &request, &parser);
+            continue;
+        }
+        for (size_t n = context->piece; ; n += context->piece) {
+            ssize_t result = parse_request(context->buffer, n < context->length ? n : context->length, &request, &parser);
+            if (result != 0 || n >= context->length) {
+                sink = result;
+                break;
+            }
+        }
+    }
+}
+
+
+static void run_hash(void* arg, size_t iterations) {
+    const char* uri = arg;
+    size_t result = 0;
+    for (size_t i = 0; i < iterations; i += 1) {
+        result += hash(uri);
+    }
+    sink = result;
+}
+
+
+static void run_hash_cached(void* arg, size_t iterations) {
+    const char* uri = arg;
+    size_t result = 0;
+    for (size_t i = 0; i < iterations; i += 1) {
+        result += hash_cached(uri);
+    }
+    sink = result;
+}
+
+
+/**
+ * A haystack for `memstr()`, with the needle at its very end
+ */
+struct memstr_context {
+    char* haystack;
+    size_t length;
+};
+
+
+static void run_memstr(void* arg, size_t iterations) {
+    struct memstr_context* context = arg;
+    for (size_t i = 0; i < iterations; i += 1) {
+        sink = (size_t) memstr(context->haystack, context->length, "\r\n\r\n");
+    }
+}
+
+
+/**
+ * A store filled with `n_keys` keys "/key/0" ... "/key/<n_keys - 1>"
+ *
+ * `keys`: the stored keys followed by as many missing ones
+ */
+struct store_context {
+    struct store store;
+    size_t n_keys;
+    char (*keys)[32];
+    unsigned seed;
+};
+
+
+static void run_get_hit(void* arg, size_t iterations) {
+    struct store_context* context = arg;
+    for (size_t i = 0; i < iterations; i += 1) {
+        size_t length;
+        const char* value = get(context->keys[rand_r(&(context->seed)) % context->n_keys], &(context->store), &length);
+        release(&(context->store), value);
+        sink = length;
+    }
+}
+
+
+static void run_get_miss(void* arg, size_t iterations) {
+    struct store_context* context = arg;
+    for (size_t i = 0; i < iterations; i += 1) {
+        size_t length;
+        sink = (size_t) get(context->keys[context->n_keys + rand_r(&(context->seed)) % context->n_keys],
+                            &(context->store), &length);
+    }
+}
+
+
+static void run_set_overwrite(void* arg, size_t iterations) {
+    struct store_context* context = arg;
+    for (size_t i = 0; i < iterations; i += 1) {
+        sink = set(context->keys[rand_r(&(context->seed)) % context->n_keys], STORE_VALUE,
+                   sizeof(STORE_VALUE) - 1, &(context->store));
+    }
+}
+
+
+/**
+ * Inserts a missing key and deletes it again, keeping the fill level
+ */
+static void run_set_delete(void* arg, size_t iterations) {
+    struct store_context* context = arg;
+    for (size_t i = 0; i < iterations; i += 1) {
+        const string key = context->keys[context->n_keys + rand_r(&(context->seed)) % context->n_keys];
+        set(key, STORE_VALUE, sizeof(STORE_VALUE) - 1, &(context->store));
+        sink = delete(key, &(context->store));
+    }
+}
+
+
+static struct store_context* store_context_create(size_t n_keys) {
+    struct store_context* context = calloc(1, sizeof(struct store_context));
+    context->n_keys = n_keys;
+    context->seed = 1;
+    context->keys = calloc(2 * n_keys, sizeof(*context->keys));
+    store_init(&(context->store), n_keys);
+    for (size_t i = 0; i < 2 * n_keys; i += 1) {
+        snprintf(context->keys[i], sizeof(context->keys[i]), "/key/%zu", i);
+        if (i < n_keys) {
+            set(context->keys[i], STORE_VALUE, sizeof(STORE_VALUE) - 1, &(context->store));
+        }
+    }
+    return context;
+}
+
+
+static void bench_parser(void) {
+    static const struct {
+        const char* name;
+        const char* request;
+    } corpus[] = {
+        {"minimal", "GET / HTTP/1.1\r\n\r\n"},
+        {"curl", "GET /static/foo HTTP/1.1\r\nHost: 127.0.0.1:4711\r\nUser-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n"},
+        {"browser",
+         "GET /dynamic/some/longer/path/to/a/resource HTTP/1.1\r\n"
+         "Host: localhost:4711\r\n"
+         "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+         "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+         "Accept-Language: en-US,en;q=0.5\r\n"
+         "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+         "Connection: keep-alive\r\n"
+         "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+         "Upgrade-Insecure-Requests: 1\r\n"
+         "Sec-Fetch-Dest: document\r\n"
+         "Sec-Fetch-Mode: navigate\r\n"
+         "Sec-Fetch-Site: none\r\n"
+         "Priority: u=0, i\r\n"
+         "\r\n"},
+        {"put", "PUT /dynamic/key HTTP/1.1\r\nHost: localhost:4711\r\nContent-Type: application/octet-stream\r\n"
+                "Content-Length: 5\r\n\r\nvalue"},
+    };
+    static const size_t pieces[] = {0, 64, 16};
+
+    for (size_t i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i += 1) {
+        for (size_t j = 0; j < sizeof(pieces) / sizeof(pieces[0]); j += 1) {
+            struct parse_context* context = malloc(sizeof(struct parse_context));
+            context->request = corpus[i].request;
+            context->length = strlen(corpus[i].request);
+            context->piece = pieces[j];
+
+            char name[64];
+            if (pieces[j]) {
+                snprintf(name, sizeof(name), "parse_request/%s/pieces_%zu", corpus[i].name, pieces[j]);
+            } else {
+                snprintf(name, sizeof(name), "parse_request/%s", corpus[i].name);
+            }
+            measure(&(struct benchmark) {name, run_parse, context});
+            free(context);
+        }
+    }
+}
+
+
+static void bench_hash(void) {
+    static const size_t lengths[] = {8, 64, 512};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i += 1) {
+        char* uri = malloc(lengths[i] + 1);
+        uri[0] = '/';
+        memset(uri + 1, 'a', lengths[i] - 1);
+        uri[lengths[i]] = '\0';
+
+        char name[64];
+        snprintf(name, sizeof(name), "hash/uri_%zu", lengths[i]);
+        measure(&(struct benchmark) {name, run_hash, uri});
+        snprintf(name, sizeof(name), "hash_cached/uri_%zu", lengths[i]);
+        measure(&(struct benchmark) {name, run_hash_cached, uri});
+        free(uri);
+    }
+}
+
+
+static void bench_memstr(void) {
+    static const size_t lengths[] = {64, 1024, HTTP_MAX_SIZE};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i += 1) {
+        // Header-like text with many single line separators before the needle
+        struct memstr_context context = {.haystack = malloc(lengths[i]), .length = lengths[i]};
+        for (size_t j = 0; j < lengths[i]; j += 1) {
+            context.haystack[j] = j % 32 == 30 ? '\r' : j % 32 == 31 ? '\n' : 'a';
+        }
+        memcpy(context.haystack + lengths[i] - 4, "\r\n\r\n", 4);
+
+        char name[64];
+        snprintf(name, sizeof(name), "memstr/haystack_%zu", lengths[i]);
+        measure(&(struct benchmark) {name, run_memstr, &context});
+        free(context.haystack);
+    }
+}
+
+
+static void bench_store(void) {
+    static const size_t fill_levels[] = {1000, 100000, 1000000};
+    static const struct {
+        const char* name;
+        void (*run)(void* context, size_t iterations);
+    } operations[] = {
+        {"get_hit", run_get_hit},
+        {"get_miss", run_get_miss},
+        {"set_overwrite", run_set_overwrite},
+        {"set_delete", run_set_delete},
+    };
+
+    for (size_t i = 0; i < sizeof(fill_levels) / sizeof(fill_levels[0]); i += 1) {
+        // Keys and values are never freed, the store has no destructor
+        struct store_context* context = store_context_create(fill_levels[i]);
+        for (size_t j = 0; j < sizeof(operations) / sizeof(operations[0]); j += 1) {
+            char name[64];
+            snprintf(name, sizeof(name), "store/%s/keys_%zu", operations[j].name, fill_levels[i]);
+            measure(&(struct benchmark) {name, operations[j].run, context});
+        }
+    }
+}
+
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [-t seconds] [-f filter]\n"
+            "\n"
+            "  -t seconds  minimum duration of each benchmark (default %.1f)\n"
+            "  -f filter   only run benchmarks whose name contains this string\n",
+            program, DEFAULT_MIN_TIME);
+}
+
+
+int main(int argc, char** argv) {
+    int option;
+    while ((option = getopt(argc, argv, "t:f:")) != -1) {
+        switch (option) {
+            case 't':
+                min_time = strtod(optarg, NULL);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    bench_parser();
+    bench_hash();
+    bench_memstr();
+    bench_store();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,85 @@
+/**
+ * Lookups in a catalog of static resources, see `struct catalog`.
+ */
+
+#include "catalog.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+void catalog_open(struct catalog* catalog, const char* path) {
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file == -1) {
+        perror("open catalog");
+        exit(EXIT_FAILURE);
+    }
+    struct stat status;
+    if (fstat(file, &status) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = status.st_size;
+    if (size < sizeof(struct catalog_header)) {
+        fprintf(stderr, "%s: not a catalog\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    const char* data = mmap(NULL, size, PROT_READ, MAP_SHARED, file, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    close(file);
+
+    const struct catalog_header* header = (const struct catalog_header*) data;
+    size_t entries_end = sizeof(struct catalog_header) + header->n_entries * sizeof(struct catalog_entry);
+    if (header->magic != CATALOG_MAGIC || header->n_entries > size / sizeof(struct catalog_entry)
+        || header->keys_end < entries_end || header->keys_end > size
+        || (header->n_entries > 0 && data[header->keys_end - 1] != '\0')) {
+        fprintf(stderr, "%s: not a catalog\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    // Lookups touch the entries and keys in no particular order
+    madvise((void*) data, header->keys_end, MADV_RANDOM);
+
+    *catalog = (struct catalog) {
+        .data = data,
+        .size = size,
+        .entries = (const struct catalog_entry*) (data + sizeof(struct catalog_header)),
+        .n_entries = header->n_entries,
+        .keys_end = header->keys_end,
+    };
+}
+
+
+const char* catalog_find(const struct catalog* catalog, const char* key, size_t* value_length) {
+    size_t low = 0;
+    size_t high = catalog->n_entries;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const struct catalog_entry* entry = &(catalog->entries[middle]);
+        if (entry->key >= catalog->keys_end) {
+            return NULL;  // Corrupt entry
+        }
+
+        int order = strcmp(key, catalog->data + entry->key);
+        if (order < 0) {
+            high = middle;
+        } else if (order > 0) {
+            low = middle + 1;
+        } else {
+            if (entry->value > catalog->size || entry->value_length > catalog->size - entry->value) {
+                return NULL;
+            }
+            *value_length = entry->value_length;
+            return catalog->data + entry->value;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define CATALOG_MAGIC 0x54414352  // "RCAT", starts every catalog file
+#define CATALOG_ALIGNMENT 8  // values start at multiples of this many bytes
+
+
+/**
+ * Start of a catalog file
+ *
+ * The header is followed by `n_entries` entries sorted by key as by
+ * strcmp(), then by the keys, each with its terminating zero, and then by
+ * the values. All offsets are from the start of the file, all numbers in
+ * the byte order of the host that built the file.
+ *
+ * `magic`: CATALOG_MAGIC
+ * `n_entries`: number of entries following the header
+ * `keys_end`: end of the keys; the byte before it is zero, so comparing
+ *             with any key never reads beyond the file
+ */
+struct catalog_header {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t n_entries;
+    uint64_t keys_end;
+};
+
+
+/**
+ * A resource of the catalog
+ *
+ * `key`: offset of the zero-terminated key
+ * `value`: offset of the value
+ * `value_length`: number of bytes of the value
+ */
+struct catalog_entry {
+    uint64_t key;
+    uint64_t value;
+    uint64_t value_length;
+};
+
+
+/**
+ * Immutable resources served from a file mapped into memory
+ *
+ * The file is built ahead of time by `mkcatalog` and never changes while
+ * mapped. Opening it only checks the header, resources are found by binary
+ * search over the entries in the mapping and served straight from it, so
+ * nothing is parsed or copied, and all processes mapping the same file on
+ * a host share its pages in the page cache. A catalog with no entries, as
+ * a zero-initialized one, finds nothing.
+ *
+ * `data`: the mapped file
+ * `size`: number of bytes of the file
+ * `entries`: the sorted entries in `data`, `n_entries` many
+ * `keys_end`: end of the keys in `data`
+ */
+struct catalog {
+    const char* data;
+    size_t size;
+    const struct catalog_entry* entries;
+    size_t n_entries;
+    size_t keys_end;
+};
+
+
+/**
+ * Map the catalog file at `path` into memory
+ *
+ * Exits if the file cannot be mapped or is not a catalog.
+ */
+void catalog_open(struct catalog* catalog, const char* path);
+
+/**
+ * Find the value of `key`, setting `value_length` to its number of bytes
+ *
+ * Returns NULL if the catalog has no such key. The value stays valid as
+ * long as the process runs.
+ */
+const char* catalog_find(const struct catalog* catalog, const char* key, size_t* value_length);
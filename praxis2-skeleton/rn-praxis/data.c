@@ -1,67 +1,527 @@
+#define _GNU_SOURCE  // O_TMPFILE
+
 #include "data.h"
 
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+#define SHARD_MIN_CAPACITY 16
+
+
+/**
+ * Shard responsible for a key hash
+ *
+ * Uses the upper bits, the lower ones select the slot within the shard.
+ */
+static struct store_shard* shard_of(struct store* store, uint64_t hash) {
+    return &(store->shards[hash >> 58]);
+}
 
 
-struct tuple* find(string key, struct tuple* tuples, size_t n_tuples) {
-    for (size_t i = 0; i < n_tuples; i += 1) {
-        // compare keys with 'strcmp'
-        if (tuples[i].key && strcmp(key, tuples[i].key) == 0) {
-            return &(tuples[i]);
+/**
+ * Find the slot holding `key`, or the empty slot ending its probe sequence
+ */
+static struct tuple* find(const string key, uint64_t hash, struct store_shard* shard) {
+    const size_t mask = shard->capacity - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct tuple* tuple = &(shard->tuples[i]);
+        // compare cached hashes first, keys with 'strcmp' only on a match
+        if (!tuple->key || (tuple->hash == hash && strcmp(key, tuple->key) == 0)) {
+            return tuple;
         }
     }
-    return NULL;
 }
 
 
-const char* get(const string key, struct tuple* tuples, size_t n_tuples, size_t* value_length) {
-    struct tuple* tuple = find(key, tuples, n_tuples);
-    if (tuple) {
-        *value_length = tuple->value_length;
-        return tuple->value;
-    } else {
+/**
+ * Move all entries into a table of `capacity` slots
+ */
+static void grow(struct store_shard* shard, size_t capacity) {
+    struct tuple* old = shard->tuples;
+    size_t old_capacity = shard->capacity;
+
+    shard->tuples = calloc(capacity, sizeof(struct tuple));
+    if (shard->tuples == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    shard->capacity = capacity;
+
+    for (size_t i = 0; i < old_capacity; i += 1) {
+        if (old[i].key) {
+            *find(old[i].key, old[i].hash, shard) = old[i];
+        }
+    }
+    free(old);
+}
+
+
+/**
+ * Number of bytes requested from the allocator for `value`
+ */
+static size_t value_size(const struct value* value) {
+    return sizeof(struct value) + (value->file == -1 ? value->length : 0);
+}
+
+
+/**
+ * Allocate an uninitialized value of `length` bytes, referenced once
+ *
+ * The caller holds the lock of the shard.
+ */
+static struct value* value_new(struct store_shard* shard, uint32_t index, size_t length, int file) {
+    size_t capacity;
+    struct value* value = slab_alloc(&(shard->allocator), sizeof(struct value) + (file == -1 ? length : 0), &capacity);
+    atomic_init(&(value->references), 1);
+    value->shard = index;
+    value->length = length;
+    value->capacity = capacity;
+    value->file = file;
+    value->handed_over = false;
+    return value;
+}
+
+
+/**
+ * Allocate a value holding a copy of `data`, referenced once
+ */
+static struct value* value_create(struct store_shard* shard, uint32_t index, const char* data, size_t length) {
+    struct value* value = value_new(shard, index, length, -1);
+    memcpy(value->data, data, length);
+    return value;
+}
+
+
+/**
+ * Free a value nobody references anymore, the caller holds the lock of its shard
+ */
+static void value_free(struct store_shard* shard, struct value* value) {
+    if (value->file != -1) {
+        close(value->file);
+    }
+    slab_free(&(shard->allocator), value, value->capacity, value_size(value));
+}
+
+
+/**
+ * Drop a reference to `value`, the caller holds the lock of its shard
+ */
+static void value_put(struct store_shard* shard, struct value* value) {
+    if (atomic_fetch_sub(&(value->references), 1) == 1) {
+        value_free(shard, value);
+    }
+}
+
+
+/**
+ * Ring position of a key, computed without holding any lock
+ */
+static uint16_t position_of(const string key, struct store* store) {
+    return store->position ? store->position(key) : 0;
+}
+
+
+/**
+ * Find the slot of `key`, adding the key at `position` if it is missing
+ *
+ * The caller holds the lock of the shard. The value of an added slot is NULL.
+ */
+static struct tuple* claim(const string key, uint64_t hash, uint16_t position, struct store_shard* shard) {
+    struct tuple* tuple = find(key, hash, shard);
+    if (tuple->key) {
+        return tuple;
+    }
+
+    // add tuple, growing the table first if it would become too full
+    if (shard->n_tuples + 1 > shard->capacity / 4 * 3) {
+        grow(shard, shard->capacity * 2);
+        tuple = find(key, hash, shard);
+    }
+
+    size_t key_capacity;
+    size_t key_size = strlen(key) + 1;
+    tuple->key = slab_alloc(&(shard->allocator), key_size, &key_capacity);
+    memcpy(tuple->key, key, key_size);
+    tuple->value = NULL;
+    tuple->hash = hash;
+    tuple->position = position;
+    shard->n_tuples += 1;
+    return tuple;
+}
+
+
+void store_init(struct store* store, size_t capacity) {
+    size_t slots = SHARD_MIN_CAPACITY;
+    while (slots / 4 * 3 * STORE_SHARDS < capacity) {
+        slots *= 2;
+    }
+
+    store->spill_threshold = DEFAULT_SPILL_THRESHOLD;
+    store->spill_directory = "/tmp";
+    store->position = NULL;
+    store->journal = NULL;
+    for (size_t i = 0; i < STORE_SHARDS; i += 1) {
+        struct store_shard* shard = &(store->shards[i]);
+        *shard = (struct store_shard) {0};
+        pthread_mutex_init(&(shard->lock), NULL);
+        slab_init(&(shard->allocator));
+        grow(shard, slots);
+    }
+}
+
+
+const char* get(const string key, struct store* store, size_t* value_length) {
+    const uint64_t hash = fnv1a(key);
+    struct store_shard* shard = shard_of(store, hash);
+
+    pthread_mutex_lock(&(shard->lock));
+    struct tuple* tuple = find(key, hash, shard);
+    struct value* value = tuple->key ? tuple->value : NULL;
+    if (value) {
+        atomic_fetch_add(&(value->references), 1);
+    }
+    pthread_mutex_unlock(&(shard->lock));
+
+    if (!value) {
         return NULL;
     }
+    *value_length = value->length;
+    return value->data;
 }
 
 
-bool set(const string key, char* value, size_t value_length, struct tuple* tuples, size_t n_tuples) {
-    // check if tuple already exists
-    struct tuple* tuple = find(key, tuples, n_tuples);
+bool get_position(const string key, struct store* store, uint16_t* position) {
+    const uint64_t hash = fnv1a(key);
+    struct store_shard* shard = shard_of(store, hash);
 
-    if (tuple) {  // overwrite existing value
-        free(tuple->value);
-        tuple->value = (char*) malloc(value_length * sizeof(char));
-        strcpy(tuple->value, value);
-        tuple->value_length = value_length;
-        return true;
-    } else {  // add tuple
-        for (size_t i = 0; i < n_tuples; i += 1) {
-            if (tuples[i].key == NULL) {
-                tuples[i].key = (char*) malloc((strlen(key) + 1) * sizeof(char));
-                strcpy(tuples[i].key, key);
-                tuples[i].value = (char*) malloc(value_length * sizeof(char));
-                memcpy(tuples[i].value, value, value_length);
-                tuples[i].value_length = value_length;
-                return false;
-            }
-        }
+    pthread_mutex_lock(&(shard->lock));
+    struct tuple* tuple = find(key, hash, shard);
+    bool found = tuple->key != NULL;
+    if (found) {
+        *position = tuple->position;
     }
-    return false;  // fail silently if no space for a new tuple is available 
+    pthread_mutex_unlock(&(shard->lock));
+    return found;
 }
 
 
-bool delete(const string key, struct tuple* tuples, size_t n_tuples) {
-    struct tuple* tuple = find(key, tuples, n_tuples);
+void release(struct store* store, const char* data) {
+    struct value* value = (struct value*) (data - offsetof(struct value, data));
+
+    // Dropping a reference other than the last one needs no lock: the store
+    // still holds one or the value is no longer reachable through it.
+    if (atomic_fetch_sub(&(value->references), 1) == 1) {
+        struct store_shard* shard = &(store->shards[value->shard]);
+        pthread_mutex_lock(&(shard->lock));
+        value_free(shard, value);
+        pthread_mutex_unlock(&(shard->lock));
+    }
+}
 
-    if (tuple) {
-        free(tuple->key);
-        tuple->key = NULL;
-        free(tuple->value);
-        tuple->value = NULL;
-        tuple->value_length = 0;
-        return true;
+
+int value_file(const char* data) {
+    const struct value* value = (const struct value*) (data - offsetof(struct value, data));
+    return value->file;
+}
+
+
+/**
+ * Outcome of writing a key, see `store_value()`
+ */
+enum write_result {
+    WRITE_CREATED,
+    WRITE_OVERWRITTEN,
+    WRITE_REFUSED,
+};
+
+
+/**
+ * Set a copy of `value` for the key, unless `handed_over` and the current
+ * value was written locally
+ */
+static enum write_result store_value(const string key, const char* value, size_t value_length, bool handed_over,
+                                     struct store* store) {
+    const uint64_t hash = fnv1a(key);
+    const uint16_t position = position_of(key, store);
+    struct store_shard* shard = shard_of(store, hash);
+    const uint32_t index = shard - store->shards;
+
+    pthread_mutex_lock(&(shard->lock));
+
+    // a missing key is not added just to be refused
+    struct tuple* tuple = find(key, hash, shard);
+    if (handed_over && tuple->key && !tuple->value->handed_over) {
+        pthread_mutex_unlock(&(shard->lock));
+        return WRITE_REFUSED;
+    }
+
+    tuple = claim(key, hash, position, shard);
+    struct value* current = tuple->value;
+    if (!current) {
+        tuple->value = value_create(shard, index, value, value_length);
+        tuple->value->handed_over = handed_over;
+        if (store->journal) {
+            journal_set(store->journal, key, tuple->value);
+        }
+        pthread_mutex_unlock(&(shard->lock));
+        return WRITE_CREATED;
+    }
+
+    // overwrite existing value, in place if nobody reads it and its chunk fits
+    if (current->file == -1 && atomic_load(&(current->references)) == 1
+        && slab_reuse(&(shard->allocator), current->capacity,
+                      value_size(current), sizeof(struct value) + value_length)) {
+        memcpy(current->data, value, value_length);
+        current->length = value_length;
     } else {
+        tuple->value = value_create(shard, index, value, value_length);
+        value_put(shard, current);
+    }
+    tuple->value->handed_over = handed_over;
+    if (store->journal) {
+        journal_set(store->journal, key, tuple->value);
+    }
+    pthread_mutex_unlock(&(shard->lock));
+    return WRITE_OVERWRITTEN;
+}
+
+
+bool set(const string key, char* value, size_t value_length, struct store* store) {
+    return store_value(key, value, value_length, false, store) == WRITE_OVERWRITTEN;
+}
+
+
+bool set_handed_over(const string key, char* value, size_t value_length, struct store* store) {
+    return store_value(key, value, value_length, true, store) != WRITE_REFUSED;
+}
+
+
+struct value* value_alloc(const string key, size_t value_length, struct store* store) {
+    struct store_shard* shard = shard_of(store, fnv1a(key));
+    const uint32_t index = shard - store->shards;
+
+    int file = -1;
+    if (value_length > store->spill_threshold) {
+        file = open(store->spill_directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (file == -1) {
+            perror("open");
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&(shard->lock));
+    struct value* value = value_new(shard, index, value_length, file);
+    pthread_mutex_unlock(&(shard->lock));
+    return value;
+}
+
+
+/**
+ * Set `value` for the key, taking over the caller's reference, unless
+ * `handed_over` and the current value was written locally
+ */
+static enum write_result store_allocated(const string key, struct value* value, bool handed_over,
+                                         struct store* store) {
+    const uint64_t hash = fnv1a(key);
+    const uint16_t position = position_of(key, store);
+    struct store_shard* shard = shard_of(store, hash);
+
+    pthread_mutex_lock(&(shard->lock));
+    struct tuple* tuple = find(key, hash, shard);
+    if (handed_over && tuple->key && !tuple->value->handed_over) {
+        value_put(shard, value);
+        pthread_mutex_unlock(&(shard->lock));
+        return WRITE_REFUSED;
+    }
+
+    tuple = claim(key, hash, position, shard);
+    struct value* current = tuple->value;
+    value->handed_over = handed_over;
+    tuple->value = value;
+    if (current) {
+        value_put(shard, current);
+    }
+    if (store->journal) {
+        journal_set(store->journal, key, value);
+    }
+    pthread_mutex_unlock(&(shard->lock));
+    return current ? WRITE_OVERWRITTEN : WRITE_CREATED;
+}
+
+
+bool set_value(const string key, struct value* value, struct store* store) {
+    return store_allocated(key, value, false, store) == WRITE_OVERWRITTEN;
+}
+
+
+bool set_value_handed_over(const string key, struct value* value, struct store* store) {
+    return store_allocated(key, value, true, store) != WRITE_REFUSED;
+}
+
+
+/**
+ * Delete the key, unless `handed_over` and its value was written locally
+ */
+static bool remove_key(const string key, bool handed_over, struct store* store) {
+    const uint64_t hash = fnv1a(key);
+    struct store_shard* shard = shard_of(store, hash);
+
+    pthread_mutex_lock(&(shard->lock));
+    struct tuple* tuple = find(key, hash, shard);
+
+    if (!tuple->key || (handed_over && !tuple->value->handed_over)) {
+        pthread_mutex_unlock(&(shard->lock));
         return false;
     }
+
+    size_t key_size = strlen(tuple->key) + 1;
+    slab_free(&(shard->allocator), tuple->key, slab_capacity(key_size), key_size);
+    value_put(shard, tuple->value);
+    shard->n_tuples -= 1;
+
+    // Backward-shift deletion: pull following entries of the probe sequence
+    // into the hole, so no lookup passes an empty slot before its key.
+    const size_t mask = shard->capacity - 1;
+    size_t hole = tuple - shard->tuples;
+    for (size_t i = (hole + 1) & mask; shard->tuples[i].key; i = (i + 1) & mask) {
+        size_t home = shard->tuples[i].hash & mask;
+        // distance from the home slot, modulo table size
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            shard->tuples[hole] = shard->tuples[i];
+            hole = i;
+        }
+    }
+    shard->tuples[hole] = (struct tuple) {0};
+
+    if (store->journal) {
+        journal_delete(store->journal, key);
+    }
+    pthread_mutex_unlock(&(shard->lock));
+    return true;
+}
+
+
+bool delete(const string key, struct store* store) {
+    return remove_key(key, false, store);
+}
+
+
+bool delete_handed_over(const string key, struct store* store) {
+    return remove_key(key, true, store);
+}
+
+
+size_t store_collect(struct store* store, size_t index, struct store_entry** entries) {
+    struct store_shard* shard = &(store->shards[index]);
+
+    pthread_mutex_lock(&(shard->lock));
+    *entries = malloc((shard->n_tuples + 1) * sizeof(struct store_entry));
+    if (*entries == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < shard->capacity; i += 1) {
+        struct tuple* tuple = &(shard->tuples[i]);
+        if (tuple->key) {
+            atomic_fetch_add(&(tuple->value->references), 1);
+            (*entries)[n] = (struct store_entry) {strdup(tuple->key), tuple->value};
+            n += 1;
+        }
+    }
+    pthread_mutex_unlock(&(shard->lock));
+    return n;
+}
+
+
+/**
+ * A key and the distance of its position from the start of the range, as
+ * sorted by `store_range()`
+ */
+struct positioned_key {
+    uint16_t offset;
+    string key;
+};
+
+
+static int compare_positions(const void* a, const void* b) {
+    const struct positioned_key* first = a;
+    const struct positioned_key* second = b;
+    return (int) first->offset - (int) second->offset;
+}
+
+
+size_t store_range(struct store* store, uint16_t from, uint16_t to, string** keys) {
+    struct positioned_key* found = NULL;
+    size_t n = 0;
+    size_t capacity = 0;
+
+    // Positions are counted from `from`, so the interval does not wrap around
+    uint16_t width = to - from;
+    for (size_t i = 0; i < STORE_SHARDS; i += 1) {
+        struct store_shard* shard = &(store->shards[i]);
+        pthread_mutex_lock(&(shard->lock));
+        for (size_t j = 0; j < shard->capacity; j += 1) {
+            struct tuple* tuple = &(shard->tuples[j]);
+            uint16_t offset = tuple->position - from;
+            if (tuple->key == NULL || (width != 0 && (offset == 0 || offset > width))) {
+                continue;
+            }
+            if (n == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                found = realloc(found, capacity * sizeof(struct positioned_key));
+                if (found == NULL) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            found[n] = (struct positioned_key) {offset, strdup(tuple->key)};
+            n += 1;
+        }
+        pthread_mutex_unlock(&(shard->lock));
+    }
+
+    qsort(found, n, sizeof(struct positioned_key), compare_positions);
+    *keys = malloc((n + 1) * sizeof(string));
+    if (*keys == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < n; i += 1) {
+        (*keys)[i] = found[i].key;
+    }
+    free(found);
+    return n;
+}
+
+
+size_t store_size(struct store* store) {
+    size_t size = 0;
+    for (size_t i = 0; i < STORE_SHARDS; i += 1) {
+        pthread_mutex_lock(&(store->shards[i].lock));
+        size += store->shards[i].n_tuples;
+        pthread_mutex_unlock(&(store->shards[i].lock));
+    }
+    return size;
+}
+
+
+struct slab_stats store_stats(struct store* store) {
+    struct slab_stats total = {0};
+    for (size_t i = 0; i < STORE_SHARDS; i += 1) {
+        pthread_mutex_lock(&(store->shards[i].lock));
+        struct slab_stats stats = slab_stats(&(store->shards[i].allocator));
+        pthread_mutex_unlock(&(store->shards[i].lock));
+
+        total.bytes_live += stats.bytes_live;
+        total.bytes_wasted += stats.bytes_wasted;
+        total.n_slabs += stats.n_slabs;
+        total.bytes_large += stats.bytes_large;
+    }
+    return total;
 }
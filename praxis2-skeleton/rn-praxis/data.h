@@ -1,40 +1,226 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include "slab.h"
 #include "util.h"
 
+#define STORE_SHARDS 64
+#define DEFAULT_SPILL_THRESHOLD (1 << 20)
+
+struct journal;
+
+
+/**
+ * A stored value
+ *
+ * Values are reference counted, so readers can keep using a value after
+ * releasing the store's lock while it is overwritten or deleted. The store
+ * holds one reference itself as long as the value is current.
+ *
+ * `references`: number of holders, the value is freed when it drops to zero
+ * `shard`: index of the shard whose allocator owns the value
+ * `length`: number of bytes in `data`, or in `file`
+ * `capacity`: usable size of the chunk holding the value, including this header
+ * `file`: unlinked temporary file holding large values instead of `data`, or -1
+ * `handed_over`: whether the value was handed over by the key's previous
+ *                owner rather than written to the local node
+ */
+struct value {
+    atomic_uint references;
+    uint32_t shard;
+    size_t length;
+    size_t capacity;
+    int file;
+    bool handed_over;
+    char data[];
+};
+
 /**
  * A simple key-value entry
  *
- * Provides a simple, inefficient, key-value when combined with `get()`,
- * `set()`, and `delete()`.
+ * `hash` caches the table hash of `key`, so probing and growing the table
+ * never rehash keys. `position` caches the key's position in the ring, see
+ * `store->position`. Slots with `key == NULL` are empty. Keys and values
+ * are chunks of the shard's slab allocator.
  */
 struct tuple {
     string key;
-    char* value;
-    size_t value_length;
+    struct value* value;
+    uint64_t hash;
+    uint16_t position;
+};
+
+/**
+ * One independently locked part of the store
+ *
+ * Uses linear probing with backward-shift deletion, so there are no
+ * tombstones and lookups stay O(1) independent of the number of deletes.
+ * The table doubles in size before exceeding a load factor of 3/4.
+ *
+ * `lock`: guards all other members
+ * `tuples`: the slots, `capacity` many
+ * `capacity`: number of slots, always a power of two
+ * `n_tuples`: number of occupied slots
+ * `allocator`: memory for keys and values
+ */
+struct store_shard {
+    pthread_mutex_t lock;
+    struct tuple* tuples;
+    size_t capacity;
+    size_t n_tuples;
+    struct slab_allocator allocator;
+};
+
+/**
+ * Key-value store backed by open-addressing hash tables
+ *
+ * Keys are spread over `STORE_SHARDS` shards by the upper bits of their
+ * hash, so concurrent workers rarely contend for the same lock.
+ *
+ * `spill_threshold`: values allocated with `value_alloc()` above this
+ *                    length are kept in temporary files
+ * `spill_directory`: directory the temporary files are created in
+ * `position`: maps keys to their position in the ring, computed once when a
+ *             key is added; positions are 0 if NULL
+ * `journal`: log all writes are passed to, NULL if the store is not persisted
+ */
+struct store {
+    struct store_shard shards[STORE_SHARDS];
+    size_t spill_threshold;
+    const char* spill_directory;
+    uint16_t (*position)(const char* key);
+    struct journal* journal;
+};
+
+/**
+ * A key and its value, as handed out by `store_collect()`
+ */
+struct store_entry {
+    string key;
+    struct value* value;
 };
 
 /**
- * Get the value matching the key in an array of tuples
+ * Initialize an empty store with room for at least `capacity` entries
+ */
+void store_init(struct store* store, size_t capacity);
+
+/**
+ * Get the value matching the key in the store
  *
  * Returns a pointer to the begin of the value, stores its length in `value_length`.
+ * The value remains valid until it is handed back to `release()`.
+ */
+const char* get(const string key, struct store* store, size_t* value_length);
+
+/**
+ * Get the ring position recorded for the key, see `store->position`
+ *
+ * Returns false if the key is not in the store.
+ */
+bool get_position(const string key, struct store* store, uint16_t* position);
+
+/**
+ * Release a value returned by `get()`
+ */
+void release(struct store* store, const char* value);
+
+/**
+ * Set the value for the key in the store
+ *
+ * Returns true if a value was overwritten, false if it was created.
+ */
+bool set(const string key, char* value, size_t value_length, struct store* store);
+
+
+/**
+ * Allocate a value of `value_length` bytes for the key, to be filled by the caller
+ *
+ * Lets large values be received in place instead of being copied. Values
+ * above the store's spill threshold are backed by a temporary file, the
+ * caller writes to `file` instead of `data` then. The value is passed to
+ * `set_value()` or dropped with `release()`.
+ *
+ * Returns NULL if the temporary file cannot be created.
  */
-const char* get(const string key, struct tuple* tuples, size_t n_tuples, size_t* value_length);
+struct value* value_alloc(const string key, size_t value_length, struct store* store);
 
 /**
- * Set the value for the key in an array of tuples
+ * Set a value obtained from `value_alloc()` for the same key in the store
  *
+ * The store takes over the caller's reference.
  * Returns true if a value was overwritten, false if it was created.
  */
-bool set(const string key, char* value, size_t value_length, struct tuple* tuples, size_t n_tuples);
+bool set_value(const string key, struct value* value, struct store* store);
+
+/**
+ * Set the value for the key as handed over by the key's previous owner
+ *
+ * Applies only if the key is missing or its value was handed over as well,
+ * so writes the local node received since it took the key over win.
+ * Returns true if the value was applied.
+ */
+bool set_handed_over(const string key, char* value, size_t value_length, struct store* store);
+
+/**
+ * Like `set_handed_over()`, for a value obtained from `value_alloc()`
+ *
+ * The store takes over the caller's reference, or drops it if the value is
+ * not applied.
+ */
+bool set_value_handed_over(const string key, struct value* value, struct store* store);
+
+/**
+ * Descriptor of the file backing a value returned by `get()`, or -1 if it is held in memory
+ */
+int value_file(const char* value);
 
 
 /**
- * Deletes the key in the array of tuples.
+ * Deletes the key in the store.
  *
  * Returns true if it existed.
  */
-bool delete(const string key, struct tuple* tuples, size_t n_tuples);
+bool delete(const string key, struct store* store);
+
+/**
+ * Delete the key as handed over by its previous owner
+ *
+ * Only a value handed over itself is deleted, see `set_handed_over()`.
+ * Returns true if the key was deleted.
+ */
+bool delete_handed_over(const string key, struct store* store);
+
+/**
+ * Copy the keys of shard `index` and take a reference to each of their values
+ *
+ * Lets the store be walked without holding a lock for long. Returns the
+ * number of entries, stored in `*entries` allocated with malloc(). The
+ * caller frees the keys and hands the values back to `release()`.
+ */
+size_t store_collect(struct store* store, size_t index, struct store_entry** entries);
+
+/**
+ * Copy the keys whose position lies in the ring interval (`from`, `to`]
+ *
+ * The whole ring if `from` equals `to`. Keys are in ring order, starting
+ * after `from`, so a range is handed over in the order lookups split it. Returns the
+ * number of keys, stored in `*keys` allocated with malloc(); the caller
+ * frees them and each key.
+ */
+size_t store_range(struct store* store, uint16_t from, uint16_t to, string** keys);
+
+/**
+ * Number of keys in the store
+ */
+size_t store_size(struct store* store);
+
+/**
+ * Statistics of the memory holding keys and values, summed over all shards
+ */
+struct slab_stats store_stats(struct store* store);
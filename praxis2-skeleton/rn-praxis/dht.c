@@ -0,0 +1,1302 @@
+/**
+ * This file implements the Chord-like DHT: responsibility checks, handling of
+ * Lookup and Reply messages, asynchronous lookups with retransmission, a
+ * cache of lookup results, finger table routing, and ring membership:
+ * nodes join through any member of the ring and periodically stabilize
+ * their successor, which answers with its predecessor and its successor
+ * list. A successor that falls silent is replaced by the next one of the
+ * list.
+ *
+ * Messages are received and sent in batches: the socket is drained with
+ * recvmmsg(), and the messages sent while handling them are collected and
+ * passed to the kernel with a single sendmmsg().
+ */
+
+#define _GNU_SOURCE  // recvmmsg(), sendmmsg()
+
+#include "dht.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifndef DHT_FAST_HASH
+#include <openssl/sha.h>
+#endif
+
+#include "logger.h"
+#include "metrics.h"
+#include "util.h"
+
+
+#ifdef DHT_FAST_HASH
+
+__extension__ typedef unsigned __int128 uint128;
+
+#define WY_P0 0xa0761d6478bd642full
+#define WY_P1 0xe7037ed1a0b428dbull
+
+
+/**
+ * Multiply to 128 bits and fold the halves, the mixing step of wyhash
+ */
+static uint64_t wymix(uint64_t a, uint64_t b) {
+    uint128 product = (uint128) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+
+static uint64_t read64(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+
+static uint64_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+
+/**
+ * wyhash-style hash of `length` bytes: 16 bytes are mixed per multiplication
+ */
+static uint64_t wyhash(const uint8_t* p, size_t length) {
+    uint64_t seed = WY_P0;
+    uint64_t a, b;
+    if (length <= 16) {
+        if (length >= 4) {
+            a = (read32(p) << 32) | read32(p + ((length >> 3) << 2));
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - ((length >> 3) << 2));
+        } else if (length > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t remaining = length;
+        for (; remaining > 16; remaining -= 16, p += 16) {
+            seed = wymix(read64(p) ^ WY_P1, read64(p + 8) ^ seed);
+        }
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
+    }
+    uint128 product = (uint128) (a ^ WY_P1) * (b ^ seed);
+    return wymix((uint64_t) product ^ WY_P0 ^ length, (uint64_t) (product >> 64) ^ WY_P1);
+}
+
+
+uint16_t hash(const char* str) {
+    return wyhash((const uint8_t*) str, strlen(str)) >> 48;
+}
+
+#else
+
+uint16_t hash(const char* str){ //Copied from Aufgabenblatt
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256((uint8_t *)str, strlen(str), digest);
+    return htons(*((uint16_t *)digest)); // We only use the first two bytes here
+}
+
+#endif
+
+
+/**
+ * A recently hashed string
+ *
+ * `tag`: FNV-1a hash of `key`, compared before the key itself
+ * `used`: value of the memo's clock when last used, 0 if the entry is empty
+ */
+struct memo_entry {
+    uint64_t tag;
+    uint64_t used;
+    uint16_t hash;
+    char key[HASH_MEMO_KEY_SIZE];
+};
+
+
+/**
+ * Set-associative memo of `hash()`, one per thread so it needs no locking
+ *
+ * Strings are mapped to a set by their tag, within a set the least recently
+ * used entry is replaced.
+ */
+static _Thread_local struct {
+    struct memo_entry sets[HASH_MEMO_SETS][HASH_MEMO_WAYS];
+    uint64_t clock;
+} memo;
+
+
+bool hash_memo_find(const char* str, uint16_t* value) {
+    if (strnlen(str, HASH_MEMO_KEY_SIZE) == HASH_MEMO_KEY_SIZE) {
+        return false;  // never memoized
+    }
+
+    uint64_t tag = fnv1a(str);
+    struct memo_entry* set = memo.sets[tag % HASH_MEMO_SETS];
+    for (size_t i = 0; i < HASH_MEMO_WAYS; i += 1) {
+        if (set[i].used && set[i].tag == tag && strcmp(set[i].key, str) == 0) {
+            memo.clock += 1;
+            set[i].used = memo.clock;
+            *value = set[i].hash;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void hash_memo_insert(const char* str, uint16_t value) {
+    size_t length = strnlen(str, HASH_MEMO_KEY_SIZE);
+    if (length == HASH_MEMO_KEY_SIZE) {
+        return;  // too long to be kept
+    }
+
+    uint64_t tag = fnv1a(str);
+    struct memo_entry* set = memo.sets[tag % HASH_MEMO_SETS];
+    struct memo_entry* victim = &set[0];
+    for (size_t i = 1; i < HASH_MEMO_WAYS; i += 1) {
+        if (set[i].used < victim->used) {
+            victim = &set[i];
+        }
+    }
+
+    memo.clock += 1;
+    victim->tag = tag;
+    victim->used = memo.clock;
+    victim->hash = value;
+    memcpy(victim->key, str, length + 1);
+}
+
+
+uint16_t hash_cached(const char* str) {
+#ifdef DHT_FAST_HASH
+    return hash(str);
+#else
+    uint16_t value;
+    if (!hash_memo_find(str, &value)) {
+        value = hash(str);
+        hash_memo_insert(str, value);
+    }
+    return value;
+#endif
+}
+
+
+bool in_range(uint16_t value, uint16_t from, uint16_t to) {
+    if (from < to) {
+        return from < value && value <= to;
+    }
+    // The interval wraps around zero, or covers the full ring if from == to
+    return from < value || value <= to;
+}
+
+
+bool dht_responsible(struct dht* dht, uint16_t hash) {
+    if (dht->node == NULL) {
+        return true;
+    }
+    int pred_id = atomic_load_explicit(&(dht->pred_id), memory_order_relaxed);
+    return pred_id != -1 && in_range(hash, pred_id, dht->node->id);
+}
+
+
+bool dht_replicates(struct dht* dht, uint16_t hash, size_t n_replicas) {
+    if (dht->node == NULL) {
+        return true;
+    }
+
+    pthread_mutex_lock(&(dht->lock));
+    bool replicated = true;
+    for (size_t i = 0; i <= n_replicas && i < dht->n_predecessors; i += 1) {
+        if (dht->predecessors[i].id == dht->node->id) {
+            break;  // wrapped around the ring
+        }
+        if (i == n_replicas) {
+            replicated = in_range(hash, dht->predecessors[i].id, dht->node->id);
+        }
+    }
+    pthread_mutex_unlock(&(dht->lock));
+    return replicated;
+}
+
+
+/**
+ * Format the authority of a node whose `ip` and `port` are set
+ */
+static void node_describe(Node* node) {
+    snprintf(node->authority, sizeof(node->authority), "%s:%u", node->ip, node->port);
+}
+
+
+Node* initialize(const char* ip, uint16_t port, uint16_t id){
+    Node* node = (Node*)calloc(1, sizeof(Node));
+    if(node != NULL){
+        snprintf(node->ip, sizeof(node->ip), "%s", ip);
+        node->port = port;
+        node->id = id;
+        node->addr = (struct sockaddr_in) {
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+        };
+        inet_pton(AF_INET, ip, &(node->addr.sin_addr));
+        node_describe(node);
+        node->pred = NULL;
+        node->succ = NULL;
+    }
+    return node;
+}
+
+
+int udp_node_socket(struct sockaddr_in addr){
+    const int enable = 1;
+
+
+    // Create a socket
+    int sockDgram = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockDgram == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    // Set the SO_REUSEADDR socket option to allow reuse of local addresses
+    if (setsockopt(sockDgram, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    // Bursts of Lookups arrive faster than one batch is handled, the default buffer drops them
+    const int rcvbuf = DHT_RCVBUF;
+    if (setsockopt(sockDgram, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    // Bind socket to the provided address
+    if (bind(sockDgram, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(sockDgram);
+        exit(EXIT_FAILURE);
+    }
+
+
+    return sockDgram;
+}
+
+
+/**
+ * Messages passed to or from the kernel in one call
+ *
+ * Each header refers to the message and address at its index, so they are
+ * set up once and only `n` changes.
+ *
+ * `n`: number of messages queued for sending
+ */
+struct message_batch {
+    Message messages[DHT_BATCH];
+    struct sockaddr_in addresses[DHT_BATCH];
+    struct iovec parts[DHT_BATCH];
+    struct mmsghdr headers[DHT_BATCH];
+    size_t n;
+};
+
+
+static struct message_batch* batch_new(void) {
+    struct message_batch* batch = calloc(1, sizeof(struct message_batch));
+    if (batch == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < DHT_BATCH; i += 1) {
+        batch->parts[i] = (struct iovec) {&(batch->messages[i]), sizeof(Message)};
+        batch->headers[i].msg_hdr = (struct msghdr) {
+            .msg_name = &(batch->addresses[i]),
+            .msg_namelen = sizeof(struct sockaddr_in),
+            .msg_iov = &(batch->parts[i]),
+            .msg_iovlen = 1,
+        };
+    }
+    return batch;
+}
+
+
+/**
+ * A message of type `flag` carrying `hash` and `peer`
+ */
+static Message message_new(uint8_t flag, uint16_t hash, const Node* peer) {
+    return (Message) {
+        .flag = flag,
+        .hash = htons(hash),
+        .id = htons(peer->id),
+        .ip = peer->addr.sin_addr.s_addr,
+        .port = peer->addr.sin_port,
+    };
+}
+
+
+/**
+ * Send a message to `to` right away, may be called from any thread
+ */
+static void send_message(struct dht* dht, const struct sockaddr_in* to, const Message* msg) {
+    if (sendto(dht->sock, msg, sizeof(*msg), 0, (const struct sockaddr*) to, sizeof(*to)) == -1) {
+        perror("sendto");
+    }
+    metrics_message(true, msg->flag);
+}
+
+
+/**
+ * Pass all queued messages to the kernel
+ *
+ * Messages the socket has no room for are dropped like lost datagrams,
+ * Lookups are retransmitted anyway.
+ */
+static void flush_messages(struct dht* dht) {
+    struct message_batch* outbox = dht->outbox;
+    size_t sent = 0;
+    while (sent < outbox->n) {
+        int n = sendmmsg(dht->sock, outbox->headers + sent, outbox->n - sent, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("sendmmsg");
+            break;
+        }
+        sent += n;
+    }
+    outbox->n = 0;
+}
+
+
+/**
+ * Queue a message to `to` until the next `flush_messages()`
+ *
+ * Only used on the thread handling messages and timers, which owns the outbox.
+ */
+static void queue_message(struct dht* dht, const struct sockaddr_in* to, const Message* msg) {
+    struct message_batch* outbox = dht->outbox;
+    if (outbox->n == DHT_BATCH) {
+        flush_messages(dht);
+    }
+    outbox->messages[outbox->n] = *msg;
+    outbox->addresses[outbox->n] = *to;
+    outbox->n += 1;
+    metrics_message(true, msg->flag);
+}
+
+
+/**
+ * Address of the peer a message refers to
+ */
+static struct sockaddr_in message_sockaddr(const Message* msg) {
+    return (struct sockaddr_in) {
+        .sin_family = AF_INET,
+        .sin_port = msg->port,
+        .sin_addr.s_addr = msg->ip,
+    };
+}
+
+
+/**
+ * The peer a message refers to
+ */
+static Node message_peer(const Message* msg) {
+    Node peer = {
+        .id = ntohs(msg->id),
+        .port = ntohs(msg->port),
+        .addr = message_sockaddr(msg),
+    };
+    inet_ntop(AF_INET, &msg->ip, peer.ip, sizeof(peer.ip));
+    node_describe(&peer);
+    return peer;
+}
+
+
+/**
+ * Make `peer` the predecessor or successor in `*neighbor`
+ *
+ * Cached lookup results may be outdated once the ring changed, so they are
+ * dropped. The caller holds the lock.
+ */
+static void set_neighbor(struct dht* dht, Node** neighbor, const Node* peer) {
+    if (*neighbor == NULL) {
+        *neighbor = malloc(sizeof(Node));
+        if (*neighbor == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    **neighbor = *peer;
+    (*neighbor)->pred = NULL;
+    (*neighbor)->succ = NULL;
+    dht->n_cached = 0;
+
+    bool pred = neighbor == &(dht->node->pred);
+    if (pred) {
+        atomic_store(&(dht->pred_id), peer->id);
+        dht->pred_heard = monotonic_ms();
+    } else {
+        dht->succ_heard = monotonic_ms();
+    }
+    logger_printf("%s is now %u at %s\n", pred ? "Predecessor" : "Successor", peer->id, peer->authority);
+}
+
+
+/**
+ * Make `peer` the successor, keeping the successor list consistent
+ *
+ * If `peer` is in the list already, the entries before it are dropped, as
+ * on a failover. Otherwise it joined in between and is put in front. The
+ * caller holds the lock.
+ */
+static void set_successor(struct dht* dht, const Node* peer) {
+    Node successor = *peer;  // `peer` may point into the list
+    size_t found = 0;
+    while (found < dht->n_successors && dht->successors[found].id != successor.id) {
+        found += 1;
+    }
+
+    if (found < dht->n_successors) {
+        dht->n_successors -= found;
+        memmove(dht->successors, dht->successors + found, dht->n_successors * sizeof(Node));
+    } else {
+        if (dht->n_successors == DHT_SUCCESSORS) {
+            dht->n_successors -= 1;
+        }
+        memmove(dht->successors + 1, dht->successors, dht->n_successors * sizeof(Node));
+        dht->n_successors += 1;
+    }
+    dht->successors[0] = successor;
+    set_neighbor(dht, &(dht->node->succ), &successor);
+}
+
+
+/**
+ * Make `peer` the predecessor, keeping the predecessor list consistent
+ *
+ * Like `set_successor()`: entries before `peer` are dropped if it is in the
+ * list already, as when the predecessor failed, otherwise it joined in
+ * between and is put in front. The caller holds the lock.
+ */
+static void set_predecessor(struct dht* dht, const Node* peer) {
+    Node predecessor = *peer;
+    size_t found = 0;
+    while (found < dht->n_predecessors && dht->predecessors[found].id != predecessor.id) {
+        found += 1;
+    }
+
+    if (found < dht->n_predecessors) {
+        dht->n_predecessors -= found;
+        memmove(dht->predecessors, dht->predecessors + found, dht->n_predecessors * sizeof(Node));
+    } else {
+        if (dht->n_predecessors == DHT_PREDECESSORS) {
+            dht->n_predecessors -= 1;
+        }
+        memmove(dht->predecessors + 1, dht->predecessors, dht->n_predecessors * sizeof(Node));
+        dht->n_predecessors += 1;
+    }
+    dht->predecessors[0] = predecessor;
+    set_neighbor(dht, &(dht->node->pred), &predecessor);
+}
+
+
+/**
+ * Stop routing through the node with `id`, which did not answer in time
+ *
+ * Its fingers are refreshed by the next maintenance rounds. The caller holds
+ * the lock.
+ */
+static void forget_fingers(struct dht* dht, uint16_t id) {
+    for (size_t i = 0; i < DHT_FINGERS; i += 1) {
+        if (dht->fingers[i].valid && dht->fingers[i].node.id == id) {
+            dht->fingers[i].valid = false;
+        }
+    }
+}
+
+
+/**
+ * Replace the successor by the next entry of the successor list
+ *
+ * Without another entry the successor is kept, it is the only candidate.
+ * The caller holds the lock.
+ */
+static void fail_successor(struct dht* dht) {
+    Node* succ = dht->node->succ;
+    if (dht->n_successors < 2) {
+        return;
+    }
+    logger_printf("Successor %u at %s failed\n", succ->id, succ->authority);
+    forget_fingers(dht, succ->id);
+    set_successor(dht, &(dht->successors[1]));
+}
+
+
+/**
+ * Whether a neighbor last heard of at `heard` is considered failed by `now`
+ */
+static bool silent(const struct dht* dht, uint64_t heard, uint64_t now) {
+    return now - heard > (uint64_t) DHT_FAILURE_ROUNDS * dht->period;
+}
+
+
+static bool same_address(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+
+/**
+ * The node to forward a Lookup for `hash` to
+ *
+ * That is the finger closest to, but not past `hash`, falling back to the
+ * successor. Every hop thereby at least halves the remaining distance.
+ * The caller holds the lock.
+ */
+static const Node* next_hop(const struct dht* dht, uint16_t hash) {
+    const Node* node = dht->node;
+    for (size_t i = DHT_FINGERS; i > 0; i -= 1) {
+        const struct finger* finger = &(dht->fingers[i - 1]);
+        if (finger->valid && in_range(finger->node.id, node->id, hash)) {
+            return &(finger->node);
+        }
+    }
+    return node->succ;
+}
+
+
+static void arm_timer(struct dht* dht, bool arm) {
+    if (dht->timer_armed == arm) {
+        return;
+    }
+    struct itimerspec spec = {0};
+    if (arm) {
+        spec.it_interval.tv_nsec = DHT_TICK_MS * 1000000L;
+        spec.it_value = spec.it_interval;
+    }
+    if (timerfd_settime(dht->timer, 0, &spec, NULL) == -1) {
+        perror("timerfd_settime");
+        exit(EXIT_FAILURE);
+    }
+    dht->timer_armed = arm;
+}
+
+
+/**
+ * Arm `maintenance` to expire once, after 3/4 to 5/4 of `period`
+ */
+static void arm_maintenance(struct dht* dht) {
+    unsigned ms = dht->period * 3 / 4 + rand_r(&(dht->seed)) % (dht->period / 2 + 1);
+    if (ms == 0) {
+        ms = 1;  // zero would disarm the timer
+    }
+    struct itimerspec spec = {
+        .it_value.tv_sec = ms / 1000,
+        .it_value.tv_nsec = (ms % 1000) * 1000000L,
+    };
+    if (timerfd_settime(dht->maintenance, 0, &spec, NULL) == -1) {
+        perror("timerfd_settime");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * Hand all waiters of `entry` back, with `responsible` if it was found
+ */
+static void notify_waiters(struct dht* dht, struct pending_lookup* entry, const Node* responsible) {
+    struct lookup_waiter* waiter = entry->waiters;
+    entry->waiters = NULL;
+    while (waiter) {
+        struct lookup_waiter* next = waiter->next;
+        waiter->found = responsible != NULL;
+        if (responsible) {
+            waiter->responsible = *responsible;
+        }
+        dht->notify(waiter);
+        waiter = next;
+    }
+}
+
+
+/**
+ * Index of the first cache entry with `low` greater than `hash`
+ */
+static size_t cache_upper_bound(const struct dht* dht, uint16_t hash) {
+    size_t low = 0;
+    size_t high = dht->n_cached;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (dht->cache[middle].low <= hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+
+/**
+ * The unexpired cache entry covering `hash`, or NULL
+ */
+static const struct cached_range* cache_find(const struct dht* dht, uint16_t hash, uint64_t now) {
+    size_t index = cache_upper_bound(dht, hash);
+    if (index == 0) {
+        return NULL;
+    }
+    const struct cached_range* range = &(dht->cache[index - 1]);
+    if (hash > range->high || range->expiry <= now) {
+        return NULL;
+    }
+    return range;
+}
+
+
+static void cache_remove(struct dht* dht, size_t index) {
+    memmove(&(dht->cache[index]), &(dht->cache[index + 1]), (dht->n_cached - index - 1) * sizeof(struct cached_range));
+    dht->n_cached -= 1;
+}
+
+
+/**
+ * Cache that `responsible` is responsible for [`low`, `high`]
+ *
+ * Entries overlapping the range are outdated and dropped. If the cache is
+ * full, expired entries are dropped, or else the one expiring first.
+ */
+static void cache_insert(struct dht* dht, uint16_t low, uint16_t high, const Node* responsible, uint64_t now) {
+    for (size_t i = 0; i < dht->n_cached; ) {
+        const struct cached_range* range = &(dht->cache[i]);
+        if ((range->low <= high && low <= range->high) || range->expiry <= now) {
+            cache_remove(dht, i);
+        } else {
+            i += 1;
+        }
+    }
+
+    if (dht->n_cached == DHT_CACHE_SIZE) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < dht->n_cached; i += 1) {
+            if (dht->cache[i].expiry < dht->cache[oldest].expiry) {
+                oldest = i;
+            }
+        }
+        cache_remove(dht, oldest);
+    }
+
+    size_t index = cache_upper_bound(dht, low);
+    memmove(&(dht->cache[index + 1]), &(dht->cache[index]), (dht->n_cached - index) * sizeof(struct cached_range));
+    dht->cache[index] = (struct cached_range) {
+        .low = low,
+        .high = high,
+        .expiry = now + DHT_CACHE_TTL_MS,
+        .responsible = *responsible,
+    };
+    dht->n_cached += 1;
+}
+
+
+/**
+ * Remove `entry` from the pending table, `prev` precedes it in `pending_list`
+ */
+static void remove_pending(struct dht* dht, struct pending_lookup* prev, struct pending_lookup* entry) {
+    if (prev) {
+        prev->next = entry->next;
+    } else {
+        dht->pending_list = entry->next;
+    }
+    dht->pending[entry->hash] = NULL;
+    dht->n_pending -= 1;
+    free(entry);
+}
+
+
+void dht_init(struct dht* dht, Node* node, int sock, void (*notify)(struct lookup_waiter* waiter)) {
+    memset(dht, 0, sizeof(*dht));
+    dht->node = node;
+    dht->sock = sock;
+    dht->notify = notify;
+    dht->inbox = batch_new();
+    dht->outbox = batch_new();
+    dht->period = DHT_MAINTENANCE_MS;
+    dht->seed = monotonic_us() ^ (node ? node->id : 0);
+    atomic_init(&(dht->pred_id), node && node->pred ? node->pred->id : -1);
+    if (node && node->succ) {
+        dht->successors[0] = *(node->succ);
+        dht->n_successors = 1;
+    }
+    if (node && node->pred) {
+        dht->predecessors[0] = *(node->pred);
+        dht->n_predecessors = 1;
+    }
+    dht->succ_heard = dht->pred_heard = monotonic_ms();
+    pthread_mutex_init(&(dht->lock), NULL);
+
+    dht->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    dht->maintenance = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (dht->timer == -1 || dht->maintenance == -1) {
+        perror("timerfd_create");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; node && i < DHT_FINGERS; i += 1) {
+        dht->fingers[i].start = node->id + (1u << i);
+    }
+}
+
+
+void dht_start_maintenance(struct dht* dht, unsigned period) {
+    dht->period = period;
+    dht->succ_heard = dht->pred_heard = monotonic_ms();
+    arm_maintenance(dht);
+}
+
+
+void dht_join(struct dht* dht, const Node* anchor) {
+    dht->anchor = *anchor;
+    Message join = message_new(FLAG_JOIN, 0, dht->node);
+    send_message(dht, &(anchor->addr), &join);
+}
+
+
+bool dht_lookup(struct dht* dht, uint16_t hash, Node* responsible, struct lookup_waiter* waiter) {
+    pthread_mutex_lock(&(dht->lock));
+
+    const Node* succ = dht->node->succ;
+    if (succ && in_range(hash, dht->node->id, succ->id)) {
+        // The successor is responsible, no lookup needed
+        *responsible = *succ;
+        pthread_mutex_unlock(&(dht->lock));
+        return true;
+    }
+
+    const struct cached_range* range = cache_find(dht, hash, monotonic_ms());
+    if (range) {
+        *responsible = range->responsible;
+        pthread_mutex_unlock(&(dht->lock));
+        return true;
+    }
+
+    struct pending_lookup* entry = dht->pending[hash];
+
+    if (!entry && succ && dht->n_pending < DHT_MAX_PENDING) {
+        entry = calloc(1, sizeof(struct pending_lookup));
+    }
+    if (!entry || !succ) {  // too many lookups in flight, or not part of the ring yet: give up right away
+        pthread_mutex_unlock(&(dht->lock));
+        if (waiter) {
+            waiter->found = false;
+            dht->notify(waiter);
+        }
+        return false;
+    }
+
+    if (entry->attempts == 0) {
+        entry->hash = hash;
+        entry->attempts = 1;
+        entry->started = monotonic_us();
+        entry->deadline = monotonic_ms() + DHT_LOOKUP_TIMEOUT_MS;
+        entry->next = dht->pending_list;
+        dht->pending_list = entry;
+        dht->pending[hash] = entry;
+        dht->n_pending += 1;
+
+        const Node* hop = next_hop(dht, hash);
+        entry->via = hop->id;
+        Message msg = message_new(FLAG_LOOKUP, hash, dht->node);
+        send_message(dht, &(hop->addr), &msg);
+        atomic_fetch_add(&(dht->n_sent), 1);
+        arm_timer(dht, true);
+    }
+    if (waiter) {
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+    }
+
+    pthread_mutex_unlock(&(dht->lock));
+    return false;
+}
+
+
+/**
+ * Answer a Lookup if the successor is responsible, forward it otherwise
+ */
+static void handle_lookup(struct dht* dht, const Message* msg) {
+    Node* node = dht->node;
+    uint16_t hash = ntohs(msg->hash);
+    struct sockaddr_in origin = message_sockaddr(msg);
+
+    if (node->succ == NULL) {
+        return;  // not part of the ring yet
+    }
+
+    if (in_range(hash, node->id, node->succ->id)) {
+        Message reply = message_new(FLAG_REPLY, node->id, node->succ);
+        queue_message(dht, &origin, &reply);
+        atomic_fetch_add(&(dht->n_answered), 1);
+    } else if (node->pred && in_range(hash, node->pred->id, node->id)) {
+        Message reply = message_new(FLAG_REPLY, node->pred->id, node);
+        queue_message(dht, &origin, &reply);
+        atomic_fetch_add(&(dht->n_answered), 1);
+    } else {
+        atomic_fetch_add(&(dht->n_forwarded), 1);
+        pthread_mutex_lock(&(dht->lock));
+        queue_message(dht, &(next_hop(dht, hash)->addr), msg);
+        pthread_mutex_unlock(&(dht->lock));
+    }
+}
+
+
+/**
+ * Cache the range the replying node is responsible for, and update the
+ * fingers and resolve all lookups for hashes within it
+ *
+ * A Reply carries the responsible node and, as hash, the ID of its
+ * predecessor, so it covers the range (hash, responsible.id].
+ */
+static void handle_reply(struct dht* dht, const Message* msg) {
+    uint16_t from = ntohs(msg->hash);
+    Node responsible = message_peer(msg);
+    uint64_t now = monotonic_ms();
+
+    pthread_mutex_lock(&(dht->lock));
+
+    uint16_t low = from + 1;
+    if (from == responsible.id) {
+        cache_insert(dht, 0, UINT16_MAX, &responsible, now);
+    } else if (low <= responsible.id) {
+        cache_insert(dht, low, responsible.id, &responsible, now);
+    } else {  // wraps around zero
+        cache_insert(dht, low, UINT16_MAX, &responsible, now);
+        cache_insert(dht, 0, responsible.id, &responsible, now);
+    }
+
+    for (size_t i = 0; i < DHT_FINGERS; i += 1) {
+        if (in_range(dht->fingers[i].start, from, responsible.id)) {
+            dht->fingers[i].node = responsible;
+            dht->fingers[i].valid = true;
+        }
+    }
+
+    uint64_t resolved = monotonic_us();
+    struct pending_lookup* prev = NULL;
+    struct pending_lookup* entry = dht->pending_list;
+    while (entry) {
+        struct pending_lookup* next = entry->next;
+        if (in_range(entry->hash, from, responsible.id)) {
+            histogram_record(&(metrics.lookups), resolved - entry->started);
+            notify_waiters(dht, entry, &responsible);
+            remove_pending(dht, prev, entry);
+        } else {
+            prev = entry;
+        }
+        entry = next;
+    }
+    arm_timer(dht, dht->n_pending > 0);
+
+    pthread_mutex_unlock(&(dht->lock));
+}
+
+
+/**
+ * Adopt the sender of a Stabilize as predecessor if it is closer than the
+ * current one, or the current one fell silent, and tell it about the
+ * predecessor with a Notify and about the successors with Successor messages
+ *
+ * A node whose predecessor failed adopts even itself, when it is the last
+ * one left of the ring. Neighbors are only changed by the event loop, so
+ * they are read without the lock here.
+ */
+static void handle_stabilize(struct dht* dht, const Message* msg, uint64_t now) {
+    Node* node = dht->node;
+    Node peer = message_peer(msg);
+
+    bool failed = node->pred && silent(dht, dht->pred_heard, now);
+    if ((peer.id != node->id || failed) && (node->pred == NULL || failed || in_range(peer.id, node->pred->id, node->id))) {
+        pthread_mutex_lock(&(dht->lock));
+        if (failed && node->pred->id != peer.id) {
+            logger_printf("Predecessor %u at %s failed\n", node->pred->id, node->pred->authority);
+        }
+        set_predecessor(dht, &peer);
+        pthread_mutex_unlock(&(dht->lock));
+    }
+    if (node->pred) {
+        Message notify = message_new(FLAG_NOTIFY, 0, node->pred);
+        queue_message(dht, &(peer.addr), &notify);
+    }
+    for (size_t i = 0; i < dht->n_successors && i + 1 < DHT_SUCCESSORS; i += 1) {
+        Message successor = message_new(FLAG_SUCCESSOR, i, &(dht->successors[i]));
+        queue_message(dht, &(peer.addr), &successor);
+    }
+}
+
+
+/**
+ * Adopt the peer of a Notify as successor if it lies between the local node
+ * and the current successor
+ *
+ * A Notify answers a Stabilize with the successor's predecessor, or a Join
+ * with the node that accepted the joining one.
+ */
+static void handle_notify(struct dht* dht, const Message* msg) {
+    Node* node = dht->node;
+    Node peer = message_peer(msg);
+
+    if (peer.id == node->id) {
+        return;  // the successor already knows this node
+    }
+    if (node->succ == NULL || (peer.id != node->succ->id && in_range(peer.id, node->id, node->succ->id))) {
+        pthread_mutex_lock(&(dht->lock));
+        set_successor(dht, &peer);
+        pthread_mutex_unlock(&(dht->lock));
+    }
+}
+
+
+/**
+ * Take over an entry of the successor's successor list as the next one of
+ * the own list
+ *
+ * Entries are sent in order, one that does not continue the list, because
+ * an earlier one was lost, is ignored. The list ends where it wraps around
+ * to the local node.
+ */
+static void handle_successor(struct dht* dht, const Message* msg, const struct sockaddr_in* from) {
+    Node* node = dht->node;
+    size_t index = ntohs(msg->hash);
+    Node peer = message_peer(msg);
+
+    if (node->succ == NULL || !same_address(from, &(node->succ->addr))
+        || index + 1 >= DHT_SUCCESSORS || index + 1 > dht->n_successors) {
+        return;
+    }
+
+    pthread_mutex_lock(&(dht->lock));
+    if (peer.id == node->id) {
+        dht->n_successors = index + 1;
+    } else {
+        dht->successors[index + 1] = peer;
+        dht->n_successors = index + 2;
+    }
+    pthread_mutex_unlock(&(dht->lock));
+}
+
+
+/**
+ * Take over an entry of the predecessor's predecessor list as the next one
+ * of the own list
+ *
+ * Like `handle_successor()`, entries must continue the list, and it ends
+ * where it wraps around to the local node.
+ */
+static void handle_predecessor(struct dht* dht, const Message* msg, const struct sockaddr_in* from) {
+    Node* node = dht->node;
+    size_t index = ntohs(msg->hash);
+    Node peer = message_peer(msg);
+
+    if (node->pred == NULL || !same_address(from, &(node->pred->addr))
+        || index + 1 >= DHT_PREDECESSORS || index + 1 > dht->n_predecessors) {
+        return;
+    }
+
+    pthread_mutex_lock(&(dht->lock));
+    if (peer.id == node->id) {
+        dht->n_predecessors = index + 1;
+    } else {
+        dht->predecessors[index + 1] = peer;
+        dht->n_predecessors = index + 2;
+    }
+    pthread_mutex_unlock(&(dht->lock));
+}
+
+
+/**
+ * Note that the sender of a message is alive, if it is a neighbor
+ */
+static void heard_from(struct dht* dht, const struct sockaddr_in* from, uint64_t now) {
+    Node* node = dht->node;
+    if (node->succ && same_address(from, &(node->succ->addr))) {
+        dht->succ_heard = now;
+    }
+    if (node->pred && same_address(from, &(node->pred->addr))) {
+        dht->pred_heard = now;
+    }
+}
+
+
+/**
+ * Accept a joining node as predecessor if its ID falls into the local range,
+ * forward the Join towards the responsible node otherwise
+ *
+ * The accepted node learns its successor from the Notify it is sent, the
+ * former predecessor learns about it when stabilizing next. A node whose
+ * predecessor is unknown cannot tell whether it is responsible and passes
+ * the Join on; its hash counts the hops, so it is dropped instead of
+ * circling the ring, and repeated by the joining node later.
+ */
+static void handle_join(struct dht* dht, const Message* msg) {
+    Node* node = dht->node;
+    Node peer = message_peer(msg);
+
+    if (node->succ == NULL || peer.id == node->id) {
+        return;  // not part of the ring yet, or a Join of this node
+    }
+
+    if (node->pred && peer.id == node->pred->id) {
+        // Accepted before, the Notify may have been lost
+    } else if (node->pred && in_range(peer.id, node->pred->id, node->id)) {
+        pthread_mutex_lock(&(dht->lock));
+        set_predecessor(dht, &peer);
+        pthread_mutex_unlock(&(dht->lock));
+    } else {
+        uint16_t hops = ntohs(msg->hash) + 1;
+        if (hops < DHT_JOIN_MAX_HOPS) {
+            Message join = *msg;
+            join.hash = htons(hops);
+            pthread_mutex_lock(&(dht->lock));
+            queue_message(dht, &(next_hop(dht, peer.id)->addr), &join);
+            pthread_mutex_unlock(&(dht->lock));
+        }
+        return;
+    }
+
+    Message notify = message_new(FLAG_NOTIFY, 0, node);
+    queue_message(dht, &(peer.addr), &notify);
+}
+
+
+bool dht_is_neighbor(struct dht* dht, const struct in_addr* addr) {
+    if (dht->node == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&(dht->lock));
+    bool neighbor = false;
+    for (size_t i = 0; i < dht->n_predecessors && !neighbor; i += 1) {
+        neighbor = dht->predecessors[i].addr.sin_addr.s_addr == addr->s_addr;
+    }
+    for (size_t i = 0; i < dht->n_successors && !neighbor; i += 1) {
+        neighbor = dht->successors[i].addr.sin_addr.s_addr == addr->s_addr;
+    }
+    pthread_mutex_unlock(&(dht->lock));
+    return neighbor;
+}
+
+
+size_t dht_successors(struct dht* dht, Node* successors, size_t n) {
+    if (dht->node == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&(dht->lock));
+    size_t copied = 0;
+    for (size_t i = 0; i < dht->n_successors && copied < n; i += 1) {
+        if (dht->successors[i].id == dht->node->id) {
+            break;  // wrapped around the ring
+        }
+        successors[copied] = dht->successors[i];
+        copied += 1;
+    }
+    pthread_mutex_unlock(&(dht->lock));
+    return copied;
+}
+
+
+bool dht_predecessor(struct dht* dht, Node* pred) {
+    if (dht->node == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&(dht->lock));
+    bool known = dht->node->pred != NULL;
+    if (known) {
+        *pred = *(dht->node->pred);
+    }
+    pthread_mutex_unlock(&(dht->lock));
+    return known;
+}
+
+
+size_t dht_predecessors(struct dht* dht, Node* predecessors, size_t n) {
+    if (dht->node == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&(dht->lock));
+    size_t copied = 0;
+    for (size_t i = 0; i < dht->n_predecessors && copied < n; i += 1) {
+        if (dht->predecessors[i].id == dht->node->id) {
+            break;  // wrapped around the ring
+        }
+        predecessors[copied] = dht->predecessors[i];
+        copied += 1;
+    }
+    pthread_mutex_unlock(&(dht->lock));
+    return copied;
+}
+
+
+void dht_invalidate(struct dht* dht) {
+    pthread_mutex_lock(&(dht->lock));
+    dht->n_cached = 0;
+    pthread_mutex_unlock(&(dht->lock));
+}
+
+
+void dht_handle_messages(struct dht* dht) {
+    struct message_batch* inbox = dht->inbox;
+    int received;
+    do {
+        received = recvmmsg(dht->sock, inbox->headers, DHT_BATCH, 0, NULL);
+        uint64_t now = monotonic_ms();
+        for (int i = 0; i < received; i += 1) {
+            const Message* msg = &(inbox->messages[i]);
+            const struct sockaddr_in* from = &(inbox->addresses[i]);
+            if (inbox->headers[i].msg_len != sizeof(*msg) || dht->node == NULL) {
+                continue;  // not a DHT message, or not part of a DHT
+            }
+            metrics_message(false, msg->flag);
+            heard_from(dht, from, now);
+            switch (msg->flag) {
+                case FLAG_LOOKUP:
+                    handle_lookup(dht, msg);
+                    break;
+                case FLAG_REPLY:
+                    handle_reply(dht, msg);
+                    break;
+                case FLAG_STABILIZE:
+                    handle_stabilize(dht, msg, now);
+                    break;
+                case FLAG_NOTIFY:
+                    handle_notify(dht, msg);
+                    break;
+                case FLAG_JOIN:
+                    handle_join(dht, msg);
+                    break;
+                case FLAG_SUCCESSOR:
+                    handle_successor(dht, msg, from);
+                    break;
+                case FLAG_PREDECESSOR:
+                    handle_predecessor(dht, msg, from);
+                    break;
+                default:
+                    break;
+            }
+        }
+        flush_messages(dht);
+    } while (received == DHT_BATCH);  // a partial batch drained the socket
+
+    if (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("recvmmsg");
+    }
+}
+
+
+/**
+ * Handle the timeout of a Lookup sent to the node with `id`
+ *
+ * A single lost datagram only costs the finger, which is refreshed soon. The
+ * successor is only given up if it did not answer the last Stabilize
+ * either. The caller holds the lock.
+ */
+static void suspect(struct dht* dht, uint16_t id, uint64_t now) {
+    forget_fingers(dht, id);
+    const Node* succ = dht->node->succ;
+    if (succ && succ->id == id && now - dht->succ_heard > dht->period) {
+        fail_successor(dht);
+    }
+}
+
+
+void dht_tick(struct dht* dht) {
+    uint64_t expirations;
+    if (read(dht->timer, &expirations, sizeof(expirations)) == -1) {
+        return;
+    }
+
+    uint64_t now = monotonic_ms();
+
+    pthread_mutex_lock(&(dht->lock));
+    struct pending_lookup* prev = NULL;
+    struct pending_lookup* entry = dht->pending_list;
+    while (entry) {
+        struct pending_lookup* next = entry->next;
+        if (entry->deadline > now) {
+            prev = entry;
+            entry = next;
+            continue;
+        }
+
+        suspect(dht, entry->via, now);
+        if (entry->attempts < DHT_LOOKUP_RETRIES) {
+            // Retransmit, backing off exponentially, possibly along another route
+            const Node* hop = next_hop(dht, entry->hash);
+            entry->via = hop->id;
+            Message msg = message_new(FLAG_LOOKUP, entry->hash, dht->node);
+            queue_message(dht, &(hop->addr), &msg);
+            atomic_fetch_add(&(dht->n_sent), 1);
+            entry->deadline = now + (DHT_LOOKUP_TIMEOUT_MS << entry->attempts);
+            entry->attempts += 1;
+            prev = entry;
+        } else {
+            // Lost: give up on waiting clients
+            atomic_fetch_add(&(metrics.lookups_failed), 1);
+            notify_waiters(dht, entry, NULL);
+            remove_pending(dht, prev, entry);
+        }
+        entry = next;
+    }
+    arm_timer(dht, dht->n_pending > 0);
+    pthread_mutex_unlock(&(dht->lock));
+    flush_messages(dht);
+}
+
+
+void dht_maintain(struct dht* dht) {
+    uint64_t expirations;
+    if (read(dht->maintenance, &expirations, sizeof(expirations)) == -1 || dht->node == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(dht->lock));
+    Node* node = dht->node;
+    if (node->succ && silent(dht, dht->succ_heard, monotonic_ms())) {
+        fail_successor(dht);
+    }
+    if (node->succ == NULL) {
+        Message join = message_new(FLAG_JOIN, 0, node);
+        queue_message(dht, &(dht->anchor.addr), &join);
+    } else {
+        Message stabilize = message_new(FLAG_STABILIZE, 0, node);
+        queue_message(dht, &(node->succ->addr), &stabilize);
+        for (size_t i = 0; i < dht->n_predecessors && i + 1 < DHT_PREDECESSORS; i += 1) {
+            Message predecessor = message_new(FLAG_PREDECESSOR, i, &(dht->predecessors[i]));
+            queue_message(dht, &(node->succ->addr), &predecessor);
+        }
+
+        struct finger* finger = &(dht->fingers[dht->next_finger]);
+        dht->next_finger = (dht->next_finger + 1) % DHT_FINGERS;
+
+        // Fingers in the range of the successor are known without asking
+        if (in_range(finger->start, node->id, node->succ->id)) {
+            finger->node = *(node->succ);
+            finger->valid = true;
+        } else if (!(node->pred && in_range(finger->start, node->pred->id, node->id))) {
+            Message msg = message_new(FLAG_LOOKUP, finger->start, node);
+            queue_message(dht, &(next_hop(dht, finger->start)->addr), &msg);
+            atomic_fetch_add(&(dht->n_sent), 1);
+        }
+    }
+    pthread_mutex_unlock(&(dht->lock));
+    flush_messages(dht);
+    arm_maintenance(dht);
+}
@@ -0,0 +1,382 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DHT_MAX_PENDING 1024
+#define DHT_LOOKUP_TIMEOUT_MS 200
+#define DHT_LOOKUP_RETRIES 3
+#define DHT_TICK_MS 50
+#define DHT_CACHE_SIZE 256
+#define DHT_CACHE_TTL_MS 30000
+#define DHT_FINGERS 16  // one per bit of the ID space
+#define DHT_MAINTENANCE_MS 500  // default period of stabilization and finger refreshes
+#define DHT_JOIN_MAX_HOPS 64  // Joins are dropped after this many forwards
+#define DHT_SUCCESSORS 4  // length of the successor list, the ring survives as many adjacent failures minus one
+#define DHT_PREDECESSORS (DHT_SUCCESSORS + 1)  // length of the predecessor list, bounds the ranges a node holds replicas of
+#define DHT_FAILURE_ROUNDS 3  // maintenance periods a neighbor may stay silent before it is considered failed
+#define DHT_BATCH 64  // messages received or sent per system call
+#define DHT_RCVBUF (1 << 20)  // receive buffer of the DHT socket, holds bursts arriving between two batches
+#define HASH_MEMO_SETS 256
+#define HASH_MEMO_WAYS 4
+#define HASH_MEMO_KEY_SIZE 104  // longer strings are not memoized; entries fill two cache lines
+
+
+/**
+ * A peer in the DHT
+ *
+ * `addr` and `authority` are derived from `ip` and `port` once, so sending
+ * to and redirecting to a peer needs no conversions. `pred` and `succ` are
+ * only set for the local node, and are NULL while unknown, i.e. until a
+ * joining node was accepted into the ring and was stabilized by its
+ * predecessor.
+ *
+ * `addr`: the peer's address for `sendto()`
+ * `authority`: "ip:port", as used in URLs
+ */
+typedef struct Node{
+    uint16_t id;
+    char ip[INET_ADDRSTRLEN];
+    uint16_t port;
+    struct sockaddr_in addr;
+    char authority[INET_ADDRSTRLEN + sizeof(":65535")];
+    struct Node* pred;
+    struct Node* succ;
+} Node;
+
+
+/**
+ * Message types, see `rn.lua`
+ *
+ * A Successor message carries an entry of the sender's successor list, the
+ * hash being its index. They follow the Notify answering a Stabilize.
+ * Predecessor messages carry the sender's predecessor list the same way,
+ * they follow each Stabilize.
+ */
+enum message_flag {
+    FLAG_LOOKUP = 0,
+    FLAG_REPLY = 1,
+    FLAG_STABILIZE = 2,
+    FLAG_NOTIFY = 3,
+    FLAG_JOIN = 4,
+    FLAG_SUCCESSOR = 5,
+    FLAG_PREDECESSOR = 6,
+};
+
+
+/**
+ * A DHT control message, all fields in network byte order
+ */
+typedef struct Message{
+    uint8_t flag;
+    uint16_t hash;
+    uint16_t id;
+    uint32_t ip;
+    uint16_t port;
+}__attribute__((packed)) Message;
+
+
+/**
+ * A client waiting for the outcome of a lookup
+ *
+ * Allocated by the caller of `dht_lookup()` and handed back through the
+ * `notify` callback of the DHT once the lookup completed or failed.
+ *
+ * `owner`, `sock`, `generation`: identify the waiting connection, opaque to the DHT
+ * `found`: whether `responsible` was determined
+ * `responsible`: the node responsible for the looked up hash
+ */
+struct lookup_waiter {
+    struct lookup_waiter* next;
+    void* owner;
+    int sock;
+    uint64_t generation;
+    bool found;
+    Node responsible;
+};
+
+
+/**
+ * A lookup in flight
+ *
+ * `started`: time the first Lookup was sent (microseconds, monotonic)
+ * `deadline`: time of the next retransmission (milliseconds, monotonic)
+ * `attempts`: number of Lookup messages sent so far
+ * `via`: ID of the node the last Lookup was sent to, suspected to have
+ *        failed if it times out
+ * `waiters`: clients to notify once the lookup completes
+ */
+struct pending_lookup {
+    struct pending_lookup* next;
+    uint16_t hash;
+    uint16_t via;
+    uint64_t started;
+    uint64_t deadline;
+    unsigned attempts;
+    struct lookup_waiter* waiters;
+};
+
+
+/**
+ * A lookup result: `responsible` is responsible for all hashes in [`low`, `high`]
+ *
+ * Ranges wrapping around zero are cached as two entries.
+ */
+struct cached_range {
+    uint16_t low;
+    uint16_t high;
+    uint64_t expiry;
+    Node responsible;
+};
+
+
+/**
+ * An entry of the finger table
+ *
+ * `node` is the first node succeeding `start` = own ID + 2^i on the ring,
+ * if `valid`.
+ */
+struct finger {
+    uint16_t start;
+    bool valid;
+    Node node;
+};
+
+
+/**
+ * State of the local DHT node
+ *
+ * All members except `node`, `sock` and `timer` are guarded by `lock`,
+ * lookups may be started from any worker. Messages and timer expirations
+ * are handled by a single event loop, which is also the only one changing
+ * the neighbors of `node`; it does so with `lock` held, so other threads
+ * read them with `lock` held as well.
+ *
+ * `node`: the local node, or NULL when running standalone
+ * `sock`: non-blocking UDP socket for all DHT messages
+ * `timer`: timerfd driving retransmissions while lookups are pending
+ * `maintenance`: timerfd driving stabilization and the refresh of
+ *                `fingers`, only armed by `dht_start_maintenance()`
+ * `period`: mean interval of `maintenance` in milliseconds, each one is
+ *           drawn from [3/4, 5/4] of it so nodes do not synchronize
+ * `seed`: state of the random jitter of `period`
+ * `anchor`: peer a joining node sends its Join to until it has a successor
+ * `pred_id`: ID of `node->pred`, or -1 while unknown; readable without
+ *            `lock`, so deciding whether a key is local takes no lock
+ * `successors`: the nodes following the local one, `successors[0]` being
+ *               `node->succ`. The rest is learned from the successor in
+ *               answer to every Stabilize, so the next one takes over when
+ *               the successor fails.
+ * `n_successors`: number of entries in `successors`
+ * `predecessors`: the nodes preceding the local one, nearest first,
+ *                 `predecessors[0]` being `node->pred`. The rest is learned
+ *                 from the predecessor with every Stabilize it sends, so a
+ *                 node knows whose keys it holds replicas of.
+ * `n_predecessors`: number of entries in `predecessors`
+ * `succ_heard`, `pred_heard`: time any message last arrived from the
+ *                             successor or predecessor (milliseconds,
+ *                             monotonic), only used by the event loop
+ * `pending`: lookups indexed by hash
+ * `pending_list`: all entries of `pending`
+ * `n_pending`: number of entries in `pending_list`
+ * `cache`: ranges learned from Reply messages, sorted by `low` and not
+ *          overlapping, so hashes are resolved by binary search
+ * `n_cached`: number of entries in `cache`
+ * `fingers`: shortcuts across the ring, Lookups are forwarded to the
+ *            closest finger preceding the hash
+ * `next_finger`: index of the finger refreshed next
+ * `notify`: called for every waiter once its lookup completed or failed
+ * `inbox`, `outbox`: messages received and to be sent in batches, only used
+ *                    by the event loop handling messages and timers
+ * `n_sent`: Lookups sent by this node, including retransmissions
+ * `n_forwarded`: Lookups received and passed on towards the responsible node
+ * `n_answered`: Lookups received and answered with a Reply
+ *
+ * Summed over the ring, (`n_forwarded` + `n_answered`) / `n_sent` is the
+ * average number of hops a Lookup takes.
+ */
+struct dht {
+    Node* node;
+    int sock;
+    int timer;
+    int maintenance;
+    unsigned period;
+    unsigned seed;
+    Node anchor;
+    atomic_int pred_id;
+    Node successors[DHT_SUCCESSORS];
+    size_t n_successors;
+    Node predecessors[DHT_PREDECESSORS];
+    size_t n_predecessors;
+    uint64_t succ_heard;
+    uint64_t pred_heard;
+    pthread_mutex_t lock;
+    struct pending_lookup* pending[1 << 16];
+    struct pending_lookup* pending_list;
+    size_t n_pending;
+    struct cached_range cache[DHT_CACHE_SIZE];
+    size_t n_cached;
+    struct finger fingers[DHT_FINGERS];
+    size_t next_finger;
+    bool timer_armed;
+    void (*notify)(struct lookup_waiter* waiter);
+    struct message_batch* inbox;
+    struct message_batch* outbox;
+    atomic_size_t n_sent;
+    atomic_size_t n_forwarded;
+    atomic_size_t n_answered;
+};
+
+
+/**
+ * Hash of a URI, selecting the node responsible for it
+ *
+ * The first two bytes of SHA-256 by default, or of wyhash if built with
+ * DHT_FAST_HASH. All nodes of a ring must use the same function.
+ */
+uint16_t hash(const char* str);
+
+/**
+ * Look up the hash of `str` in the calling thread's memo of recent hashes
+ *
+ * Returns false if it is not memoized.
+ */
+bool hash_memo_find(const char* str, uint16_t* value);
+
+/**
+ * Remember the hash of `str` in the calling thread's memo, replacing the
+ * least recently used entry of its set
+ */
+void hash_memo_insert(const char* str, uint16_t value);
+
+/**
+ * Like `hash()`, memoized for recently hashed strings
+ *
+ * The memo is bypassed if built with DHT_FAST_HASH, hashing is cheaper then.
+ */
+uint16_t hash_cached(const char* str);
+
+/**
+ * Whether `value` lies in the ring interval (`from`, `to`]
+ */
+bool in_range(uint16_t value, uint16_t from, uint16_t to);
+
+/**
+ * Whether the local node is responsible for `hash`
+ *
+ * Always true standalone, always false while the predecessor is unknown.
+ */
+bool dht_responsible(struct dht* dht, uint16_t hash);
+
+/**
+ * Whether the local node is responsible for `hash` or one of its
+ * `n_replicas` predecessors is, so it holds a replica
+ *
+ * True while fewer predecessors are known, the ring being that small.
+ */
+bool dht_replicates(struct dht* dht, uint16_t hash, size_t n_replicas);
+
+/**
+ * Allocate a node
+ */
+Node* initialize(const char* ip, uint16_t port, uint16_t id);
+
+/**
+ * Creates a non-blocking UDP socket bound to the given address.
+ */
+int udp_node_socket(struct sockaddr_in addr);
+
+/**
+ * Initialize the DHT state of the local node
+ */
+void dht_init(struct dht* dht, Node* node, int sock, void (*notify)(struct lookup_waiter* waiter));
+
+/**
+ * Start stabilizing the ring and refreshing the finger table in the
+ * background, about every `period` milliseconds
+ */
+void dht_start_maintenance(struct dht* dht, unsigned period);
+
+/**
+ * Join the ring `anchor` is part of
+ *
+ * The local node must have neither predecessor nor successor. The Join is
+ * repeated with every maintenance until the ring accepted the node.
+ */
+void dht_join(struct dht* dht, const Node* anchor);
+
+/**
+ * Determine the node responsible for `hash`, which is not the local node
+ *
+ * Returns true and fills `responsible` if the successor is responsible or
+ * the answer is cached. Otherwise
+ * a Lookup is sent towards the responsible node, unless one for this hash
+ * is already in flight, and false is returned. If given, `waiter` is notified once
+ * the lookup completes or failed; it is never notified if true is returned.
+ */
+bool dht_lookup(struct dht* dht, uint16_t hash, Node* responsible, struct lookup_waiter* waiter);
+
+/**
+ * Copy up to `n` of the nodes succeeding the local one into `successors`
+ *
+ * The local node itself is never included, so fewer are copied if the ring
+ * is smaller. Returns the number of nodes copied.
+ */
+size_t dht_successors(struct dht* dht, Node* successors, size_t n);
+
+/**
+ * Copy the predecessor of the local node into `pred`
+ *
+ * Returns false while it is unknown, or when running standalone.
+ */
+bool dht_predecessor(struct dht* dht, Node* pred);
+
+/**
+ * Copy up to `n` of the nodes preceding the local one into `predecessors`,
+ * nearest first
+ *
+ * The local node itself is never included, so fewer are copied if the ring
+ * is smaller, or while the list is still being learned. Returns the number
+ * of nodes copied.
+ */
+size_t dht_predecessors(struct dht* dht, Node* predecessors, size_t n);
+
+/**
+ * Whether `addr` is the address of a node in the predecessor or successor list
+ *
+ * Only the IP address is compared, connections from other nodes come from
+ * arbitrary ports. Returns false when running standalone.
+ */
+bool dht_is_neighbor(struct dht* dht, const struct in_addr* addr);
+
+/**
+ * Forget all cached lookup results, to be called whenever the ring changes
+ */
+void dht_invalidate(struct dht* dht);
+
+/**
+ * Handle all DHT messages waiting on the socket
+ */
+void dht_handle_messages(struct dht* dht);
+
+/**
+ * Handle an expiration of `timer`: retransmit or give up overdue lookups
+ *
+ * The node an overdue Lookup was sent to is suspected to have failed: it is
+ * no longer used as finger, and the successor is replaced by the next one
+ * of `successors` if it has not been heard of for a maintenance period.
+ */
+void dht_tick(struct dht* dht);
+
+/**
+ * Handle an expiration of `maintenance`: send a Stabilize to the successor,
+ * or the Join to the anchor while joining, and refresh the next finger
+ *
+ * A successor silent for DHT_FAILURE_ROUNDS periods is replaced by the next
+ * one of `successors` first.
+ */
+void dht_maintain(struct dht* dht);
@@ -8,6 +8,11 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 /**
@@ -19,6 +24,39 @@ struct non_string {
 };
 
 
+/**
+ * Find the first line feed or `delimiter` in `buffer`
+ *
+ * Header lines are scanned once for both their colon and their end. With
+ * SSE2, 16 bytes are compared against both characters at a time.
+ *
+ * Returns the offset of the match, or `n` if there is none.
+ */
+static size_t scan(const char* buffer, size_t n, char delimiter) {
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i line_feeds = _mm_set1_epi8('\n');
+    const __m128i delimiters = _mm_set1_epi8(delimiter);
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (buffer + i));
+        __m128i matches = _mm_or_si128(_mm_cmpeq_epi8(chunk, line_feeds), _mm_cmpeq_epi8(chunk, delimiters));
+        int mask = _mm_movemask_epi8(matches);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for (; i < n; i += 1) {
+        if (buffer[i] == '\n' || buffer[i] == delimiter) {
+            return i;
+        }
+    }
+    return n;
+}
+
+
 /**
  * Parse the request line of an HTTP request
  *
@@ -51,119 +89,145 @@ static bool parse_request_line(char* buffer, size_t n, struct non_string* method
 /**
  * Parse HTTP header
  *
- * Returns whether a valid header (excluding line separator) is parsed. On
- * a valid header, `key` and `value` are populated with the corresponding
- * values, reusing `buffer`'s memory.
+ * The header (excluding line separator) has its field name end at `colon`.
+ * `key` and `value` are populated with the corresponding values, reusing
+ * `buffer`'s memory.
  */
-static bool parse_header(char* buffer, size_t n, struct non_string* key, struct non_string* value) {
-    char* field_name_end = memchr(buffer, ':', n);
-    if (!field_name_end) {
-        return false;
+static void parse_header(char* buffer, size_t n, char* colon, struct non_string* key, struct non_string* value) {
+    // Skip optional whitespace preceding the field value
+    char* value_start = colon + 1;
+    while (value_start < buffer + n && (*value_start == ' ' || *value_start == '\t')) {
+        value_start += 1;
     }
 
     *key = (struct non_string) {
         .start = buffer,
-        .n = field_name_end - buffer
+        .n = colon - buffer
     };
     *value = (struct non_string) {
-        .start = field_name_end + 1,
-        .n = (buffer + n) - (field_name_end + 1)
+        .start = value_start,
+        .n = (buffer + n) - value_start
     };
+}
 
-    return true;
+
+void parser_reset(struct parser* parser) {
+    parser->scanned = 0;
+    parser->line_start = 0;
+    parser->colon = 0;
+    parser->request_line = false;
+    parser->n_headers = 0;
 }
 
 
-ssize_t parse_request(char* buffer, size_t n, struct request* request) {
-    char* line_separator = "\r\n";
+/**
+ * Parse the line ending before the line feed at `line_feed`
+ *
+ * Strings are null-terminated right away: parsed lines are never scanned
+ * again. All relevant strings are followed by at least one byte (a space,
+ * the colon or the line separator), which can be overwritten.
+ *
+ * Returns 1 if the line was the empty line ending the header, 0 for any
+ * other valid line and -1 if it is malformed.
+ */
+static int parse_line(char* buffer, size_t line_feed, struct parser* parser) {
+    const size_t line_start = parser->line_start;
+    if (line_feed == line_start || buffer[line_feed - 1] != '\r') {
+        return -1;  // Lines end with CRLF
+    }
+    const size_t line_end = line_feed - 1;
 
-    const char* end = buffer + n;
-    char* pos = buffer;
-    char* line_end;
+    if (!parser->request_line) {
+        struct non_string method = {0};
+        struct non_string uri = {0};
+        if (!parse_request_line(buffer + line_start, line_end - line_start, &method, &uri)) {
+            return -1; // Error parsing request line
+        }
+        method.start[method.n] = '\0';
+        uri.start[uri.n] = '\0';
+        parser->method = method.start - buffer;
+        parser->uri = uri.start - buffer;
+        parser->request_line = true;
+        return 0;
+    }
 
-    // Parse the request line
-    if (!(line_end = memstr(pos, end - pos, line_separator))) {
-        return 0; // Request line not received yet
+    if (line_end == line_start) {
+        return 1;  // Empty line
     }
-    struct non_string method = {0};
-    struct non_string uri = {0};
-    if (!parse_request_line(pos, line_end - pos, &method, &uri)) {
-        return -1; // Error parsing request line
+    if (!parser->colon || parser->n_headers == HTTP_MAX_HEADERS) {
+        return -1; // Error parsing header, or too many of them
     }
 
-    pos = line_end + strlen(line_separator);  // Skip line separator
+    struct non_string key;
+    struct non_string value;
+    parse_header(buffer + line_start, line_end - line_start, buffer + parser->colon, &key, &value);
+    key.start[key.n] = '\0';
+    value.start[value.n] = '\0';
+    parser->keys[parser->n_headers] = key.start - buffer;
+    parser->values[parser->n_headers] = value.start - buffer;
+    parser->n_headers += 1;
+    parser->colon = 0;
+    return 0;
+}
 
-    // Parse headers
-    struct {
-        struct non_string key;
-        struct non_string value;
-    } headers[HTTP_MAX_HEADERS] = {0};
-    size_t header_count = 0;
 
-    while ((line_end = memstr(pos, end - pos, line_separator)) != pos) {
-        if (header_count > HTTP_MAX_HEADERS) {
-            fprintf(stderr, "Exceeded max header count.\n");
-            exit(EXIT_FAILURE);
+ssize_t parse_request(char* buffer, size_t n, struct request* request, struct parser* parser) {
+    // Continue with the bytes not scanned by earlier calls
+    while (true) {
+        const char delimiter = parser->request_line && !parser->colon ? ':' : '\n';
+        size_t i = parser->scanned + scan(buffer + parser->scanned, n - parser->scanned, delimiter);
+        if (i == n) {
+            parser->scanned = n;
+            return 0;  // Header not fully received
         }
-        if (!line_end) {
-            return 0; // Header not fully received
+        parser->scanned = i + 1;
+
+        if (buffer[i] == ':') {
+            parser->colon = i;
+            continue;
         }
-        if (!parse_header(pos, line_end - pos, &(headers[header_count].key), &(headers[header_count].value))) {
-            return -1; // Error parsing header
+
+        int result = parse_line(buffer, i, parser);
+        if (result == -1) {
+            parser_reset(parser);
+            return -1;
+        }
+        parser->line_start = i + 1;
+        if (result == 1) {
+            break;
         }
-        pos = line_end + strlen(line_separator);  // Skip line separator
-        header_count += 1;
     }
 
-    pos = line_end + strlen(line_separator);  // Skip empty line
+    request->method = buffer + parser->method;
+    request->uri = buffer + parser->uri;
+    for (size_t i = 0; i < parser->n_headers; i += 1) {
+        request->headers[i].key = buffer + parser->keys[i];
+        request->headers[i].value = buffer + parser->values[i];
+    }
 
     // Parse payload length from headers
-    for (size_t i = 0; i < header_count; i += 1) {
-        if (strncmp(headers[i].key.start, "Content-Length", headers[i].key.n) == 0) {
-            request->payload_length = strtoul(headers[i].value.start, NULL, 10);
-            break;
-        }
-    }
-    if (request->payload_length < 0) {
-        if (request->method && strncmp(request->method, "PUT", strlen("PUT")) == 0) {
-            return -1; // Content-Length non-optional on PUT-requests
-        }
+    const string content_length = get_header(request, "Content-Length");
+    if (content_length) {
+        request->payload_length = strtoul(content_length, NULL, 10);
+    } else {
         request->payload_length = 0;
     }
-    request->payload = pos;
-    if  (pos + request->payload_length > end) {
-        return 0;  // Payload not yet received completely, try again.
-    }
-
-    // Request is valid: Bytes will be discarded after sending the reply,
-    // so we can reuse `buffer` here to avoid dynamic memory allocation.
-    // All relevant strings are followed by at least one byte, so we can
-    // overwrite these with null-characters, yielding proper strings.
 
-    method.start[method.n] = '\0';
-    request->method = method.start;
+    // The payload may not be received completely yet, the caller decides
+    // whether to wait for it or to receive it elsewhere.
+    size_t header_length = parser->line_start;
+    request->payload = buffer + header_length;
 
-    uri.start[uri.n] = '\0';
-    request->uri = uri.start;
-
-    for (size_t i = 0; i < header_count; i += 1) {
-        headers[i].key.start[headers[i].key.n] = '\0';
-        request->headers[i].key = headers[i].key.start;
-
-        headers[i].value.start[headers[i].value.n] = '\0';
-        request->headers[i].value = headers[i].value.start;
-    }
-
-    return (pos + request->payload_length) - buffer;  // Parsed until `pos`
+    parser_reset(parser);
+    return header_length;  // Parsed until the payload
 }
 
 
 string get_header(const struct request* request, const string name) {
     for (size_t i = 0; i < HTTP_MAX_HEADERS; i += 1) {
-        if (request->headers[i].key && strcmp(request->headers[i].key, name) == 0) {
+        if (request->headers[i].key && strcasecmp(request->headers[i].key, name) == 0) {
             return request->headers[i].value;
         }
     }
     return NULL; // Header not found
 }
-
@@ -1,11 +1,17 @@
 #pragma once
 
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
+#include "metrics.h"
 #include "util.h"
 
 #define HTTP_MAX_SIZE 8192
 #define HTTP_MAX_HEADERS 40
+#define HTTP_MAX_REPLIES 32
 
 
 /**
@@ -29,31 +35,170 @@ struct request {
 };
 
 
+/**
+ * Progress of parsing a request whose header is not complete yet
+ *
+ * Allows `parse_request()` to continue where it stopped, so every byte is
+ * scanned only once, no matter in how many parts the header arrives. All
+ * positions are offsets from the start of the request, which stay valid
+ * when the request is moved within the buffer.
+ *
+ * `scanned`: number of bytes searched for delimiters
+ * `line_start`: start of the first line not parsed yet
+ * `colon`: position of the colon in the current header line, or 0
+ * `request_line`: whether the request line was parsed
+ * `method`, `uri`: start of the parsed method and URI
+ * `n_headers`: number of parsed header fields
+ * `keys`, `values`: start of each header field's name and value
+ */
+struct parser {
+    size_t scanned;
+    size_t line_start;
+    size_t colon;
+    bool request_line;
+    size_t method;
+    size_t uri;
+    size_t n_headers;
+    size_t keys[HTTP_MAX_HEADERS];
+    size_t values[HTTP_MAX_HEADERS];
+};
+
+
+struct value;
+struct proxy_request;
+
+
+/**
+ * A reply queued for the client
+ *
+ * The body is sent straight from where it is stored, it is never copied
+ * next to the header.
+ *
+ * `header`: offset of the status line and header fields in the output's `headers`
+ * `header_length`: number of bytes of the header
+ * `body`: body in memory, a value taken from the store, or NULL
+ * `owned`: whether `body` was allocated for this reply and is freed instead
+ * `borrowed`: whether `body` outlives the reply, as resources of the catalog,
+ *             and is neither freed nor handed back
+ * `file`: descriptor the body is sent from with sendfile() instead, or -1
+ * `offset`: offset of the body in `file`
+ * `body_length`: number of bytes in the body
+ * `sent`: number of bytes of header and body sent so far
+ */
+struct reply {
+    size_t header;
+    size_t header_length;
+    const char* body;
+    bool owned;
+    bool borrowed;
+    int file;
+    off_t offset;
+    size_t body_length;
+    size_t sent;
+};
+
+
+/**
+ * Replies to pipelined requests, waiting to be sent in order
+ *
+ * All replies to the requests of one received packet are passed to the
+ * kernel together. Sockets are non-blocking, so replies may take several
+ * attempts until the client has received all of them.
+ *
+ * `headers`: headers of all queued replies, back to back
+ * `headers_length`: number of bytes used in `headers`
+ * `replies`: the queued replies
+ * `first`: index of the first reply not sent completely
+ * `n_replies`: number of queued replies, including those already sent
+ */
+struct output {
+    char headers[2 * HTTP_MAX_SIZE];
+    size_t headers_length;
+    struct reply replies[HTTP_MAX_REPLIES];
+    size_t first;
+    size_t n_replies;
+};
+
+
 /**
  * The state of an ongoing HTTP connection
  *
  * `sock`: the socket connected to the client
+ * `client`: the address the client connected from
  * `buffer`: buffer for the raw received data
  * `end`: end of unprocessed data in `buffer`
  * `current_request`: current, complete request, not yet answered to. Reuses
  *                    memory of `buffer`.
+ * `parser`: progress of parsing the request at the start of `buffer`
+ * `generation`: distinguishes connections that reuse the same socket
+ * `parked`: whether the reply to a request is deferred; requests following
+ *           it stay in `buffer` meanwhile
+ * `parked_uri`: URI of the request whose reply is deferred
+ * `forward`: request to forward once the lookup the connection is parked
+ *            for completed, or NULL
+ * `close_after_reply`: whether to close the connection once all queued
+ *                      replies are sent
+ * `output`: replies not sent yet
+ * `events`: events the socket is currently watched for
+ * `upload`: value the body of a PUT request is received into, or NULL. Bodies
+ *           not complete with the header bypass `buffer`.
+ * `upload_uri`: URI the value is stored under once it is complete
+ * `upload_received`: number of bytes of the body received so far
+ * `upload_close`: whether to close the connection after the upload
+ * `upload_replicate`: whether the upload is passed on to the replicas once
+ *                     stored, i.e. it is not a write of a replica itself
+ * `upload_proxy`: whether the upload is forwarded to the responsible node
+ *                 instead of being stored
+ * `upload_handover`: whether the upload hands the key over from its
+ *                    previous owner, see `set_value_handed_over()`
+ * `skip`: number of bytes of an unused body still to be dropped
+ * `request_start`: time the current request was parsed (microseconds, monotonic)
+ * `request_method`: method of the current request, for metrics
  */
 struct connection_state {
     int sock;
+    struct sockaddr_in client;
     char buffer[HTTP_MAX_SIZE];
     char* end;
     struct request current_request;
+    struct parser parser;
+    uint64_t generation;
+    bool parked;
+    string parked_uri;
+    struct proxy_request* forward;
+    bool close_after_reply;
+    struct output output;
+    uint32_t events;
+    struct value* upload;
+    string upload_uri;
+    size_t upload_received;
+    bool upload_close;
+    bool upload_replicate;
+    bool upload_proxy;
+    bool upload_handover;
+    size_t skip;
+    uint64_t request_start;
+    enum metrics_method request_method;
 };
 
 /**
  * Parse HTTP request into the given structure.
  *
- * When a full request is read, `request` is populated with its corresponding
- * values, utilizing the existing memory in `buffer`, and the number of bytes
- * read is returned. Otherwise, `buffer` remains unchanged, and zero is
- * returned.
+ * When the request line and all headers are read, `request` is populated
+ * with its corresponding values, utilizing the existing memory in `buffer`,
+ * and the number of bytes up to the payload is returned. `payload` points
+ * behind the headers, of its `payload_length` bytes only those up to the end
+ * of `buffer` may be received yet. Otherwise, zero is returned and `parser`
+ * records the progress: the next call, with the same request at the start
+ * of `buffer` and more bytes following, only scans the new bytes. Returns
+ * -1 for malformed requests. `parser` is reset after a non-zero result.
+ */
+ssize_t parse_request(char* buffer, size_t n, struct request* request, struct parser* parser);
+
+/**
+ * Prepare a parser for a new request
  */
-ssize_t parse_request(char* buffer, size_t n, struct request* request);
+void parser_reset(struct parser* parser);
 
 /**
  * Get value of header in request if set, or NULL.
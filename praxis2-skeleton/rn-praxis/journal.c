@@ -0,0 +1,548 @@
+#define _GNU_SOURCE  // IOV_MAX
+
+/**
+ * The write-ahead log of the store, its snapshots, and recovery from both,
+ * see `struct journal`.
+ */
+
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define JOURNAL_PARTS 1024  // iovecs per writev(), records have two or three
+
+
+/**
+ * Records collected for writing with a single writev()
+ *
+ * `file`: where the records are written to
+ * `written`: number of bytes written so far
+ * `headers`: headers of the collected records, the parts refer to them
+ * `parts`: headers, keys and values of the collected records, `n_parts` many
+ */
+struct record_writer {
+    int file;
+    uint64_t written;
+    struct journal_record headers[JOURNAL_PARTS / 2];
+    struct iovec parts[JOURNAL_PARTS];
+    size_t n_headers;
+    size_t n_parts;
+};
+
+
+/**
+ * FNV-1a of the key, mixed with the value length and the CRC-32C of the value
+ */
+static uint32_t checksum(const char* key, size_t key_length, uint64_t value_length, uint32_t value_crc) {
+    uint64_t hash = 0xcbf29ce484222325ull ^ value_length;
+    for (size_t i = 0; i < key_length; i += 1) {
+        hash ^= (uint8_t) key[i];
+        hash *= 0x100000001b3ull;
+    }
+    hash ^= value_crc;
+    hash *= 0x100000001b3ull;
+    return hash ^ (hash >> 32);
+}
+
+
+/**
+ * CRC-32C of the `length` bytes of a value backed by `file`
+ */
+static uint32_t file_crc(int file, uint64_t length) {
+    static char buffer[1 << 16];  // only used by the journal's thread
+    uint32_t crc = 0;
+    for (uint64_t offset = 0; offset < length;) {
+        size_t chunk = length - offset < sizeof(buffer) ? length - offset : sizeof(buffer);
+        ssize_t n = pread(file, buffer, chunk, offset);
+        if (n == 0) {
+            fprintf(stderr, "pread: value file ends before its length\n");
+            exit(EXIT_FAILURE);
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pread");
+            exit(EXIT_FAILURE);
+        }
+        crc = crc32c(crc, buffer, n);
+        offset += n;
+    }
+    return crc;
+}
+
+
+static void file_path(char* path, const struct journal* journal, const char* name) {
+    if (snprintf(path, PATH_MAX, "%s/%s", journal->directory, name) >= PATH_MAX) {
+        fprintf(stderr, "Journal directory path too long\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * Make renames and removals in the journal directory durable
+ */
+static void sync_directory(const struct journal* journal) {
+    int directory = open(journal->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory == -1 || fsync(directory) == -1) {
+        perror("fsync");
+        exit(EXIT_FAILURE);
+    }
+    close(directory);
+}
+
+
+static void rename_file(const struct journal* journal, const char* from, const char* to) {
+    char from_path[PATH_MAX];
+    char to_path[PATH_MAX];
+    file_path(from_path, journal, from);
+    file_path(to_path, journal, to);
+    if (rename(from_path, to_path) == -1) {
+        perror("rename");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static void remove_file(const struct journal* journal, const char* name) {
+    char path[PATH_MAX];
+    file_path(path, journal, name);
+    if (unlink(path) == -1 && errno != ENOENT) {
+        perror("unlink");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static bool file_exists(const struct journal* journal, const char* name) {
+    char path[PATH_MAX];
+    file_path(path, journal, name);
+    return access(path, F_OK) == 0;
+}
+
+
+static int open_file(const struct journal* journal, const char* name, int flags) {
+    char path[PATH_MAX];
+    file_path(path, journal, name);
+    int file = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0600);
+    if (file == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    return file;
+}
+
+
+/**
+ * Write all collected records
+ */
+static void writer_flush(struct record_writer* writer) {
+    struct iovec* parts = writer->parts;
+    size_t n_parts = writer->n_parts;
+    while (n_parts > 0) {
+        ssize_t written = writev(writer->file, parts, n_parts < IOV_MAX ? n_parts : IOV_MAX);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("writev");
+            exit(EXIT_FAILURE);
+        }
+        writer->written += written;
+
+        // Skip the parts written completely, advance within a partly written one
+        while (n_parts > 0 && (size_t) written >= parts->iov_len) {
+            written -= parts->iov_len;
+            parts += 1;
+            n_parts -= 1;
+        }
+        if (n_parts > 0) {
+            parts->iov_base = (char*) parts->iov_base + written;
+            parts->iov_len -= written;
+        }
+    }
+    writer->n_headers = 0;
+    writer->n_parts = 0;
+}
+
+
+/**
+ * Collect a record of `key` being set to `value`, or deleted if it is NULL
+ *
+ * Values backed by a file are copied from it right away, by the kernel.
+ * The key and value must stay valid until the next `writer_flush()`.
+ */
+static void writer_add(struct record_writer* writer, const char* key, const struct value* value) {
+    if (writer->n_parts + 3 > JOURNAL_PARTS) {
+        writer_flush(writer);
+    }
+
+    size_t key_length = strlen(key);
+    uint64_t value_length = value ? value->length : JOURNAL_DELETED;
+    uint32_t value_crc = 0;
+    if (value) {
+        // File-backed values are read twice, the header needs the checksum before they are sent
+        value_crc = value->file == -1 ? crc32c(0, value->data, value->length) : file_crc(value->file, value->length);
+    }
+    struct journal_record* header = &(writer->headers[writer->n_headers]);
+    *header = (struct journal_record) {
+        .magic = JOURNAL_MAGIC,
+        .checksum = checksum(key, key_length, value_length, value_crc),
+        .key_length = key_length,
+        .value_length = value_length,
+    };
+    writer->n_headers += 1;
+    writer->parts[writer->n_parts++] = (struct iovec) {header, sizeof(*header)};
+    writer->parts[writer->n_parts++] = (struct iovec) {(char*) key, key_length};
+
+    if (value && value->file == -1) {
+        writer->parts[writer->n_parts++] = (struct iovec) {(char*) value->data, value->length};
+    } else if (value) {
+        writer_flush(writer);
+        off_t offset = 0;
+        while ((uint64_t) offset < value->length) {
+            ssize_t sent = sendfile(writer->file, value->file, &offset, value->length - offset);
+            if (sent == 0) {
+                fprintf(stderr, "sendfile: value file ends before its length\n");
+                exit(EXIT_FAILURE);
+            }
+            if (sent == -1 && errno != EINTR) {
+                perror("sendfile");
+                exit(EXIT_FAILURE);
+            }
+        }
+        writer->written += value->length;
+    }
+}
+
+
+/**
+ * Write all pending writes to the journal and make them durable
+ *
+ * Only called by the journal's thread, and before it is started.
+ */
+static void commit(struct journal* journal) {
+    pthread_mutex_lock(&(journal->lock));
+    struct journal_entry* entries = journal->pending;
+    size_t n = journal->n_pending;
+    journal->pending = NULL;
+    journal->n_pending = 0;
+    journal->capacity = 0;
+    pthread_mutex_unlock(&(journal->lock));
+    if (n == 0) {
+        return;
+    }
+
+    static struct record_writer writer;  // too large for the stack
+    writer.file = journal->file;
+    writer.written = 0;
+    for (size_t i = 0; i < n; i += 1) {
+        writer_add(&writer, entries[i].key, entries[i].value);
+    }
+    writer_flush(&writer);
+    if (fdatasync(journal->file) == -1) {
+        perror("fdatasync");
+        exit(EXIT_FAILURE);
+    }
+    journal->size += writer.written;
+
+    for (size_t i = 0; i < n; i += 1) {
+        if (entries[i].value) {
+            release(journal->store, entries[i].value->data);
+        }
+        free(entries[i].key);
+    }
+    free(entries);
+}
+
+
+/**
+ * Write all entries of the store to a new snapshot, replacing the last one
+ *
+ * The store is walked one shard at a time. Writes arriving meanwhile are
+ * committed between shards, so they are not held back until the snapshot
+ * is complete.
+ */
+static void write_snapshot(struct journal* journal) {
+    static struct record_writer writer;
+    writer.file = open_file(journal, "snapshot.tmp", O_TRUNC);
+    writer.written = 0;
+
+    for (size_t i = 0; i < STORE_SHARDS; i += 1) {
+        struct store_entry* entries;
+        size_t n = store_collect(journal->store, i, &entries);
+        for (size_t j = 0; j < n; j += 1) {
+            writer_add(&writer, entries[j].key, entries[j].value);
+        }
+        writer_flush(&writer);
+        for (size_t j = 0; j < n; j += 1) {
+            release(journal->store, entries[j].value->data);
+            free(entries[j].key);
+        }
+        free(entries);
+        commit(journal);
+    }
+
+    if (fdatasync(writer.file) == -1) {
+        perror("fdatasync");
+        exit(EXIT_FAILURE);
+    }
+    close(writer.file);
+    rename_file(journal, "snapshot.tmp", "snapshot");
+    sync_directory(journal);
+    journal->snapshot_size = writer.written;
+}
+
+
+/**
+ * Replace the journal by a snapshot
+ *
+ * Later writes go to a new journal, so the old one is only needed until the
+ * snapshot is complete.
+ */
+static void compact(struct journal* journal) {
+    uint64_t start = monotonic_ms();
+    uint64_t size = journal->size;
+
+    rename_file(journal, "journal", "journal.old");
+    close(journal->file);
+    journal->file = open_file(journal, "journal", O_TRUNC);
+    journal->size = 0;
+    sync_directory(journal);
+
+    write_snapshot(journal);
+    remove_file(journal, "journal.old");
+    sync_directory(journal);
+    logger_printf("Compacted journal of %lu bytes into snapshot of %lu bytes in %lu ms\n", size,
+                  journal->snapshot_size, monotonic_ms() - start);
+}
+
+
+/**
+ * Set `key` to the `length` bytes at `data`, into a file if above the spill threshold
+ */
+static void restore_value(struct store* store, string key, const char* data, size_t length) {
+    if (length <= store->spill_threshold) {
+        set(key, (char*) data, length, store);
+        return;
+    }
+
+    struct value* value = value_alloc(key, length, store);
+    if (value == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (size_t written = 0; written < length;) {
+        ssize_t n = pwrite(value->file, data + written, length - written, written);
+        if (n == -1 && errno != EINTR) {
+            perror("pwrite");
+            exit(EXIT_FAILURE);
+        }
+        written += n > 0 ? n : 0;
+    }
+    set_value(key, value, store);
+}
+
+
+/**
+ * Apply the records of the file `name` to the store, if it exists
+ *
+ * The file is mapped rather than read, so values are copied into the store
+ * straight from the page cache. Records are applied up to the first
+ * incomplete or damaged one. Returns the length of the valid records.
+ */
+static uint64_t replay(struct journal* journal, const char* name) {
+    char path[PATH_MAX];
+    file_path(path, journal, name);
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat stat;
+    if (fstat(file, &stat) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t size = stat.st_size;
+    if (size == 0) {
+        close(file);
+        return 0;
+    }
+    const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    madvise((void*) data, size, MADV_SEQUENTIAL);
+
+    char* key = NULL;
+    size_t key_capacity = 0;
+    uint64_t offset = 0;
+    while (size - offset >= sizeof(struct journal_record)) {
+        struct journal_record header;
+        memcpy(&header, data + offset, sizeof(header));
+        uint64_t remaining = size - offset - sizeof(header);
+        bool deleted = header.value_length == JOURNAL_DELETED;
+        const char* record_key = data + offset + sizeof(header);
+        if (header.magic != JOURNAL_MAGIC || header.key_length > remaining
+            || (!deleted && header.value_length > remaining - header.key_length)) {
+            break;
+        }
+        uint32_t value_crc = deleted ? 0 : crc32c(0, record_key + header.key_length, header.value_length);
+        if (header.checksum != checksum(record_key, header.key_length, header.value_length, value_crc)) {
+            break;
+        }
+
+        // Keys are stored without their terminating zero
+        if (header.key_length + 1 > key_capacity) {
+            key_capacity = header.key_length + 1;
+            key = realloc(key, key_capacity);
+            if (key == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(key, record_key, header.key_length);
+        key[header.key_length] = '\0';
+
+        if (deleted) {
+            delete(key, journal->store);
+            offset += sizeof(header) + header.key_length;
+        } else {
+            restore_value(journal->store, key, record_key + header.key_length, header.value_length);
+            offset += sizeof(header) + header.key_length + header.value_length;
+        }
+    }
+
+    free(key);
+    munmap((void*) data, size);
+    close(file);
+    return offset;
+}
+
+
+/**
+ * Commits writes as they arrive, and compacts the journal once it is large
+ */
+static void* journal_run(void* arg) {
+    struct journal* journal = arg;
+
+    while (true) {
+        pthread_mutex_lock(&(journal->lock));
+        while (journal->n_pending == 0) {
+            pthread_cond_wait(&(journal->written), &(journal->lock));
+        }
+        pthread_mutex_unlock(&(journal->lock));
+
+        commit(journal);
+        if (journal->size > JOURNAL_COMPACT_BYTES && journal->size > journal->snapshot_size) {
+            compact(journal);
+        }
+    }
+    return NULL;
+}
+
+
+void journal_open(struct store* store, const char* directory) {
+    struct journal* journal = calloc(1, sizeof(struct journal));
+    if (journal == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    journal->store = store;
+    journal->directory = strdup(directory);
+    pthread_mutex_init(&(journal->lock), NULL);
+    pthread_cond_init(&(journal->written), NULL);
+    if (mkdir(directory, 0700) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+
+    // The old journal is left over if compacting was interrupted
+    uint64_t start = monotonic_ms();
+    bool interrupted = file_exists(journal, "journal.old");
+    journal->snapshot_size = replay(journal, "snapshot");
+    replay(journal, "journal.old");
+    journal->size = replay(journal, "journal");
+
+    // Appends continue behind the last complete record
+    journal->file = open_file(journal, "journal", 0);
+    if (ftruncate(journal->file, journal->size) == -1 || lseek(journal->file, 0, SEEK_END) == -1) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    logger_printf("Restored %zu keys from %s in %lu ms\n", store_size(store), directory, monotonic_ms() - start);
+
+    if (interrupted) {
+        // Nothing is written yet, so the snapshot covers both journals
+        write_snapshot(journal);
+        remove_file(journal, "journal.old");
+        if (ftruncate(journal->file, 0) == -1 || lseek(journal->file, 0, SEEK_SET) == -1) {
+            perror("ftruncate");
+            exit(EXIT_FAILURE);
+        }
+        journal->size = 0;
+        sync_directory(journal);
+    }
+
+    store->journal = journal;
+    if (pthread_create(&(journal->thread), NULL, journal_run, journal) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * Queue a write for the next commit, the caller holds the lock of the key's shard
+ */
+static void journal_add(struct journal* journal, const char* key, struct value* value) {
+    char* copy = strdup(key);
+    if (copy == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&(journal->lock));
+    if (journal->n_pending == journal->capacity) {
+        journal->capacity = journal->capacity ? journal->capacity * 2 : 64;
+        journal->pending = realloc(journal->pending, journal->capacity * sizeof(struct journal_entry));
+        if (journal->pending == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    journal->pending[journal->n_pending] = (struct journal_entry) {copy, value};
+    journal->n_pending += 1;
+    if (journal->n_pending == 1) {
+        pthread_cond_signal(&(journal->written));
+    }
+    pthread_mutex_unlock(&(journal->lock));
+}
+
+
+void journal_set(struct journal* journal, const char* key, struct value* value) {
+    atomic_fetch_add(&(value->references), 1);
+    journal_add(journal, key, value);
+}
+
+
+void journal_delete(struct journal* journal, const char* key) {
+    journal_add(journal, key, NULL);
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "data.h"
+
+#define JOURNAL_MAGIC 0x52574c32  // "RWL2", starts every record
+#define JOURNAL_COMPACT_BYTES (16 << 20)  // journal size from which a snapshot may replace it
+
+
+/**
+ * Header of a record in the journal and snapshot files, followed by the key
+ * and, unless it records a deletion, the value
+ *
+ * `magic`, `checksum`: tell a complete record from the garbage a crash may
+ *                      leave at the end of the journal. The checksum covers
+ *                      the key, the value length and the value, so a value
+ *                      torn by a crash is detected as well.
+ * `key_length`: number of bytes of the key, without terminating zero
+ * `value_length`: number of bytes of the value, JOURNAL_DELETED for a deletion
+ */
+struct journal_record {
+    uint32_t magic;
+    uint32_t checksum;
+    uint32_t key_length;
+    uint64_t value_length;
+} __attribute__((packed));
+
+#define JOURNAL_DELETED UINT64_MAX
+
+
+/**
+ * A write waiting to be committed
+ *
+ * `key`: copy of the written key
+ * `value`: a reference to the value that was set, NULL for a deletion
+ */
+struct journal_entry {
+    string key;
+    struct value* value;
+};
+
+
+/**
+ * Write-ahead log of a store, with snapshots limiting its length
+ *
+ * The store hands every write to the journal while it still holds the
+ * lock of the key's shard, so the journal has writes of a key in the order
+ * they were applied. The writes are collected in memory and committed by a
+ * background thread: each batch is appended with one writev() and made
+ * durable with one fdatasync(), the writes arriving meanwhile form the next
+ * batch. Values are not copied, the journal holds a reference until they
+ * are written. Replies do not wait for the commit, so a crash of the
+ * machine loses the writes of the last batch at most.
+ *
+ * Once the journal grew beyond JOURNAL_COMPACT_BYTES and the last snapshot,
+ * it is renamed to `journal.old`, a new one is started, and all entries of
+ * the store are written to a new snapshot, replacing the old one and
+ * `journal.old`. On startup the snapshot and both journals are mapped into
+ * memory and replayed in that order. Records state the value of a key, not
+ * a change, so replaying a write the snapshot already contains is harmless.
+ *
+ * `store`: the store whose writes are logged
+ * `directory`: where `snapshot`, `journal` and `journal.old` are kept
+ * `file`: the journal being appended to
+ * `size`: number of bytes in `file`
+ * `snapshot_size`: number of bytes of the last snapshot
+ * `lock`: guards `pending`, `n_pending` and `capacity`
+ * `written`: signalled when `pending` becomes non-empty
+ * `pending`: writes not committed yet, `capacity` entries allocated
+ * `thread`: the thread committing the writes
+ */
+struct journal {
+    struct store* store;
+    char* directory;
+    int file;
+    uint64_t size;
+    uint64_t snapshot_size;
+    pthread_mutex_t lock;
+    pthread_cond_t written;
+    struct journal_entry* pending;
+    size_t n_pending;
+    size_t capacity;
+    pthread_t thread;
+};
+
+
+/**
+ * Restore the store from `directory` and log all further writes there
+ *
+ * The directory is created if it does not exist. Exits if the files in it
+ * cannot be read or written.
+ */
+void journal_open(struct store* store, const char* directory);
+
+/**
+ * Log that `key` was set to `value`, taking a reference to it
+ *
+ * Called by the store with the lock of the key's shard held.
+ */
+void journal_set(struct journal* journal, const char* key, struct value* value);
+
+/**
+ * Log that `key` was deleted
+ *
+ * Called by the store with the lock of the key's shard held.
+ */
+void journal_delete(struct journal* journal, const char* key);
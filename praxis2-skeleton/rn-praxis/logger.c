@@ -0,0 +1,135 @@
+/**
+ * An asynchronous logger: a bounded ring buffer with many producers and one
+ * consumer thread that writes the buffered lines to stderr in batches.
+ *
+ * The ring follows Dmitry Vyukov's bounded MPMC queue: each slot carries a
+ * sequence number telling whether it is free for the producer at a given
+ * position or filled for the consumer, so producers only contend on the
+ * position counter and never take a lock.
+ */
+
+#include "logger.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define LOG_POLL_NS 10000000L  // the writer sleeps this long once the ring is empty
+
+
+/**
+ * A line in the ring
+ *
+ * `sequence`: equals the position the slot is next written at while free,
+ *             and that position plus one once the line is complete
+ */
+struct slot {
+    atomic_size_t sequence;
+    size_t length;
+    char line[LOG_LINE_SIZE];
+};
+
+
+static struct slot slots[LOG_CAPACITY];
+static atomic_size_t head;  // next position to write a line at
+static size_t tail;  // next position to read a line from, only used by the writer
+static atomic_bool started;
+
+
+/**
+ * Writes all complete lines to stderr, sleeps while there are none
+ */
+static void* logger_run(void* arg) {
+    (void) arg;
+    static char batch[LOG_CAPACITY / 4 * LOG_LINE_SIZE];
+
+    while (true) {
+        size_t length = 0;
+        while (length + LOG_LINE_SIZE <= sizeof(batch)) {
+            struct slot* slot = &(slots[tail % LOG_CAPACITY]);
+            if (atomic_load_explicit(&(slot->sequence), memory_order_acquire) != tail + 1) {
+                break;  // not written yet
+            }
+            memcpy(batch + length, slot->line, slot->length);
+            length += slot->length;
+            atomic_store_explicit(&(slot->sequence), tail + LOG_CAPACITY, memory_order_release);
+            tail += 1;
+        }
+
+        if (length == 0) {
+            nanosleep(&(struct timespec) {.tv_nsec = LOG_POLL_NS}, NULL);
+            continue;
+        }
+        for (size_t written = 0; written < length;) {
+            ssize_t n = write(STDERR_FILENO, batch + written, length - written);
+            if (n == -1) {
+                break;  // nowhere to report to
+            }
+            written += n;
+        }
+    }
+    return NULL;
+}
+
+
+void logger_start(void) {
+    for (size_t i = 0; i < LOG_CAPACITY; i += 1) {
+        atomic_init(&(slots[i].sequence), i);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, logger_run, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    atomic_store(&started, true);
+}
+
+
+void logger_printf(const char* format, ...) {
+    if (!atomic_load_explicit(&started, memory_order_relaxed)) {
+        return;
+    }
+
+    // Claim a free slot
+    struct slot* slot;
+    size_t position = atomic_load_explicit(&head, memory_order_relaxed);
+    while (true) {
+        slot = &(slots[position % LOG_CAPACITY]);
+        size_t sequence = atomic_load_explicit(&(slot->sequence), memory_order_acquire);
+        if (sequence == position) {
+            if (atomic_compare_exchange_weak_explicit(&head, &position, position + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (sequence < position) {  // full: the writer has not read this slot yet
+            atomic_fetch_add_explicit(&(metrics.log_dropped), 1, memory_order_relaxed);
+            return;
+        } else {
+            position = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(slot->line, LOG_LINE_SIZE, format, args);
+    va_end(args);
+    if (length < 0) {
+        length = 0;
+    } else if (length >= LOG_LINE_SIZE) {
+        length = LOG_LINE_SIZE - 1;
+        slot->line[length - 1] = '\n';
+    }
+    slot->length = length;
+
+    atomic_store_explicit(&(slot->sequence), position + 1, memory_order_release);
+}
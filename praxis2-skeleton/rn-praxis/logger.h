@@ -0,0 +1,22 @@
+#pragma once
+
+#define LOG_LINE_SIZE 256  // longer lines are truncated
+#define LOG_CAPACITY 1024  // lines buffered before further ones are dropped
+
+
+/**
+ * Start writing logged lines to stderr
+ *
+ * Until this is called, `logger_printf()` discards all lines. Lines are
+ * written by a background thread, so logging never blocks the caller on
+ * stderr; lines logged faster than they can be written are dropped and
+ * counted in `metrics.log_dropped`.
+ */
+void logger_start(void);
+
+/**
+ * Log a line formatted like printf(), `format` ends with a newline
+ *
+ * Safe to call from any thread.
+ */
+void logger_printf(const char* format, ...) __attribute__((format(printf, 1, 2)));
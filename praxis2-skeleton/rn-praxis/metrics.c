@@ -0,0 +1,194 @@
+#define _GNU_SOURCE  // open_memstream()
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "data.h"
+#include "dht.h"
+
+
+struct metrics metrics;
+
+static const char* const method_names[N_METHODS] = {"GET", "PUT", "DELETE", "other"};
+
+// Status codes the server replies with, the last entry collects any other
+static const int statuses[N_STATUSES] = {200, 201, 204, 303, 400, 403, 404, 414, 501, 502, 503, 507, 0};
+
+static const char* const message_names[N_MESSAGE_TYPES] = {"lookup", "reply", "stabilize", "notify", "join", "successor", "predecessor"};
+
+
+/**
+ * Index of the bucket counting `value`
+ *
+ * Values are grouped by their most significant bit, the following bits
+ * select one of `HISTOGRAM_SUB_BUCKETS` buckets within the group.
+ */
+static size_t bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    unsigned bits = 64 - __builtin_clzll(value);
+    unsigned shift = bits - 4;  // keep the leading bit and the three following it
+    size_t index = (shift + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+
+/**
+ * Smallest value not counted in buckets up to `index`
+ */
+static uint64_t bucket_end(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index + 1;
+    }
+    unsigned shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    return (uint64_t) (HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS + 1) << shift;
+}
+
+
+void histogram_record(struct histogram* histogram, uint64_t value) {
+    atomic_fetch_add_explicit(&(histogram->buckets[bucket_index(value)]), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(histogram->count), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(histogram->sum), value, memory_order_relaxed);
+}
+
+
+enum metrics_method metrics_method(const char* method) {
+    for (size_t i = 0; i < METHOD_OTHER; i += 1) {
+        if (strcmp(method, method_names[i]) == 0) {
+            return i;
+        }
+    }
+    return METHOD_OTHER;
+}
+
+
+void metrics_request(enum metrics_method method, int status, uint64_t duration) {
+    size_t index = 0;
+    while (index < N_STATUSES - 1 && statuses[index] != status) {
+        index += 1;
+    }
+    histogram_record(&(metrics.requests[method][index]), duration);
+}
+
+
+void metrics_message(bool sent, uint8_t flag) {
+    if (flag < N_MESSAGE_TYPES) {
+        atomic_fetch_add_explicit(&(metrics.messages[sent][flag]), 1, memory_order_relaxed);
+    }
+}
+
+
+/**
+ * Write a histogram of microsecond values in seconds
+ *
+ * Prometheus buckets are cumulative and few, so only powers of two are
+ * reported as bucket bounds.
+ */
+static void render_histogram(FILE* out, const char* name, const char* labels, struct histogram* histogram) {
+    uint64_t count = atomic_load_explicit(&(histogram->count), memory_order_relaxed);
+    if (count == 0) {
+        return;
+    }
+
+    const char* separator = labels[0] ? "," : "";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i += 1) {
+        cumulative += atomic_load_explicit(&(histogram->buckets[i]), memory_order_relaxed);
+        uint64_t end = bucket_end(i);
+        if ((end & (end - 1)) == 0) {
+            fprintf(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, separator, end / 1e6, cumulative);
+            if (cumulative >= count) {
+                break;
+            }
+        }
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, separator, count);
+    const char* open = labels[0] ? "{" : "";
+    const char* close = labels[0] ? "}" : "";
+    fprintf(out, "%s_sum%s%s%s %g\n", name, open, labels, close,
+            atomic_load_explicit(&(histogram->sum), memory_order_relaxed) / 1e6);
+    fprintf(out, "%s_count%s%s%s %lu\n", name, open, labels, close, count);
+}
+
+
+char* metrics_render(struct store* store, struct dht* dht, size_t* length) {
+    char* buffer = NULL;
+    FILE* out = open_memstream(&buffer, length);
+    if (out == NULL) {
+        perror("open_memstream");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(out, "# HELP http_request_duration_seconds Time from parsing a request until its reply is queued.\n");
+    fprintf(out, "# TYPE http_request_duration_seconds histogram\n");
+    for (size_t method = 0; method < N_METHODS; method += 1) {
+        for (size_t status = 0; status < N_STATUSES; status += 1) {
+            char labels[64];
+            if (statuses[status]) {
+                snprintf(labels, sizeof(labels), "method=\"%s\",status=\"%d\"", method_names[method], statuses[status]);
+            } else {
+                snprintf(labels, sizeof(labels), "method=\"%s\",status=\"other\"", method_names[method]);
+            }
+            render_histogram(out, "http_request_duration_seconds", labels, &(metrics.requests[method][status]));
+        }
+    }
+
+    fprintf(out, "# HELP http_connections Open client connections.\n");
+    fprintf(out, "# TYPE http_connections gauge\n");
+    fprintf(out, "http_connections %ld\n", (long) atomic_load(&(metrics.connections)));
+
+    fprintf(out, "# HELP dht_messages_total DHT messages by direction and type.\n");
+    fprintf(out, "# TYPE dht_messages_total counter\n");
+    for (size_t sent = 0; sent < 2; sent += 1) {
+        for (size_t type = 0; type < N_MESSAGE_TYPES; type += 1) {
+            fprintf(out, "dht_messages_total{direction=\"%s\",type=\"%s\"} %lu\n", sent ? "sent" : "received",
+                    message_names[type], atomic_load_explicit(&(metrics.messages[sent][type]), memory_order_relaxed));
+        }
+    }
+
+    fprintf(out, "# HELP dht_lookups_total Lookups by what this node did with them.\n");
+    fprintf(out, "# TYPE dht_lookups_total counter\n");
+    fprintf(out, "dht_lookups_total{action=\"sent\"} %zu\n", atomic_load(&(dht->n_sent)));
+    fprintf(out, "dht_lookups_total{action=\"forwarded\"} %zu\n", atomic_load(&(dht->n_forwarded)));
+    fprintf(out, "dht_lookups_total{action=\"answered\"} %zu\n", atomic_load(&(dht->n_answered)));
+    fprintf(out, "dht_lookups_total{action=\"failed\"} %lu\n", atomic_load(&(metrics.lookups_failed)));
+
+    fprintf(out, "# HELP dht_lookup_duration_seconds Round trip time of lookups started by this node.\n");
+    fprintf(out, "# TYPE dht_lookup_duration_seconds histogram\n");
+    render_histogram(out, "dht_lookup_duration_seconds", "", &(metrics.lookups));
+
+    struct slab_stats stats = store_stats(store);
+    fprintf(out, "# HELP store_keys Resources in the store.\n");
+    fprintf(out, "# TYPE store_keys gauge\n");
+    fprintf(out, "store_keys %zu\n", store_size(store));
+    fprintf(out, "# HELP store_bytes Memory of the store by use.\n");
+    fprintf(out, "# TYPE store_bytes gauge\n");
+    fprintf(out, "store_bytes{kind=\"live\"} %zu\n", stats.bytes_live);
+    fprintf(out, "store_bytes{kind=\"wasted\"} %zu\n", stats.bytes_wasted);
+    fprintf(out, "store_bytes{kind=\"large\"} %zu\n", stats.bytes_large);
+
+    fprintf(out, "# HELP replica_writes_total Writes sent to replicas by whether they applied them.\n");
+    fprintf(out, "# TYPE replica_writes_total counter\n");
+    fprintf(out, "replica_writes_total{result=\"applied\"} %lu\n", atomic_load(&(metrics.replica_writes[REPLICA_APPLIED])));
+    fprintf(out, "replica_writes_total{result=\"failed\"} %lu\n", atomic_load(&(metrics.replica_writes[REPLICA_FAILED])));
+
+    fprintf(out, "# HELP keys_migrated_total Keys handed over to a node that joined as predecessor, or to the successor when leaving.\n");
+    fprintf(out, "# TYPE keys_migrated_total counter\n");
+    fprintf(out, "keys_migrated_total %lu\n", atomic_load(&(metrics.keys_migrated)));
+
+    fprintf(out, "# HELP peer_connections_total Connections to other nodes by whether a kept one was reused, opened, or failed.\n");
+    fprintf(out, "# TYPE peer_connections_total counter\n");
+    fprintf(out, "peer_connections_total{result=\"reused\"} %lu\n", atomic_load(&(metrics.peer_connections[POOL_REUSED])));
+    fprintf(out, "peer_connections_total{result=\"opened\"} %lu\n", atomic_load(&(metrics.peer_connections[POOL_OPENED])));
+    fprintf(out, "peer_connections_total{result=\"failed\"} %lu\n", atomic_load(&(metrics.peer_connections[POOL_FAILED])));
+
+    fprintf(out, "# HELP log_dropped_total Log lines dropped because the logger fell behind.\n");
+    fprintf(out, "# TYPE log_dropped_total counter\n");
+    fprintf(out, "log_dropped_total %lu\n", atomic_load(&(metrics.log_dropped)));
+
+    fclose(out);
+    return buffer;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define HISTOGRAM_SUB_BUCKETS 8  // per power of two, bounds the relative error to 1/8
+#define HISTOGRAM_BUCKETS (30 * HISTOGRAM_SUB_BUCKETS)  // values up to 2^32
+
+struct store;
+struct dht;
+
+
+/**
+ * Methods requests are counted by, anything else is `METHOD_OTHER`
+ */
+enum metrics_method {
+    METHOD_GET,
+    METHOD_PUT,
+    METHOD_DELETE,
+    METHOD_OTHER,
+    N_METHODS,
+};
+
+
+/**
+ * Status codes requests are counted by, see `metrics.c`
+ */
+#define N_STATUSES 13
+
+/**
+ * Types of DHT messages, indexed by `enum message_flag`
+ */
+#define N_MESSAGE_TYPES 7
+
+
+/**
+ * Outcomes of writes sent to replicas
+ */
+enum replica_result {
+    REPLICA_APPLIED,
+    REPLICA_FAILED,
+    N_REPLICA_RESULTS,
+};
+
+
+/**
+ * How connections to other nodes were obtained from the pool
+ */
+enum pool_result {
+    POOL_REUSED,
+    POOL_OPENED,
+    POOL_FAILED,
+    N_POOL_RESULTS,
+};
+
+
+/**
+ * A histogram with logarithmic buckets, in the style of HdrHistogram
+ *
+ * Values below `HISTOGRAM_SUB_BUCKETS` have a bucket each, larger ones
+ * share a bucket with values of the same power of two and the same leading
+ * bits, so every bucket is at most 1/8 of its values wide. Recording is
+ * lock-free.
+ */
+struct histogram {
+    atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+};
+
+
+/**
+ * Counters and histograms of the whole process
+ *
+ * `requests`: duration of HTTP requests in microseconds, from their header
+ *             being parsed until the reply is queued, by method and status
+ * `messages`: DHT messages received (0) and sent (1), by type
+ * `lookups`: time until a Reply resolved a lookup, in microseconds
+ * `lookups_failed`: lookups given up after all retransmissions
+ * `connections`: currently open client connections
+ * `replica_writes`: writes sent to replicas, by `enum replica_result`
+ * `keys_migrated`: keys handed over to a node that joined as predecessor, or
+ *                  to the successor when leaving
+ * `peer_connections`: connections to other nodes taken from the pool, by
+ *                     `enum pool_result`
+ * `log_dropped`: log lines dropped because the logger fell behind
+ */
+struct metrics {
+    struct histogram requests[N_METHODS][N_STATUSES];
+    atomic_uint_fast64_t messages[2][N_MESSAGE_TYPES];
+    struct histogram lookups;
+    atomic_uint_fast64_t lookups_failed;
+    atomic_int_fast64_t connections;
+    atomic_uint_fast64_t replica_writes[N_REPLICA_RESULTS];
+    atomic_uint_fast64_t keys_migrated;
+    atomic_uint_fast64_t peer_connections[N_POOL_RESULTS];
+    atomic_uint_fast64_t log_dropped;
+};
+
+extern struct metrics metrics;
+
+
+/**
+ * Add a value to a histogram
+ */
+void histogram_record(struct histogram* histogram, uint64_t value);
+
+/**
+ * The method index of a request method
+ */
+enum metrics_method metrics_method(const char* method);
+
+/**
+ * Count a request that was answered with `status` after `duration` microseconds
+ */
+void metrics_request(enum metrics_method method, int status, uint64_t duration);
+
+/**
+ * Count a DHT message of type `flag`, `sent` by or received by this node
+ */
+void metrics_message(bool sent, uint8_t flag);
+
+/**
+ * Render all metrics in the Prometheus text exposition format
+ *
+ * Includes the size of the store and the lookup counters of the DHT at the
+ * time of the call. Returns a buffer allocated with malloc(), its length is
+ * stored in `length`.
+ */
+char* metrics_render(struct store* store, struct dht* dht, size_t* length);
@@ -0,0 +1,212 @@
+/**
+ * Hand-over of keys between neighbors when the ring changes, see
+ * `struct migrator`.
+ */
+
+#include "migration.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+
+static void pause_ms(uint64_t ms) {
+    struct timespec duration = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (ms % 1000) * 1000000L,
+    };
+    while (nanosleep(&duration, &duration) == -1) {
+    }
+}
+
+
+static void free_keys(string* keys, size_t n) {
+    for (size_t i = 0; i < n; i += 1) {
+        free(keys[i]);
+    }
+    free(keys);
+}
+
+
+/**
+ * Send the keys in (`from`, `owner->id`] to `owner`, which joined as predecessor
+ *
+ * The keys stay in the store, see `prune()`. Returns false if the owner did
+ * not apply all of them, the hand-over is repeated then.
+ */
+static bool hand_over(struct migrator* migrator, uint16_t from, const Node* owner) {
+    string* keys;
+    size_t n_keys = store_range(migrator->store, from, owner->id, &keys);
+    if (n_keys == 0) {
+        free(keys);
+        return true;
+    }
+
+    logger_printf("Handing %zu keys over to %u at %s\n", n_keys, owner->id, owner->authority);
+    uint64_t start = monotonic_ms();
+    bool complete = true;
+    for (size_t first = 0; first < n_keys; first += MIGRATION_BATCH) {
+        size_t n = n_keys - first < MIGRATION_BATCH ? n_keys - first : MIGRATION_BATCH;
+        uint64_t batch_start = monotonic_ms();
+        ssize_t failed = replica_transfer(migrator->store, migrator->pool, owner, keys + first, n, true);
+        if (failed != 0) {
+            complete = false;
+            break;
+        }
+        atomic_fetch_add(&(metrics.keys_migrated), n);
+        pause_ms((monotonic_ms() - batch_start) * MIGRATION_PAUSE);
+    }
+
+    if (complete) {
+        logger_printf("Handed %zu keys over to %u in %lu ms\n", n_keys, owner->id, monotonic_ms() - start);
+    } else {
+        logger_printf("Hand-over to %u at %s failed\n", owner->id, owner->authority);
+    }
+    free_keys(keys, n_keys);
+    return complete;
+}
+
+
+/**
+ * Replicate the keys in (`from`, `to`], taken over from the failed predecessor
+ */
+static void take_over(struct migrator* migrator, uint16_t from, uint16_t to) {
+    if (migrator->replicator == NULL) {
+        return;
+    }
+
+    string* keys;
+    size_t n_keys = store_range(migrator->store, from, to, &keys);
+    for (size_t i = 0; i < n_keys; i += 1) {
+        replicator_queue(migrator->replicator, keys[i]);
+    }
+    if (n_keys > 0) {
+        logger_printf("Took over %zu keys of a failed predecessor\n", n_keys);
+    }
+    free_keys(keys, n_keys);
+}
+
+
+/**
+ * Delete the keys in (`from`, `to`], which the local node neither is
+ * responsible for nor holds as replica anymore
+ */
+static void prune(struct migrator* migrator, uint16_t from, uint16_t to) {
+    string* keys;
+    size_t n_keys = store_range(migrator->store, from, to, &keys);
+    for (size_t i = 0; i < n_keys; i += 1) {
+        delete(keys[i], migrator->store);
+    }
+    if (n_keys > 0) {
+        logger_printf("Dropped %zu keys held for other nodes\n", n_keys);
+    }
+    free_keys(keys, n_keys);
+}
+
+
+/**
+ * Watches the predecessor and hands keys over whenever a node joined in
+ * front of the local one
+ */
+static void* migrator_run(void* arg) {
+    struct migrator* migrator = arg;
+    uint16_t self = migrator->dht->node->id;
+
+    // The predecessor the local keys were last arranged for
+    bool known = false;
+    Node last;
+    // The start of the range of keys held, the local node's own id while it holds all. A
+    // node configured with its neighbors keeps what it has, any other starts out alone.
+    Node configured;
+    bool window_known = !dht_predecessor(migrator->dht, &configured) || configured.id == self;
+    uint16_t held_from = self;
+    while (true) {
+        pause_ms(MIGRATION_POLL_MS);
+
+        Node pred;
+        if (!dht_predecessor(migrator->dht, &pred)) {
+            continue;
+        }
+        if (!known || pred.id == last.id) {
+            known = true;
+            last = pred;
+
+            // Only once the whole window is known, a shorter list may just be stale
+            Node predecessors[DHT_PREDECESSORS];
+            size_t n = dht_predecessors(migrator->dht, predecessors, migrator->n_replicas + 1);
+            if (n == 0) {
+                window_known = true;  // alone in the ring
+                held_from = self;
+            }
+            if (n < migrator->n_replicas + 1 || predecessors[0].id != last.id) {
+                continue;
+            }
+
+            // Keys are dropped as the window shrinks
+            uint16_t from = predecessors[migrator->n_replicas].id;
+            if (window_known && from != held_from && (held_from == self || in_range(from, held_from, self))) {
+                prune(migrator, held_from, from);
+            }
+            window_known = true;
+            held_from = from;
+            continue;
+        }
+
+        if (pred.id != self && in_range(pred.id, last.id, self)) {
+            if (!hand_over(migrator, last.id, &pred)) {
+                pause_ms(MIGRATION_RETRY_MS);
+                continue;
+            }
+        } else {
+            take_over(migrator, pred.id, last.id);
+        }
+        last = pred;
+    }
+    return NULL;
+}
+
+
+void migrator_start(struct migrator* migrator, struct store* store, struct dht* dht, struct peer_pool* pool,
+                    struct replicator* replicator) {
+    *migrator = (struct migrator) {
+        .store = store,
+        .dht = dht,
+        .pool = pool,
+        .replicator = replicator,
+        .n_replicas = replicator ? replicator->n_replicas : 0,
+    };
+
+    if (pthread_create(&(migrator->thread), NULL, migrator_run, migrator) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void migrator_leave(struct migrator* migrator) {
+    uint16_t self = migrator->dht->node->id;
+    Node successor;
+    if (dht_successors(migrator->dht, &successor, 1) == 0) {
+        return;  // alone in the ring
+    }
+
+    // All keys if the own range is not known
+    Node pred;
+    uint16_t from = dht_predecessor(migrator->dht, &pred) ? pred.id : self;
+    string* keys;
+    size_t n_keys = store_range(migrator->store, from, self, &keys);
+
+    logger_printf("Leaving, handing %zu keys over to %u at %s\n", n_keys, successor.id, successor.authority);
+    for (size_t first = 0; first < n_keys; first += MIGRATION_BATCH) {
+        size_t n = n_keys - first < MIGRATION_BATCH ? n_keys - first : MIGRATION_BATCH;
+        if (replica_transfer(migrator->store, migrator->pool, &successor, keys + first, n, false) != 0) {
+            logger_printf("Hand-over to %u at %s failed\n", successor.id, successor.authority);
+            break;
+        }
+        atomic_fetch_add(&(metrics.keys_migrated), n);
+    }
+    free_keys(keys, n_keys);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "data.h"
+#include "dht.h"
+#include "pool.h"
+#include "replica.h"
+
+#define MIGRATION_POLL_MS 100  // interval of checking whether the predecessor changed
+#define MIGRATION_RETRY_MS 1000  // delay before a failed hand-over is repeated
+#define MIGRATION_BATCH 64  // keys sent to the new owner before waiting for its replies
+#define MIGRATION_PAUSE 1  // pause after each batch, in multiples of the time the batch took
+
+
+/**
+ * Hands keys over to their new owner when the predecessor changes
+ *
+ * When a node joins as predecessor, it becomes responsible for the keys
+ * between the former predecessor and itself. These are scanned from the
+ * store in ring order and sent as batches of pipelined writes, marked with
+ * the REPLICA_HEADER, so the new node applies them even before it learned
+ * its own predecessor. Each batch is followed by a pause as long as it
+ * took, so a hand-over never takes more than half of the time of the
+ * sending thread, nor starves the receiving node's clients. The new node
+ * keeps values written to it meanwhile, see `set_handed_over()`.
+ *
+ * The local node holds the keys it is responsible for, and those it is a
+ * replica of: the keys after its `n_replicas`-th predecessor. Once that
+ * predecessor is known and the keys were handed over, keys before it are
+ * deleted, so a node that joined in front of the local one or one of its
+ * predecessors takes them off it.
+ *
+ * When the predecessor failed instead, the local node took over its keys,
+ * which it holds as replica if the ring keeps any; they are queued for
+ * replication, so the replication factor is restored. Without replicas
+ * the keys of a failed node are lost.
+ *
+ * `store`, `dht`: the local keys, and who the predecessors are
+ * `pool`: connections to the node keys are handed over to
+ * `replicator`: replication of local keys, or NULL
+ * `n_replicas`: number of predecessors whose keys the local node holds
+ * `thread`: the thread watching the predecessor and sending the keys
+ */
+struct migrator {
+    struct store* store;
+    struct dht* dht;
+    struct peer_pool* pool;
+    struct replicator* replicator;
+    size_t n_replicas;
+    pthread_t thread;
+};
+
+
+/**
+ * Start handing keys over whenever the predecessor of the local node changes
+ */
+void migrator_start(struct migrator* migrator, struct store* store, struct dht* dht, struct peer_pool* pool,
+                    struct replicator* replicator);
+
+/**
+ * Hand the keys the local node is responsible for over to its successor,
+ * before it leaves the ring
+ *
+ * The successor applies them unconditionally, and takes them over once it
+ * notices the local node is gone. Writes the local node receives meanwhile
+ * may be lost. Blocks until the successor applied them, or failed.
+ */
+void migrator_leave(struct migrator* migrator);
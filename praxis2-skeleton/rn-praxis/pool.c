@@ -0,0 +1,273 @@
+/**
+ * Keep-alive connections to other nodes, see `struct peer_pool`.
+ */
+
+#include "pool.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "util.h"
+
+
+static bool same_node(const Node* a, const Node* b) {
+    return a->id == b->id && a->addr.sin_addr.s_addr == b->addr.sin_addr.s_addr && a->addr.sin_port == b->addr.sin_port;
+}
+
+
+/**
+ * The connections to `node`, replacing the least recently used peer if it
+ * has none yet. The caller holds the lock.
+ */
+static struct pool_peer* find_peer(struct peer_pool* pool, const Node* node) {
+    size_t oldest = 0;
+    for (size_t i = 0; i < pool->n_peers; i += 1) {
+        if (same_node(&(pool->peers[i].node), node)) {
+            return &(pool->peers[i]);
+        }
+        if (pool->peers[i].used < pool->peers[oldest].used) {
+            oldest = i;
+        }
+    }
+
+    struct pool_peer* peer;
+    if (pool->n_peers < POOL_PEERS) {
+        peer = &(pool->peers[pool->n_peers]);
+        pool->n_peers += 1;
+    } else {
+        peer = &(pool->peers[oldest]);
+        for (size_t i = 0; i < peer->n_idle; i += 1) {
+            close(peer->idle[i]);
+        }
+    }
+    *peer = (struct pool_peer) {
+        .node = *node,
+        .used = monotonic_ms(),
+    };
+    return peer;
+}
+
+
+/**
+ * Whether an idle connection is still open: the peer sends nothing unasked,
+ * so anything readable is its end of the connection
+ */
+static bool alive(int sock) {
+    char byte;
+    ssize_t n = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+
+/**
+ * Note that a connection to `node` could not be opened or failed right away.
+ * The caller holds the lock.
+ */
+static void record_failure(struct peer_pool* pool, const Node* node, uint64_t now) {
+    struct pool_peer* peer = find_peer(pool, node);
+    peer->failures += 1;
+    unsigned factor = peer->failures < POOL_MAX_BACKOFF ? peer->failures : POOL_MAX_BACKOFF;
+    peer->down_until = now + (uint64_t) POOL_BACKOFF_MS * factor;
+}
+
+
+/**
+ * Open a blocking connection to `node`, with timeouts so a failed peer cannot stall the sender
+ */
+static int open_connection(const Node* node) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    struct timeval timeout = {
+        .tv_sec = POOL_TIMEOUT_MS / 1000,
+        .tv_usec = (POOL_TIMEOUT_MS % 1000) * 1000,
+    };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));  // also bounds connect()
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(sock, (const struct sockaddr*) &(node->addr), sizeof(node->addr)) == -1) {
+        logger_printf("Cannot connect to %s: %s\n", node->authority, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+
+/**
+ * Keep `sock` as idle connection of `peer`, returns false if enough are kept
+ * already. The caller holds the lock.
+ */
+static bool keep_idle(struct pool_peer* peer, int sock, uint64_t now) {
+    if (peer->n_idle == POOL_IDLE) {
+        return false;
+    }
+    peer->idle[peer->n_idle] = sock;
+    peer->idle_since[peer->n_idle] = now;
+    peer->n_idle += 1;
+    return true;
+}
+
+
+/**
+ * Open a connection to each of the first `warm` successors without one
+ */
+static void warm_up(struct peer_pool* pool) {
+    Node successors[DHT_SUCCESSORS];
+    size_t n = dht_successors(pool->dht, successors, pool->warm);
+
+    for (size_t i = 0; i < n; i += 1) {
+        uint64_t now = monotonic_ms();
+        pthread_mutex_lock(&(pool->lock));
+        struct pool_peer* peer = find_peer(pool, &(successors[i]));
+        bool needed = peer->n_idle == 0 && now >= peer->down_until;
+        pthread_mutex_unlock(&(pool->lock));
+        if (!needed) {
+            continue;
+        }
+
+        int sock = open_connection(&(successors[i]));
+        atomic_fetch_add(&(metrics.peer_connections[sock == -1 ? POOL_FAILED : POOL_OPENED]), 1);
+        pthread_mutex_lock(&(pool->lock));
+        if (sock == -1) {
+            record_failure(pool, &(successors[i]), now);
+        } else if (keep_idle(find_peer(pool, &(successors[i])), sock, monotonic_ms())) {
+            sock = -1;
+        }
+        pthread_mutex_unlock(&(pool->lock));
+        if (sock != -1) {
+            close(sock);
+        }
+    }
+}
+
+
+/**
+ * Close idle connections that were unused for too long, or closed by the peer
+ */
+static void prune(struct peer_pool* pool) {
+    uint64_t now = monotonic_ms();
+    pthread_mutex_lock(&(pool->lock));
+    for (size_t i = 0; i < pool->n_peers; i += 1) {
+        struct pool_peer* peer = &(pool->peers[i]);
+        size_t kept = 0;
+        for (size_t j = 0; j < peer->n_idle; j += 1) {
+            if (now - peer->idle_since[j] > POOL_IDLE_MS || !alive(peer->idle[j])) {
+                close(peer->idle[j]);
+                continue;
+            }
+            peer->idle[kept] = peer->idle[j];
+            peer->idle_since[kept] = peer->idle_since[j];
+            kept += 1;
+        }
+        peer->n_idle = kept;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+
+/**
+ * Keeps the successors connected and drops stale connections
+ */
+static void* pool_run(void* arg) {
+    struct peer_pool* pool = arg;
+
+    while (true) {
+        nanosleep(&(struct timespec) {
+            .tv_sec = POOL_MAINTENANCE_MS / 1000,
+            .tv_nsec = (POOL_MAINTENANCE_MS % 1000) * 1000000L,
+        }, NULL);
+
+        if (pool->warm > 0) {
+            warm_up(pool);
+        }
+        prune(pool);
+    }
+    return NULL;
+}
+
+
+void pool_start(struct peer_pool* pool, struct dht* dht, size_t warm) {
+    *pool = (struct peer_pool) {
+        .dht = dht,
+        .warm = warm < DHT_SUCCESSORS ? warm : DHT_SUCCESSORS,
+    };
+    pthread_mutex_init(&(pool->lock), NULL);
+
+    if (pthread_create(&(pool->thread), NULL, pool_run, pool) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+int pool_take(struct peer_pool* pool, const Node* node, bool* reused) {
+    uint64_t now = monotonic_ms();
+    pthread_mutex_lock(&(pool->lock));
+    struct pool_peer* peer = find_peer(pool, node);
+    peer->used = now;
+    while (peer->n_idle > 0) {
+        peer->n_idle -= 1;
+        int sock = peer->idle[peer->n_idle];
+        if (alive(sock)) {
+            pthread_mutex_unlock(&(pool->lock));
+            atomic_fetch_add(&(metrics.peer_connections[POOL_REUSED]), 1);
+            *reused = true;
+            return sock;
+        }
+        close(sock);
+    }
+    bool down = now < peer->down_until;
+    pthread_mutex_unlock(&(pool->lock));
+
+    *reused = false;
+    int sock = down ? -1 : open_connection(node);
+    if (sock == -1) {
+        atomic_fetch_add(&(metrics.peer_connections[POOL_FAILED]), 1);
+        if (!down) {
+            pthread_mutex_lock(&(pool->lock));
+            record_failure(pool, node, now);
+            pthread_mutex_unlock(&(pool->lock));
+        }
+        return -1;
+    }
+    atomic_fetch_add(&(metrics.peer_connections[POOL_OPENED]), 1);
+    return sock;
+}
+
+
+void pool_put(struct peer_pool* pool, const Node* node, int sock) {
+    uint64_t now = monotonic_ms();
+    pthread_mutex_lock(&(pool->lock));
+    struct pool_peer* peer = find_peer(pool, node);
+    peer->used = now;
+    peer->failures = 0;
+    peer->down_until = 0;
+    if (keep_idle(peer, sock, now)) {
+        sock = -1;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+
+    if (sock != -1) {
+        close(sock);
+    }
+}
+
+
+void pool_fail(struct peer_pool* pool, const Node* node, int sock, bool reused) {
+    close(sock);
+    if (!reused) {
+        pthread_mutex_lock(&(pool->lock));
+        record_failure(pool, node, monotonic_ms());
+        pthread_mutex_unlock(&(pool->lock));
+    }
+}
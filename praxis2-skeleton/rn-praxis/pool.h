@@ -0,0 +1,102 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dht.h"
+
+#define POOL_PEERS 16  // peers connections are kept to, the least recently used one is dropped
+#define POOL_IDLE 4  // idle connections kept per peer
+#define POOL_IDLE_MS 30000  // idle connections unused for this long are closed
+#define POOL_TIMEOUT_MS 2000  // a peer not answering within this time fails the exchange
+#define POOL_BACKOFF_MS 500  // a peer that failed is not connected to again for this long, times its failures
+#define POOL_MAX_BACKOFF 8  // failures the backoff grows with at most
+#define POOL_MAINTENANCE_MS 500  // interval of warming and pruning connections
+
+
+/**
+ * Connections to one peer
+ *
+ * `node`: the peer, identified by its ID and address together
+ * `idle`: connected sockets not in use, `n_idle` of them, the most
+ *         recently returned last
+ * `idle_since`: time each of `idle` was returned (milliseconds, monotonic)
+ * `used`: time a connection was last taken or returned (milliseconds, monotonic)
+ * `failures`: consecutive connections that could not be opened or failed
+ *             before the peer answered, 0 while the peer is healthy
+ * `down_until`: no connections are opened before this time (milliseconds,
+ *               monotonic)
+ */
+struct pool_peer {
+    Node node;
+    int idle[POOL_IDLE];
+    uint64_t idle_since[POOL_IDLE];
+    size_t n_idle;
+    uint64_t used;
+    unsigned failures;
+    uint64_t down_until;
+};
+
+
+/**
+ * Keep-alive TCP connections to other nodes, shared by all node-to-node
+ * HTTP traffic: replication, forwarded requests and handed over keys
+ *
+ * A sender takes a connection, uses it for one exchange of blocking
+ * requests and replies, and returns it; other senders meanwhile take
+ * other connections to the same peer, or open new ones. Of the returned
+ * ones, up to POOL_IDLE per peer are kept, so traffic rarely waits for a
+ * TCP handshake.
+ *
+ * A background thread warms the pool, keeping one idle connection open to
+ * each of the first `warm` successors, the nodes replication and lookups
+ * talk to most, and closes connections idle for longer than POOL_IDLE_MS.
+ * Connections the peer closed meanwhile are detected when taken and
+ * replaced. A peer that cannot be connected to, or fails an exchange on a
+ * new connection, is considered down for a backoff growing with each
+ * consecutive failure, so senders fail fast instead of waiting for
+ * timeouts; the first exchange it answers makes it healthy again.
+ *
+ * `dht`: tells which the successors are
+ * `warm`: number of successors kept connected
+ * `lock`: guards `peers` and `n_peers`
+ * `peers`: the peers connected to lately, `n_peers` of them
+ * `thread`: the thread warming and pruning the pool
+ */
+struct peer_pool {
+    struct dht* dht;
+    size_t warm;
+    pthread_mutex_t lock;
+    struct pool_peer peers[POOL_PEERS];
+    size_t n_peers;
+    pthread_t thread;
+};
+
+
+/**
+ * Initialize the pool, and start warming it if `warm` is not 0
+ */
+void pool_start(struct peer_pool* pool, struct dht* dht, size_t warm);
+
+/**
+ * Take a connection to `peer`: a kept one if there is any, otherwise a new one
+ *
+ * `reused` tells which it is. The socket is blocking, with timeouts of
+ * POOL_TIMEOUT_MS. Returns -1 if the peer cannot be reached or is down.
+ */
+int pool_take(struct peer_pool* pool, const Node* peer, bool* reused);
+
+/**
+ * Return a connection to `peer` after a complete exchange, the peer is healthy
+ */
+void pool_put(struct peer_pool* pool, const Node* peer, int sock);
+
+/**
+ * Close a connection to `peer` that failed
+ *
+ * If it was new, the peer is considered down for a while. A kept one may
+ * just have been closed by the peer, that does not count.
+ */
+void pool_fail(struct peer_pool* pool, const Node* peer, int sock, bool reused);
@@ -0,0 +1,298 @@
+/**
+ * Forwarding of requests to the node responsible for their key, see
+ * `struct proxy`.
+ */
+
+#include "proxy.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "logger.h"
+
+
+/**
+ * Number of body bytes announced by the reply header at `header`, 0 if none
+ */
+static size_t content_length(const char* header, size_t length) {
+    const char* line = memchr(header, '\n', length);
+    while (line && (size_t) (line + 1 - header) < length) {
+        line += 1;
+        static const char name[] = "Content-Length:";
+        if ((size_t) (header + length - line) > sizeof(name) && strncasecmp(line, name, sizeof(name) - 1) == 0) {
+            return strtoull(line + sizeof(name) - 1, NULL, 10);
+        }
+        line = memchr(line, '\n', header + length - line);
+    }
+    return 0;
+}
+
+
+/**
+ * Outcome of forwarding a request over one connection
+ */
+enum exchange_result {
+    EXCHANGE_DONE,  // the complete reply was received
+    EXCHANGE_FAILED,  // the connection failed, the request may be repeated on another one
+    EXCHANGE_REFUSED,  // the peer answered, but its reply cannot be stored to be forwarded
+};
+
+
+/**
+ * Write `n` bytes at `data` to `value`, at `offset`
+ */
+static bool value_write(struct value* value, size_t offset, const char* data, size_t n) {
+    if (value->file == -1) {
+        memcpy(value->data + offset, data, n);
+        return true;
+    }
+
+    while (n > 0) {
+        ssize_t written = pwrite(value->file, data, n, offset);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite");
+            return false;
+        }
+        data += written;
+        n -= written;
+        offset += written;
+    }
+    return true;
+}
+
+
+/**
+ * Send `request` over `sock` and receive the complete reply
+ *
+ * The reply body is received into a value of the store, which spills large
+ * bodies to a temporary file like uploads. The reply is refused if that
+ * value cannot be allocated or written.
+ */
+static enum exchange_result exchange(struct proxy* proxy, int sock, struct proxy_request* request) {
+    struct value* value = request->value;
+    size_t body_length = value ? value->length : request->body_length;
+
+    char header[HTTP_MAX_SIZE];
+    int header_length = snprintf(header, sizeof(header),
+                                 "%s %s HTTP/1.1\r\nHost: %s\r\n" PROXY_HEADER ": 1\r\nContent-Length: %zu\r\n\r\n",
+                                 request->method, request->uri, request->peer.authority, body_length);
+    if (header_length < 0 || (size_t) header_length >= sizeof(header) || !send_all(sock, header, header_length)) {
+        return EXCHANGE_FAILED;
+    }
+    bool sent;
+    if (value == NULL) {
+        sent = send_all(sock, request->body, request->body_length);
+    } else if (value->file == -1) {
+        sent = send_all(sock, value->data, value->length);
+    } else {
+        sent = send_file(sock, value->file, value->length);  // large bodies are sent straight from their file
+    }
+    if (!sent) {
+        return EXCHANGE_FAILED;
+    }
+
+    // The reply header, and possibly the start of the body
+    char buffer[HTTP_MAX_SIZE];
+    size_t received = 0;
+    char* end = NULL;
+    while (end == NULL) {
+        if (received == sizeof(buffer)) {
+            return EXCHANGE_FAILED;
+        }
+        ssize_t n = recv(sock, buffer + received, sizeof(buffer) - received, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return EXCHANGE_FAILED;
+        }
+        received += n;
+        end = memstr(buffer, received, "\r\n\r\n");
+    }
+
+    size_t reply_length = end + 4 - buffer;
+    size_t reply_body_length = content_length(buffer, reply_length);
+    size_t early = received - reply_length < reply_body_length ? received - reply_length : reply_body_length;
+    struct value* reply_body = value_alloc(request->uri, reply_body_length, proxy->store);
+    if (reply_body == NULL) {
+        return EXCHANGE_REFUSED;
+    }
+    char* reply = malloc(reply_length);
+    if (reply == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(reply, buffer, reply_length);
+
+    // Bodies held in memory are received in place, file-backed ones through `buffer`
+    enum exchange_result result = value_write(reply_body, 0, buffer + reply_length, early) ? EXCHANGE_DONE
+                                                                                            : EXCHANGE_REFUSED;
+    for (size_t body_received = early; result == EXCHANGE_DONE && body_received < reply_body_length;) {
+        size_t wanted = reply_body_length - body_received;
+        char* target = reply_body->data + body_received;
+        if (reply_body->file != -1) {
+            wanted = wanted < sizeof(buffer) ? wanted : sizeof(buffer);
+            target = buffer;
+        }
+        ssize_t n = recv(sock, target, wanted, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            result = EXCHANGE_FAILED;
+        } else if (reply_body->file != -1 && !value_write(reply_body, body_received, buffer, n)) {
+            result = EXCHANGE_REFUSED;
+        } else {
+            body_received += n;
+        }
+    }
+    if (result != EXCHANGE_DONE) {
+        free(reply);
+        release(proxy->store, reply_body->data);
+        return result;
+    }
+
+    request->reply = reply;
+    request->reply_length = reply_length;
+    request->reply_body = reply_body;
+    return EXCHANGE_DONE;
+}
+
+
+/**
+ * Forward `request` and receive the reply, over a kept connection if possible
+ */
+static void forward(struct proxy* proxy, struct proxy_request* request) {
+    request->failed = true;
+    bool reused = true;
+    while (reused) {
+        int sock = pool_take(proxy->pool, &(request->peer), &reused);
+        if (sock == -1) {
+            break;
+        }
+        enum exchange_result result = exchange(proxy, sock, request);
+        if (result == EXCHANGE_DONE) {
+            pool_put(proxy->pool, &(request->peer), sock);
+            request->failed = false;
+            break;
+        }
+        if (result == EXCHANGE_REFUSED) {
+            close(sock);  // the rest of the reply is not read, but the peer is healthy
+            break;
+        }
+        pool_fail(proxy->pool, &(request->peer), sock, reused);
+    }
+
+    if (request->value) {
+        release(proxy->store, request->value->data);
+        request->value = NULL;
+    }
+    if (request->failed) {
+        logger_printf("Forwarding %s %s to %s failed\n", request->method, request->uri, request->peer.authority);
+    }
+}
+
+
+/**
+ * Forwards queued requests, one at a time
+ */
+static void* proxy_run(void* arg) {
+    struct proxy* proxy = arg;
+
+    while (true) {
+        pthread_mutex_lock(&(proxy->lock));
+        while (proxy->first == NULL) {
+            pthread_cond_wait(&(proxy->queued), &(proxy->lock));
+        }
+        struct proxy_request* request = proxy->first;
+        proxy->first = request->next;
+        if (proxy->first == NULL) {
+            proxy->last = NULL;
+        }
+        pthread_mutex_unlock(&(proxy->lock));
+
+        request->next = NULL;
+        forward(proxy, request);
+        proxy->done(request);
+    }
+    return NULL;
+}
+
+
+void proxy_start(struct proxy* proxy, struct store* store, struct peer_pool* pool,
+                 void (*done)(struct proxy_request* request)) {
+    *proxy = (struct proxy) {
+        .store = store,
+        .pool = pool,
+        .done = done,
+    };
+    pthread_mutex_init(&(proxy->lock), NULL);
+    pthread_cond_init(&(proxy->queued), NULL);
+
+    for (size_t i = 0; i < PROXY_THREADS; i += 1) {
+        if (pthread_create(&(proxy->threads[i]), NULL, proxy_run, proxy) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+struct proxy_request* proxy_request_new(const char* method, const char* uri, const char* body, size_t body_length,
+                                        struct value* value) {
+    struct proxy_request* request = calloc(1, sizeof(struct proxy_request));
+    if (request == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    request->method = strdup(method);
+    request->uri = strdup(uri);
+    request->value = value;
+    if (value == NULL && body_length > 0) {
+        request->body = malloc(body_length);
+        if (request->body == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(request->body, body, body_length);
+        request->body_length = body_length;
+    }
+    return request;
+}
+
+
+void proxy_submit(struct proxy* proxy, struct proxy_request* request) {
+    request->next = NULL;
+    pthread_mutex_lock(&(proxy->lock));
+    if (proxy->last) {
+        proxy->last->next = request;
+    } else {
+        proxy->first = request;
+    }
+    proxy->last = request;
+    pthread_cond_signal(&(proxy->queued));
+    pthread_mutex_unlock(&(proxy->lock));
+}
+
+
+void proxy_request_free(struct proxy* proxy, struct proxy_request* request) {
+    if (request->value) {
+        release(proxy->store, request->value->data);
+    }
+    free(request->method);
+    free(request->uri);
+    free(request->body);
+    free(request->reply);
+    if (request->reply_body) {
+        release(proxy->store, request->reply_body->data);
+    }
+    free(request);
+}
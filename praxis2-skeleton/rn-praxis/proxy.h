@@ -0,0 +1,115 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "data.h"
+#include "dht.h"
+#include "pool.h"
+
+#define PROXY_HEADER "X-Proxied"  // marks requests forwarded by another node, which are never forwarded again
+#define PROXY_THREADS 8  // requests forwarded concurrently
+
+
+/**
+ * A request forwarded to the node responsible for its key
+ *
+ * Created by a worker, owned by the proxy from `proxy_submit()` until it is
+ * handed back through the `done` callback of the proxy.
+ *
+ * `owner`, `sock`, `generation`: identify the waiting connection, opaque to the proxy
+ * `peer`: the node the request is forwarded to
+ * `method`, `uri`: copies of the request's method and URI
+ * `body`: copy of a body received with the header, `body_length` bytes
+ * `value`: a body received into a value of the store instead, or NULL; it
+ *          is handed back to the store once sent
+ * `failed`: whether the peer could not be reached or did not answer, or
+ *           its reply body could not be stored
+ * `reply`: the header of the peer's reply, `reply_length` bytes
+ * `reply_body`: a value holding the body of the reply, file-backed above
+ *               the store's spill threshold; the reply to the client takes
+ *               over the reference
+ */
+struct proxy_request {
+    struct proxy_request* next;
+    void* owner;
+    int sock;
+    uint64_t generation;
+    Node peer;
+    char* method;
+    char* uri;
+    char* body;
+    size_t body_length;
+    struct value* value;
+    bool failed;
+    char* reply;
+    size_t reply_length;
+    struct value* reply_body;
+};
+
+
+/**
+ * Forwarding of requests for remote keys, instead of redirecting clients
+ *
+ * Workers hand requests to PROXY_THREADS threads, which send each one over
+ * a keep-alive connection of the `peer_pool` to the responsible node and receive
+ * the complete reply, while the client's connection stays parked. The
+ * reply is then handed back to the worker, which passes it on to the
+ * client unchanged. Reply bodies are received into values of the store,
+ * so bodies above its spill threshold go to a temporary file as uploads
+ * do, and are sent to the client from there. A request failing on a kept
+ * connection, which the peer may have closed meanwhile, is repeated on a
+ * new one.
+ *
+ * Forwarded requests carry the PROXY_HEADER, so a node that is not
+ * responsible either, because the ring changed meanwhile, redirects
+ * instead of forwarding them on.
+ *
+ * `store`: the store bodies are received into and handed back to
+ * `pool`: connections to the other nodes
+ * `done`: called with each request once its reply arrived or it failed
+ * `lock`: guards the queue
+ * `queued`: signalled when a request is queued
+ * `first`, `last`: requests waiting for a thread, in order
+ * `threads`: the threads forwarding requests
+ */
+struct proxy {
+    struct store* store;
+    struct peer_pool* pool;
+    void (*done)(struct proxy_request* request);
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    struct proxy_request* first;
+    struct proxy_request* last;
+    pthread_t threads[PROXY_THREADS];
+};
+
+
+/**
+ * Start the threads forwarding requests
+ */
+void proxy_start(struct proxy* proxy, struct store* store, struct peer_pool* pool,
+                 void (*done)(struct proxy_request* request));
+
+/**
+ * Prepare forwarding a request, copying `method`, `uri`, and the body
+ *
+ * The body is either `body_length` bytes at `body`, or `value`, whose
+ * reference the request takes over.
+ */
+struct proxy_request* proxy_request_new(const char* method, const char* uri, const char* body, size_t body_length,
+                                        struct value* value);
+
+/**
+ * Forward `request` to `request->peer`
+ *
+ * Safe to call from any thread.
+ */
+void proxy_submit(struct proxy* proxy, struct proxy_request* request);
+
+/**
+ * Free a request handed back by the proxy, or never submitted
+ */
+void proxy_request_free(struct proxy* proxy, struct proxy_request* request);
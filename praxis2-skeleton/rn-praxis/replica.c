@@ -0,0 +1,463 @@
+/**
+ * Replication of written keys to the successors of the responsible node.
+ *
+ * Writes are collected by URI and sent by a background thread as batches
+ * of pipelined HTTP requests, so a replica handles them like any client's
+ * requests, and a batch costs one round trip per replica.
+ */
+
+#include "replica.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+
+/**
+ * A growing buffer of requests to send
+ */
+struct buffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+};
+
+
+/**
+ * Make room for `length` more bytes
+ */
+static void buffer_reserve(struct buffer* buffer, size_t length) {
+    if (buffer->length + length <= buffer->capacity) {
+        return;
+    }
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->length + length) {
+        capacity *= 2;
+    }
+    buffer->data = realloc(buffer->data, capacity);
+    if (buffer->data == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    buffer->capacity = capacity;
+}
+
+
+static void buffer_append(struct buffer* buffer, const char* data, size_t length) {
+    buffer_reserve(buffer, length);
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+
+static void buffer_printf(struct buffer* buffer, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void buffer_printf(struct buffer* buffer, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    buffer_reserve(buffer, length + 1);  // vsnprintf() terminates the string
+    va_start(args, format);
+    vsnprintf(buffer->data + buffer->length, length + 1, format, args);
+    va_end(args);
+    buffer->length += length;
+}
+
+
+/**
+ * Receive the replies to `n` requests
+ *
+ * Replicas answer writes with an empty body, so a reply ends with its
+ * header. Returns the number of writes the replica did not apply, or -1 if
+ * the connection failed.
+ */
+static ssize_t receive_replies(int sock, size_t n) {
+    char buffer[4096];
+    size_t length = 0;
+    ssize_t failed = 0;
+
+    while (n > 0) {
+        char* end = memstr(buffer, length, "\r\n\r\n");
+        if (end == NULL) {
+            if (length == sizeof(buffer)) {
+                return -1;  // not a reply of a replica
+            }
+            ssize_t received = recv(sock, buffer + length, sizeof(buffer) - length, 0);
+            if (received == -1 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                return -1;
+            }
+            length += received;
+            continue;
+        }
+
+        // A DELETE of a key the replica never received leaves it as intended
+        int status = atoi(buffer + sizeof("HTTP/1.1"));
+        if (status / 100 != 2 && status != 404) {
+            failed += 1;
+        }
+        size_t consumed = end + 4 - buffer;
+        memmove(buffer, buffer + consumed, length - consumed);
+        length -= consumed;
+        n -= 1;
+    }
+    return failed;
+}
+
+
+/**
+ * Send the current state of the keys in `uris` over `sock` and wait for the replies
+ *
+ * The writes carry `mark` as value of the REPLICA_HEADER.
+ *
+ * Returns the number of writes the peer did not apply, or -1 if the
+ * connection failed.
+ */
+static ssize_t send_writes(struct store* store, int sock, char** uris, size_t n, const char* mark) {
+    struct buffer requests = {0};
+    bool sent = true;
+    for (size_t i = 0; i < n && sent; i += 1) {
+        size_t length;
+        const char* value = get(uris[i], store, &length);
+        if (value == NULL) {
+            buffer_printf(&requests, "DELETE %s HTTP/1.1\r\n" REPLICA_HEADER ": %s\r\nContent-Length: 0\r\n\r\n",
+                          uris[i], mark);
+            continue;
+        }
+
+        buffer_printf(&requests, "PUT %s HTTP/1.1\r\n" REPLICA_HEADER ": %s\r\nContent-Length: %zu\r\n\r\n", uris[i],
+                      mark, length);
+        int file = value_file(value);
+        if (file == -1) {
+            buffer_append(&requests, value, length);
+        } else {
+            // Large values are sent straight from their file
+            sent = send_all(sock, requests.data, requests.length) && send_file(sock, file, length);
+            requests.length = 0;
+        }
+        release(store, value);
+    }
+    sent = sent && send_all(sock, requests.data, requests.length);
+    free(requests.data);
+
+    return sent ? receive_replies(sock, n) : -1;
+}
+
+
+ssize_t replica_transfer(struct store* store, struct peer_pool* pool, const Node* peer, char** uris, size_t n,
+                         bool handover) {
+    // A kept connection may have been closed by the peer, the writes are repeated on a new one then
+    bool reused = true;
+    while (reused) {
+        int sock = pool_take(pool, peer, &reused);
+        if (sock == -1) {
+            return -1;
+        }
+        ssize_t failed = send_writes(store, sock, uris, n, handover ? REPLICA_HANDOVER : "1");
+        if (failed != -1) {
+            pool_put(pool, peer, sock);
+            return failed;
+        }
+        pool_fail(pool, peer, sock, reused);
+    }
+    return -1;
+}
+
+
+/**
+ * Send the current state of the keys in `uris` to a replica and wait until
+ * it applied them
+ *
+ * Returns false if the connection failed.
+ */
+static bool channel_send(struct replicator* replicator, struct replica_channel* channel, char** uris, size_t n) {
+    uint64_t start = monotonic_us();
+    ssize_t failed = replica_transfer(replicator->store, replicator->pool, &(channel->peer), uris, n, false);
+    if (failed == -1) {
+        logger_printf("Replica %s failed, dropping %zu writes\n", channel->peer.authority, n);
+        atomic_fetch_add(&(metrics.replica_writes[REPLICA_FAILED]), n);
+        return false;
+    }
+    atomic_fetch_add(&(metrics.replica_writes[REPLICA_FAILED]), failed);
+    atomic_fetch_add(&(metrics.replica_writes[REPLICA_APPLIED]), n - failed);
+
+    // Exponentially weighted moving average of the time per write
+    uint64_t sample = (monotonic_us() - start) / n + 1;
+    uint64_t latency = atomic_load(&(channel->latency));
+    atomic_store(&(channel->latency), latency ? (latency * 7 + sample) / 8 : sample);
+    return true;
+}
+
+
+/**
+ * Forget the keys still to be sent to a former or replaced replica
+ */
+static void resync_clear(struct replica_channel* channel) {
+    for (size_t i = channel->resync_sent; i < channel->n_resync; i += 1) {
+        free(channel->resync[i]);
+    }
+    free(channel->resync);
+    channel->resync = NULL;
+    channel->n_resync = 0;
+    channel->resync_sent = 0;
+}
+
+
+/**
+ * Collect the local keys for a node that just became a replica
+ */
+static void resync_start(struct replicator* replicator, struct replica_channel* channel) {
+    uint16_t self = replicator->dht->node->id;
+    Node pred;
+    uint16_t from = dht_predecessor(replicator->dht, &pred) ? pred.id : self;
+
+    resync_clear(channel);
+    channel->n_resync = store_range(replicator->store, from, self, &(channel->resync));
+}
+
+
+/**
+ * Send the next batch of keys a new replica is missing
+ *
+ * Returns true while keys remain to be sent.
+ */
+static bool resync_step(struct replicator* replicator, struct replica_channel* channel) {
+    if (channel->resync_sent == channel->n_resync) {
+        return false;
+    }
+
+    size_t remaining = channel->n_resync - channel->resync_sent;
+    size_t n = remaining < REPLICA_BATCH ? remaining : REPLICA_BATCH;
+    bool sent = channel_send(replicator, channel, channel->resync + channel->resync_sent, n);
+    for (size_t i = 0; i < n; i += 1) {
+        free(channel->resync[channel->resync_sent + i]);
+    }
+    channel->resync_sent += n;
+    if (!sent || channel->resync_sent == channel->n_resync) {
+        resync_clear(channel);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Follow changes of the successor list: replicas that are no longer among
+ * the successors are replaced, and their latency forgotten
+ *
+ * Sets `added[i]` if the node of channel `i` just became a replica.
+ */
+static void update_channels(struct replicator* replicator, bool added[DHT_SUCCESSORS]) {
+    Node successors[DHT_SUCCESSORS];
+    size_t n = dht_successors(replicator->dht, successors, replicator->n_replicas);
+
+    pthread_mutex_lock(&(replicator->lock));
+    for (size_t i = 0; i < DHT_SUCCESSORS; i += 1) {
+        struct replica_channel* channel = &(replicator->channels[i]);
+        bool same = i < replicator->n_channels && i < n && channel->peer.id == successors[i].id
+                    && channel->peer.addr.sin_addr.s_addr == successors[i].addr.sin_addr.s_addr
+                    && channel->peer.addr.sin_port == successors[i].addr.sin_port;
+        added[i] = !same && i < n;
+        if (!same) {
+            atomic_store(&(channel->latency), 0);
+            if (i < n) {
+                channel->peer = successors[i];
+            }
+        }
+    }
+    replicator->n_channels = n;
+    pthread_mutex_unlock(&(replicator->lock));
+}
+
+
+/**
+ * Waits for written keys and sends them to all replicas in batches
+ */
+static void* replicator_run(void* arg) {
+    struct replicator* replicator = arg;
+
+    bool resyncing = false;
+    while (true) {
+        pthread_mutex_lock(&(replicator->lock));
+        if (replicator->n_queued == 0 && !resyncing) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += REPLICA_REFRESH_MS / 1000;
+            deadline.tv_nsec += (REPLICA_REFRESH_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&(replicator->queued), &(replicator->lock), &deadline);
+        }
+        char** uris = replicator->queue;
+        size_t n_uris = replicator->n_queued;
+        replicator->queue = NULL;
+        replicator->n_queued = 0;
+        replicator->capacity = 0;
+        if (n_uris > 0) {
+            memset(replicator->index, 0, replicator->index_capacity * sizeof(char*));
+        }
+        pthread_mutex_unlock(&(replicator->lock));
+
+        // Channels are only changed by this thread, so they are used without the lock
+        bool added[DHT_SUCCESSORS];
+        update_channels(replicator, added);
+        for (size_t i = 0; i < DHT_SUCCESSORS; i += 1) {
+            if (added[i]) {
+                resync_start(replicator, &(replicator->channels[i]));
+            } else if (i >= replicator->n_channels) {
+                resync_clear(&(replicator->channels[i]));
+            }
+        }
+
+        for (size_t first = 0; first < n_uris; first += REPLICA_BATCH) {
+            size_t n = n_uris - first < REPLICA_BATCH ? n_uris - first : REPLICA_BATCH;
+            for (size_t i = 0; i < replicator->n_channels; i += 1) {
+                channel_send(replicator, &(replicator->channels[i]), uris + first, n);
+            }
+        }
+
+        for (size_t i = 0; i < n_uris; i += 1) {
+            free(uris[i]);
+        }
+        free(uris);
+
+        // Only the new replicas catch up, the others have the keys already
+        resyncing = false;
+        for (size_t i = 0; i < replicator->n_channels; i += 1) {
+            resyncing = resync_step(replicator, &(replicator->channels[i])) || resyncing;
+        }
+    }
+    return NULL;
+}
+
+
+void replicator_start(struct replicator* replicator, struct store* store, struct dht* dht, struct peer_pool* pool,
+                      size_t n_replicas) {
+    *replicator = (struct replicator) {
+        .store = store,
+        .dht = dht,
+        .pool = pool,
+        .n_replicas = n_replicas < DHT_SUCCESSORS ? n_replicas : DHT_SUCCESSORS,
+    };
+    for (size_t i = 0; i < DHT_SUCCESSORS; i += 1) {
+        atomic_init(&(replicator->channels[i].latency), 0);
+    }
+    atomic_init(&(replicator->next), 0);
+
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&(replicator->queued), &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_mutex_init(&(replicator->lock), NULL);
+
+    if (pthread_create(&(replicator->thread), NULL, replicator_run, replicator) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * The slot of the index holding `uri`, or the empty slot it would take
+ *
+ * The caller holds the lock.
+ */
+static char** index_find(struct replicator* replicator, const char* uri) {
+    const size_t mask = replicator->index_capacity - 1;
+    for (size_t i = fnv1a(uri) & mask; ; i = (i + 1) & mask) {
+        char** slot = &(replicator->index[i]);
+        if (*slot == NULL || strcmp(*slot, uri) == 0) {
+            return slot;
+        }
+    }
+}
+
+
+/**
+ * Rebuild the index with `capacity` slots from the queue, the caller holds the lock
+ */
+static void index_grow(struct replicator* replicator, size_t capacity) {
+    free(replicator->index);
+    replicator->index = calloc(capacity, sizeof(char*));
+    if (replicator->index == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    replicator->index_capacity = capacity;
+    for (size_t i = 0; i < replicator->n_queued; i += 1) {
+        *index_find(replicator, replicator->queue[i]) = replicator->queue[i];
+    }
+}
+
+
+void replicator_queue(struct replicator* replicator, const char* uri) {
+    pthread_mutex_lock(&(replicator->lock));
+    if (2 * (replicator->n_queued + 1) > replicator->index_capacity) {
+        index_grow(replicator, replicator->index_capacity ? 2 * replicator->index_capacity : 128);
+    }
+
+    // The batch sends the key's state at that time, once is enough
+    char** slot = index_find(replicator, uri);
+    if (*slot) {
+        pthread_mutex_unlock(&(replicator->lock));
+        return;
+    }
+    char* copy = strdup(uri);
+    if (copy == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    *slot = copy;
+
+    if (replicator->n_queued == replicator->capacity) {
+        replicator->capacity = replicator->capacity ? replicator->capacity * 2 : 64;
+        replicator->queue = realloc(replicator->queue, replicator->capacity * sizeof(char*));
+        if (replicator->queue == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    replicator->queue[replicator->n_queued] = copy;
+    replicator->n_queued += 1;
+    if (replicator->n_queued == 1) {
+        pthread_cond_signal(&(replicator->queued));
+    }
+    pthread_mutex_unlock(&(replicator->lock));
+}
+
+
+bool replicator_pick(struct replicator* replicator, Node* replica) {
+    pthread_mutex_lock(&(replicator->lock));
+    size_t n = replicator->n_channels;
+    if (n == 0) {
+        pthread_mutex_unlock(&(replicator->lock));
+        return false;
+    }
+
+    // Start at a rotating index, so replicas of equal latency share the reads
+    size_t first = atomic_fetch_add_explicit(&(replicator->next), 1, memory_order_relaxed) % n;
+    size_t best = first;
+    for (size_t i = 1; i < n; i += 1) {
+        size_t index = (first + i) % n;
+        if (atomic_load(&(replicator->channels[index].latency)) < atomic_load(&(replicator->channels[best].latency))) {
+            best = index;
+        }
+    }
+    *replica = replicator->channels[best].peer;
+    pthread_mutex_unlock(&(replicator->lock));
+    return true;
+}
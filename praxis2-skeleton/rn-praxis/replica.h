@@ -0,0 +1,119 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "data.h"
+#include "dht.h"
+#include "pool.h"
+
+#define REPLICA_HEADER "X-Replica"  // internal: marks writes between neighbors applied without being responsible
+#define REPLICA_HANDOVER "handover"  // REPLICA_HEADER value of writes handing keys over to a node that joined
+#define REPLICA_BATCH 256  // writes sent to a replica before waiting for their replies
+#define REPLICA_REFRESH_MS 1000  // replicas are re-read from the successor list at least this often
+
+
+/**
+ * One replica of the local keys
+ *
+ * `peer`: the replica, one of the successors of the local node
+ * `latency`: moving average of the time the replica took per write
+ *            (microseconds), 0 until it acknowledged a batch
+ * `resync`: local keys written before the peer became a replica, still to
+ *           be sent to it, `n_resync` of them, the first `resync_sent` sent
+ */
+struct replica_channel {
+    Node peer;
+    atomic_uint_fast64_t latency;
+    string* resync;
+    size_t n_resync;
+    size_t resync_sent;
+};
+
+
+/**
+ * Asynchronous propagation of writes to the replicas of local keys
+ *
+ * The replicas of a key are the `n_replicas` nodes succeeding the one
+ * responsible for it. Workers only queue the URIs of written keys. A
+ * background thread sends the state of each key at that time, a PUT with
+ * the value or a DELETE once it is gone, to every replica, as pipelined
+ * requests over a keep-alive connection of the pool. A key is queued at
+ * most once per batch, so repeated writes to it before the batch is sent
+ * cost the replicas a single write.
+ *
+ * When a node becomes a replica, it is sent all local keys as well, a batch
+ * after each batch of writes, so it catches up without holding those back.
+ *
+ * Replication is best effort: writes to a replica that cannot be reached
+ * are dropped, and a replica may lag behind by a batch.
+ *
+ * `store`, `dht`: where values are read from, and who the successors are
+ * `pool`: connections to the replicas
+ * `n_replicas`: number of replicas per key, the replication factor minus one
+ * `lock`: guards the queue, its index and the peers of `channels`
+ * `queued`: signalled when the queue becomes non-empty
+ * `queue`: URIs written since the last batch, `capacity` entries allocated
+ * `index`: open-addressing set of the URIs in `queue`, `index_capacity`
+ *          slots, a power of two with at least twice as many as are queued
+ * `channels`: the replicas in ring order, `n_channels` of them; fewer than
+ *             `n_replicas` if the ring is smaller
+ * `next`: rotates among replicas of equal latency
+ * `thread`: the thread sending the writes
+ */
+struct replicator {
+    struct store* store;
+    struct dht* dht;
+    struct peer_pool* pool;
+    size_t n_replicas;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    char** queue;
+    size_t n_queued;
+    size_t capacity;
+    char** index;
+    size_t index_capacity;
+    struct replica_channel channels[DHT_SUCCESSORS];
+    size_t n_channels;
+    atomic_size_t next;
+    pthread_t thread;
+};
+
+
+/**
+ * Start replicating the writes queued with `replicator_queue()` to the next
+ * `n_replicas` successors, at most DHT_SUCCESSORS
+ */
+void replicator_start(struct replicator* replicator, struct store* store, struct dht* dht, struct peer_pool* pool,
+                      size_t n_replicas);
+
+/**
+ * Queue the key `uri` for replication after it was set or deleted
+ *
+ * Safe to call from any thread.
+ */
+void replicator_queue(struct replicator* replicator, const char* uri);
+
+/**
+ * Choose the replica to redirect a read to: the one that acknowledged
+ * writes the fastest lately
+ *
+ * Returns false if there is no replica. Safe to call from any thread.
+ */
+bool replicator_pick(struct replicator* replicator, Node* replica);
+
+/**
+ * Send the current state of the keys in `uris` to `peer` over a connection
+ * of `pool`, and wait until it applied them
+ *
+ * The writes carry the REPLICA_HEADER, so the peer applies them whether or
+ * not it considers itself responsible. With `handover` they are marked as
+ * REPLICA_HANDOVER, and the peer keeps values written to it in the meantime.
+ * Returns the number of writes the peer did not apply, or -1 if it could
+ * not be reached.
+ */
+ssize_t replica_transfer(struct store* store, struct peer_pool* pool, const Node* peer, char** uris, size_t n,
+                         bool handover);
@@ -15,6 +15,8 @@ op_names = {
     [2] = "Stabilize",
     [3] = "Notify",
     [4] = "Join",
+    [5] = "Successor",
+    [6] = "Predecessor",
 }
 
 function info_text(buffer, pinfo)
@@ -29,6 +31,8 @@ function info_text(buffer, pinfo)
         desc = string.format(" of 0x%02x@%s:%u", buffer(3, 2):uint(), buffer(5, 4):ipv4(), buffer(9, 2):uint())
     elseif name == "Join" then
         desc = string.format(" from 0x%02x@%s:%u", buffer(3, 2):uint(), buffer(5, 4):ipv4(), buffer(9, 2):uint())
+    elseif name == "Successor" or name == "Predecessor" then
+        desc = string.format(" %u: 0x%02x@%s:%u", buffer(1, 2):uint(), buffer(3, 2):uint(), buffer(5, 4):ipv4(), buffer(9, 2):uint())
     end
     local suffix = string.format(" (%s:%u → %s:%u)", pinfo.src, pinfo.src_port, pinfo.dst, pinfo.dst_port)
     return name .. desc .. suffix
@@ -0,0 +1,132 @@
+#include "slab.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define LARGE_ROUNDING 4096
+
+
+/**
+ * Index of the smallest size class holding `size` bytes
+ *
+ * Classes 0 to 2 hold 16, 24 and 32 bytes. Above that, each power of two
+ * `base` is split into four classes of `base + q * base / 4` bytes, `q` in
+ * 1..4. All capacities are multiples of 8, so carved chunks stay aligned.
+ */
+static size_t size_class(size_t size) {
+    if (size <= 32) {
+        return size <= SLAB_MIN_CHUNK ? 0 : (size + 7) / 8 - 2;
+    }
+    size_t k = 63 - __builtin_clzll(size - 1);  // base = 2^k < size <= 2^(k+1)
+    size_t base = (size_t) 1 << k;
+    size_t step = base / 4;
+    size_t q = (size - base + step - 1) / step;
+    return 2 + (k - 5) * 4 + q;
+}
+
+
+static size_t class_capacity(size_t index) {
+    if (index <= 2) {
+        return SLAB_MIN_CHUNK + index * 8;
+    }
+    size_t base = (size_t) 1 << (5 + (index - 3) / 4);
+    return base + ((index - 3) % 4 + 1) * (base / 4);
+}
+
+
+void slab_init(struct slab_allocator* allocator) {
+    *allocator = (struct slab_allocator) {0};
+}
+
+
+size_t slab_capacity(size_t size) {
+    if (size > SLAB_MAX_CHUNK) {
+        return (size + LARGE_ROUNDING - 1) / LARGE_ROUNDING * LARGE_ROUNDING;
+    }
+    return class_capacity(size_class(size));
+}
+
+
+void* slab_alloc(struct slab_allocator* allocator, size_t size, size_t* capacity) {
+    *capacity = slab_capacity(size);
+    allocator->bytes_live += size;
+
+    if (*capacity > SLAB_MAX_CHUNK) {
+        void* chunk = malloc(*capacity);
+        if (chunk == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        allocator->bytes_reserved += *capacity;
+        allocator->bytes_large += *capacity;
+        return chunk;
+    }
+
+    struct slab_class* class = &(allocator->classes[size_class(size)]);
+
+    // Recycle a released chunk first, chunks are linked through their first bytes
+    if (class->free_list) {
+        char* chunk = class->free_list;
+        memcpy(&(class->free_list), chunk, sizeof(char*));
+        return chunk;
+    }
+
+    // Carve from a fresh slab once the current one is exhausted; its rest stays unused
+    if (class->carve_left < *capacity) {
+        size_t slab_size = class->slab_size ? class->slab_size : SLAB_FIRST_SIZE;
+        while (slab_size < *capacity) {
+            slab_size *= 2;
+        }
+        class->carve = malloc(slab_size);
+        if (class->carve == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        class->carve_left = slab_size;
+        class->slab_size = slab_size < SLAB_SIZE ? slab_size * 2 : SLAB_SIZE;
+        allocator->n_slabs += 1;
+        allocator->bytes_reserved += slab_size;
+    }
+    char* chunk = class->carve;
+    class->carve += *capacity;
+    class->carve_left -= *capacity;
+    return chunk;
+}
+
+
+void slab_free(struct slab_allocator* allocator, void* chunk, size_t capacity, size_t size) {
+    if (chunk == NULL) {
+        return;
+    }
+    allocator->bytes_live -= size;
+
+    if (capacity > SLAB_MAX_CHUNK) {
+        free(chunk);
+        allocator->bytes_reserved -= capacity;
+        allocator->bytes_large -= capacity;
+        return;
+    }
+
+    struct slab_class* class = &(allocator->classes[size_class(capacity)]);
+    memcpy(chunk, &(class->free_list), sizeof(char*));
+    class->free_list = chunk;
+}
+
+
+bool slab_reuse(struct slab_allocator* allocator, size_t capacity, size_t old_size, size_t new_size) {
+    if (new_size > capacity || (new_size < capacity / 2 && slab_capacity(new_size) != capacity)) {
+        return false;
+    }
+    allocator->bytes_live = allocator->bytes_live - old_size + new_size;
+    return true;
+}
+
+
+struct slab_stats slab_stats(const struct slab_allocator* allocator) {
+    return (struct slab_stats) {
+        .bytes_live = allocator->bytes_live,
+        .bytes_wasted = allocator->bytes_reserved - allocator->bytes_live,
+        .n_slabs = allocator->n_slabs,
+        .bytes_large = allocator->bytes_large,
+    };
+}
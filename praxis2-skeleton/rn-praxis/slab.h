@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define SLAB_SIZE (64 * 1024)  // largest slab
+#define SLAB_FIRST_SIZE 1024  // first slab of a class, each further one doubles up to SLAB_SIZE
+#define SLAB_MIN_CHUNK 16
+#define SLAB_MAX_CHUNK (SLAB_SIZE / 2)
+#define SLAB_CLASSES 43  // 16, 24 and 32 bytes, then four classes per power of two up to SLAB_MAX_CHUNK
+
+
+/**
+ * Chunks of a single size class
+ *
+ * `free_list`: released chunks, linked through their first bytes
+ * `carve`: unused rest of the most recent slab of this class
+ * `carve_left`: number of bytes at `carve`
+ * `slab_size`: size of the next slab of this class, 0 before the first one
+ */
+struct slab_class {
+    char* free_list;
+    char* carve;
+    size_t carve_left;
+    size_t slab_size;
+};
+
+
+/**
+ * Allocator statistics
+ *
+ * `bytes_live`: requested bytes of all live allocations
+ * `bytes_wasted`: reserved but not holding live data: slack at the end of
+ *                 chunks, free chunks and not yet carved slab space
+ * `n_slabs`: number of slabs, of up to `SLAB_SIZE` bytes each
+ * `bytes_large`: bytes in allocations too large for slabs, included in the
+ *                numbers above
+ */
+struct slab_stats {
+    size_t bytes_live;
+    size_t bytes_wasted;
+    size_t n_slabs;
+    size_t bytes_large;
+};
+
+
+/**
+ * Size-classed slab allocator
+ *
+ * Requests up to `SLAB_MAX_CHUNK` bytes are rounded up to one of
+ * `SLAB_CLASSES` size classes spaced a quarter power of two apart (at most
+ * 25% slack) and carved from slabs, which are never returned to the
+ * system but recycled through per-class free lists. Larger requests are
+ * served by `malloc()`, rounded up to whole pages.
+ *
+ * The first slab of a class holds only SLAB_FIRST_SIZE bytes, and each
+ * further one twice as much as the one before, up to SLAB_SIZE. Every
+ * shard of the store has its own allocator, so the memory of classes that
+ * hold only a few chunks stays proportional to them.
+ *
+ * Chunks carry no header, callers pass the capacity reported on allocation
+ * back on release.
+ */
+struct slab_allocator {
+    struct slab_class classes[SLAB_CLASSES];
+    size_t bytes_live;
+    size_t bytes_reserved;
+    size_t bytes_large;
+    size_t n_slabs;
+};
+
+
+/**
+ * Initialize an allocator without any slabs
+ */
+void slab_init(struct slab_allocator* allocator);
+
+/**
+ * Number of bytes actually reserved for a request of `size` bytes
+ */
+size_t slab_capacity(size_t size);
+
+/**
+ * Allocate `size` bytes, storing the usable size of the chunk in `capacity`
+ *
+ * Exits the program if no memory is available.
+ */
+void* slab_alloc(struct slab_allocator* allocator, size_t size, size_t* capacity);
+
+/**
+ * Release a chunk that held `size` live bytes
+ */
+void slab_free(struct slab_allocator* allocator, void* chunk, size_t capacity, size_t size);
+
+/**
+ * Check whether a chunk holding `old_size` bytes may be reused for `new_size`
+ *
+ * That is the case if the new contents fit and either do not leave more
+ * than half of the chunk unused or would not get a smaller chunk anyway. On success, the statistics are updated to the new
+ * size and the caller overwrites the chunk in place.
+ */
+bool slab_reuse(struct slab_allocator* allocator, size_t capacity, size_t old_size, size_t new_size);
+
+/**
+ * Current allocator statistics
+ */
+struct slab_stats slab_stats(const struct slab_allocator* allocator);
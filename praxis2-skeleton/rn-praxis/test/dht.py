@@ -11,7 +11,7 @@ import util
 
 Peer = collections.namedtuple('Peer', ['id', 'ip', 'port'])
 Message = collections.namedtuple('Message', ['flags', 'id', 'peer'])
-Flags = enum.Enum('Flags', ['lookup', 'reply', 'stabilize', 'notify', 'join'], start=0)
+Flags = enum.Enum('Flags', ['lookup', 'reply', 'stabilize', 'notify', 'join', 'successor', 'predecessor'], start=0)
 message_format = "!BHH4sH"
 
 
@@ -0,0 +1,1259 @@
+import concurrent.futures
+import contextlib
+import os
+import socket
+import subprocess
+import threading
+import time
+from http.client import HTTPConnection
+
+import pytest
+
+import dht
+from util import KillOnExit, bytes_available
+
+
+@pytest.fixture
+def webserver(request):
+    """Return a function for webservers
+    """
+    def runner(*args, **kwargs):
+        """Spawn a webserver
+        """
+        return KillOnExit([request.config.getoption('executable'), *args], **kwargs)
+
+    return runner
+
+
+def test_concurrent_connections(webserver, port):
+    """
+    Test server serves several keep-alive clients at the same time
+    """
+
+    with webserver('127.0.0.1', f'{port}'), contextlib.ExitStack() as contexts:
+        conns = [
+            contexts.enter_context(contextlib.closing(HTTPConnection('localhost', port, timeout=2)))
+            for _ in range(16)
+        ]
+        for conn in conns:
+            conn.connect()
+
+        # Interleave requests, the first connection is never closed in between
+        for _ in range(2):
+            for conn in reversed(conns):
+                conn.request('GET', '/static/foo')
+                reply = conn.getresponse()
+                assert reply.status == 200
+                assert reply.read() == b'Foo'
+
+
+def test_connection_limit(webserver, port):
+    """
+    Test clients beyond the connection limit wait until a slot is free
+    """
+
+    with webserver('-c', '1', '127.0.0.1', f'{port}'), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=2)
+    ) as first:
+        first.connect()
+        first.request('GET', '/static/baz')
+        assert first.getresponse().read() == b'Baz'
+
+        second = socket.create_connection(('localhost', port), timeout=.5)
+        second.send(b'GET /static/bar HTTP/1.1\r\n\r\n')
+
+        first.request('GET', '/static/foo')
+        reply = first.getresponse()
+        assert reply.read() == b'Foo'
+
+        with pytest.raises(socket.timeout):
+            second.recv(1024)
+
+        first.close()
+        second.settimeout(2)
+        assert second.recv(1024).startswith(b'HTTP/1.1 200')
+        second.close()
+
+
+def test_large_connection_limit(webserver, port):
+    """
+    Test connection limits beyond 16 bits are taken as given, and invalid ones refused
+    """
+
+    # Truncated to 16 bits, 65537 would be a limit of 1
+    with webserver('-c', '65537', '127.0.0.1', f'{port}'), contextlib.ExitStack() as contexts:
+        time.sleep(.2)
+        conns = [contexts.enter_context(socket.create_connection(('localhost', port), timeout=2)) for _ in range(4)]
+        for conn in reversed(conns):
+            conn.sendall(b'GET /static/foo HTTP/1.1\r\n\r\n')
+            assert conn.recv(1024).startswith(b'HTTP/1.1 200')
+
+    for option in [['-c', '99999999999'], ['-c', '-1'], ['-c', '0'], ['-b', '1x'], ['-S', '4294967295']]:
+        with webserver(*option, '127.0.0.1', f'{port}', stderr=subprocess.DEVNULL) as server:
+            assert server.wait(timeout=2) != 0
+
+
+def test_request_in_pieces(webserver, port):
+    """
+    Test requests arriving a few bytes at a time, with line ends split up
+    """
+
+    request = b'PUT /pieces HTTP/1.1\r\nhost: localhost\r\ncontent-length: 3\r\n\r\nabc'
+
+    with webserver('127.0.0.1', f'{port}'), contextlib.closing(
+        socket.create_connection(('localhost', port), timeout=2)
+    ) as sock:
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        for i in range(0, len(request), 3):
+            sock.send(request[i:i + 3])
+            time.sleep(.01)
+        assert sock.recv(1024).startswith(b'HTTP/1.1 201')
+
+        sock.send(b'GET /pieces HTTP/1.1\r\n\r\n')
+        assert sock.recv(1024).endswith(b'\r\n\r\nabc')
+
+
+def test_too_many_headers(webserver, port):
+    """
+    Test requests with too many headers are rejected without affecting others
+    """
+
+    headers = b''.join(b'X-%d: %d\r\n' % (i, i) for i in range(100))
+
+    with webserver('127.0.0.1', f'{port}'):
+        with contextlib.closing(socket.create_connection(('localhost', port), timeout=2)) as sock:
+            sock.send(b'GET /static/foo HTTP/1.1\r\n' + headers + b'\r\n')
+            assert sock.recv(1024).startswith(b'HTTP/1.1 400')
+
+        with contextlib.closing(HTTPConnection('localhost', port, timeout=2)) as conn:
+            conn.request('GET', '/static/foo')
+            assert conn.getresponse().read() == b'Foo'
+
+
+def test_pipelined_requests(webserver, port):
+    """
+    Test replies to pipelined requests are sent in the order of the requests
+    """
+
+    requests = b''
+    expected = b''
+    for i in range(100):
+        requests += b'PUT /p%d HTTP/1.1\r\nContent-Length: %d\r\n\r\n%d' % (i, len(b'%d' % i), i)
+        requests += b'GET /p%d HTTP/1.1\r\n\r\n' % i
+        requests += b'DELETE /missing HTTP/1.1\r\n\r\n'
+        expected += b'HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n'
+        expected += b'HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%d' % (len(b'%d' % i), i)
+        expected += b'HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n'
+
+    with webserver('127.0.0.1', f'{port}'), contextlib.closing(
+        socket.create_connection(('localhost', port), timeout=2)
+    ) as sock:
+        sock.sendall(requests)
+        received = b''
+        while len(received) < len(expected):
+            chunk = sock.recv(65536)
+            assert chunk, "Connection closed before all replies were received"
+            received += chunk
+        assert received == expected
+
+
+def test_binary_value(webserver, port):
+    """
+    Test values are returned byte for byte, including NUL bytes
+    """
+
+    value = bytes(range(256)) * 28
+
+    with webserver('127.0.0.1', f'{port}'), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=2)
+    ) as conn:
+        conn.request('PUT', '/binary', body=value)
+        conn.getresponse().read()
+
+        conn.request('GET', '/binary')
+        reply = conn.getresponse()
+        assert reply.status == 200
+        assert reply.read() == value
+
+
+def test_store_growth(webserver, port):
+    """
+    Test the store keeps its contents while growing far beyond its initial size, across deletes
+    """
+
+    node = dht.Peer(None, '127.0.0.1', port)
+    n_keys = 3000
+    entry_size = 32  # header of each value in the store
+
+    def value(i):
+        return f'value {i}'.encode() * (1 + i % 5)
+
+    def live(keys):
+        return sum(len(f'/key/{i}') + 1 + entry_size + len(value(i)) for i in keys)
+
+    with webserver('127.0.0.1', f'{port}'), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=2)
+    ) as conn:
+        def request(method, uri, body=None):
+            conn.request(method, uri, body)
+            reply = conn.getresponse()
+            return reply.status, reply.read()
+
+        base = _metric(node, 'store_bytes{kind="live"}')
+        for i in range(n_keys):
+            assert request('PUT', f'/key/{i}', value(i))[0] == 201
+        assert _metric(node, 'store_bytes{kind="live"}') == base + live(range(n_keys))
+
+        # Delete every third key, then grow the tables again past the holes
+        deleted = range(0, n_keys, 3)
+        for i in deleted:
+            assert request('DELETE', f'/key/{i}')[0] == 204
+        for i in range(n_keys, 2 * n_keys):
+            assert request('PUT', f'/key/{i}', value(i))[0] == 201
+
+        kept = [i for i in range(2 * n_keys) if i >= n_keys or i % 3 != 0]
+        for i in deleted:
+            assert request('GET', f'/key/{i}')[0] == 404
+        for i in kept:
+            assert request('GET', f'/key/{i}') == (200, value(i))
+        assert _metric(node, 'store_bytes{kind="live"}') == base + live(kept)
+
+        for i in deleted:
+            assert request('PUT', f'/key/{i}', value(i))[0] == 201
+
+        # Keys deleted and reinserted get back the chunks the deletes released
+        reserved = _metric(node, 'store_bytes{kind="live"}') + _metric(node, 'store_bytes{kind="wasted"}')
+        for i in range(0, 2 * n_keys, 3):
+            assert request('DELETE', f'/key/{i}')[0] == 204
+        for i in range(0, 2 * n_keys, 3):
+            assert request('PUT', f'/key/{i}', value(i))[0] == 201
+        for i in range(2 * n_keys):
+            assert request('GET', f'/key/{i}') == (200, value(i))
+        assert _metric(node, 'store_bytes{kind="live"}') == base + live(range(2 * n_keys))
+        assert _metric(node, 'store_bytes{kind="live"}') + _metric(node, 'store_bytes{kind="wasted"}') == reserved
+        assert _metric(node, 'store_keys') == 3 + 2 * n_keys
+
+
+def test_workers(webserver, port):
+    """
+    Test clients of different workers see each other's writes, and the store stays compact
+    """
+
+    node = dht.Peer(None, '127.0.0.1', port)
+    n_clients = 8
+    n_keys = 500
+
+    def write(client):
+        with contextlib.closing(HTTPConnection('localhost', port, timeout=2)) as conn:
+            for i in range(n_keys):
+                conn.request('PUT', f'/{client}/{i}', f'{client}.{i}')
+                reply = conn.getresponse()
+                reply.read()
+                assert reply.status == 201
+
+    def read(client):
+        # Each connection may be accepted by another worker
+        for other in range(n_clients):
+            with contextlib.closing(HTTPConnection('localhost', port, timeout=2)) as conn:
+                for i in range(client, n_keys, n_clients):
+                    conn.request('GET', f'/{other}/{i}')
+                    reply = conn.getresponse()
+                    assert reply.status == 200
+                    assert reply.read() == f'{other}.{i}'.encode()
+
+    with webserver('-w', '4', '127.0.0.1', f'{port}'), concurrent.futures.ThreadPoolExecutor(n_clients) as pool:
+        for result in [pool.submit(write, client) for client in range(n_clients)]:
+            result.result()
+        for result in [pool.submit(read, client) for client in range(n_clients)]:
+            result.result()
+
+        assert _metric(node, 'store_keys') == 3 + n_clients * n_keys
+        assert _metric(node, 'store_bytes{kind="wasted"}') < 1 << 20
+
+
+def test_slow_reader(webserver, port):
+    """
+    Test replies exceeding the socket buffers are sent completely and in order
+    """
+
+    value = b'x' * 7000
+    n_requests = 500
+    expected = (b'HTTP/1.1 200 OK\r\nContent-Length: 7000\r\n\r\n' + value) * n_requests
+
+    with webserver('127.0.0.1', f'{port}'), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=2)
+    ) as conn:
+        conn.request('PUT', '/large', body=value)
+        conn.getresponse().read()
+
+        with contextlib.closing(socket.create_connection(('localhost', port), timeout=2)) as sock:
+            # Pipeline all requests before reading, so the server runs into full socket buffers
+            sock.sendall(b'GET /large HTTP/1.1\r\n\r\n' * n_requests)
+            time.sleep(.2)
+
+            received = bytearray()
+            while len(received) < len(expected):
+                chunk = sock.recv(65536)
+                assert chunk, "Connection closed before all replies were received"
+                received += chunk
+            assert received == expected
+
+        # The server is still responsive
+        conn.request('GET', '/static/foo')
+        assert conn.getresponse().read() == b'Foo'
+
+
+@pytest.mark.parametrize('spill_threshold', [1 << 30, 1 << 16])
+def test_large_upload(webserver, port, spill_threshold):
+    """
+    Test bodies exceeding the receive buffer are stored, in memory or in a temporary file
+    """
+
+    value = bytes(range(256)) * (4 << 12)  # 4 MiB
+
+    with webserver('-s', f'{spill_threshold}', '127.0.0.1', f'{port}'), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=5)
+    ) as conn:
+        conn.request('PUT', '/large', body=value)
+        reply = conn.getresponse()
+        reply.read()
+        assert reply.status == 201
+
+        conn.request('GET', '/large')
+        reply = conn.getresponse()
+        assert reply.status == 200
+        assert reply.read() == value
+
+        # The connection continues with the requests following the body
+        conn.request('GET', '/static/foo')
+        assert conn.getresponse().read() == b'Foo'
+
+
+def test_large_upload_redirected(webserver):
+    """
+    Test the body of a redirected upload is dropped without being stored
+    """
+
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0xffff, '127.0.0.1', 4712)
+
+    with webserver(self.ip, f'{self.port}', f'{self.id}', env=_peer_env(successor, successor)), contextlib.closing(
+        HTTPConnection(self.ip, self.port, timeout=5)
+    ) as conn:
+        conn.request('PUT', '/a', body=b'a' * (1 << 20))
+        reply = conn.getresponse()
+        reply.read()
+        assert reply.status == 303
+
+        # The next request is parsed after the dropped body
+        conn.request('GET', '/b')
+        reply = conn.getresponse()
+        reply.read()
+        assert reply.status == 303
+        assert reply.headers['Location'] == f'http://{successor.ip}:{successor.port}/b'
+
+
+def _peer_env(predecessor, successor):
+    return {
+        'PRED_ID': f'{predecessor.id}', 'PRED_IP': predecessor.ip, 'PRED_PORT': f'{predecessor.port}',
+        'SUCC_ID': f'{successor.id}', 'SUCC_IP': successor.ip, 'SUCC_PORT': f'{successor.port}',
+        'NO_STABILIZE': '1',
+    }
+
+
+def test_lookup_retransmit(webserver):
+    """
+    Test lost lookups are sent again
+    """
+
+    predecessor = dht.Peer(0xffff, '127.0.0.1', 4710)
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x0001, '127.0.0.1', 4712)
+
+    with dht.peer_socket(successor) as mock, webserver(
+        self.ip, f'{self.port}', f'{self.id}', env=_peer_env(predecessor, successor)
+    ), contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+        conn.request('GET', '/a')
+        reply = conn.getresponse()
+        reply.read()
+        assert reply.status == 503
+
+        time.sleep(.5)
+        lookups = []
+        while bytes_available(mock) > 0:
+            lookups.append(dht.deserialize(mock.recv(1024)))
+        assert len(lookups) >= 2, "Lookup should have been retransmitted"
+        assert all(lookup == lookups[0] for lookup in lookups)
+
+
+def test_lookup_parked(webserver):
+    """
+    Test requests wait for the lookup instead of being answered with 503 (-P)
+    """
+
+    predecessor = dht.Peer(0xffff, '127.0.0.1', 4710)
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x0001, '127.0.0.1', 4712)
+
+    with dht.peer_socket(predecessor, timeout=2) as pred_mock, dht.peer_socket(
+        successor, timeout=2
+    ) as succ_mock, webserver(
+        '-P', self.ip, f'{self.port}', f'{self.id}', env=_peer_env(predecessor, successor)
+    ), contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+        conn.request('GET', '/a')
+
+        lookup = dht.deserialize(succ_mock.recv(1024))
+        assert lookup.flags == dht.Flags.lookup
+        assert lookup.id == dht.hash(b'/a')
+
+        reply = dht.Message(dht.Flags.reply, successor.id, predecessor)
+        pred_mock.sendto(dht.serialize(reply), (self.ip, self.port))
+
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 303
+        assert response.headers['Location'] == f'http://{predecessor.ip}:{predecessor.port}/a'
+
+        # The connection is usable afterwards
+        conn.request('GET', '/a')
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 303
+
+
+def test_lookup_cached(webserver):
+    """
+    Test a Reply resolves later requests for the whole range without lookups
+    """
+
+    predecessor = dht.Peer(0xffff, '127.0.0.1', 4710)
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x0001, '127.0.0.1', 4712)
+
+    with dht.peer_socket(predecessor, timeout=2) as pred_mock, dht.peer_socket(
+        successor, timeout=2
+    ) as succ_mock, webserver(
+        self.ip, f'{self.port}', f'{self.id}', env=_peer_env(predecessor, successor)
+    ), contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+        conn.request('GET', '/a')
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 503
+
+        succ_mock.recv(1024)
+        reply = dht.Message(dht.Flags.reply, successor.id, predecessor)
+        pred_mock.sendto(dht.serialize(reply), (self.ip, self.port))
+        time.sleep(.1)
+
+        for uri in ['/a', '/b', '/c', '/d']:
+            conn.request('GET', uri)
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 303
+            assert response.headers['Location'] == f'http://{predecessor.ip}:{predecessor.port}{uri}'
+
+        assert bytes_available(succ_mock) == 0, "Cached range should not be looked up again"
+
+
+def test_metrics(webserver):
+    """
+    Test requests and DHT messages are counted at /_metrics on every node
+    """
+
+    predecessor = dht.Peer(0xffff, '127.0.0.1', 4710)
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x0001, '127.0.0.1', 4712)
+
+    with dht.peer_socket(predecessor, timeout=2) as pred_mock, dht.peer_socket(
+        successor, timeout=2
+    ) as succ_mock, webserver(
+        self.ip, f'{self.port}', f'{self.id}', env=_peer_env(predecessor, successor)
+    ), contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+        conn.request('GET', '/a')
+        conn.getresponse().read()
+
+        succ_mock.recv(1024)
+        reply = dht.Message(dht.Flags.reply, successor.id, predecessor)
+        pred_mock.sendto(dht.serialize(reply), (self.ip, self.port))
+        time.sleep(.1)
+
+        conn.request('GET', '/_metrics')
+        response = conn.getresponse()
+        assert response.status == 200
+        lines = response.read().decode().splitlines()
+
+        assert 'http_request_duration_seconds_count{method="GET",status="503"} 1' in lines
+        assert 'dht_messages_total{direction="sent",type="lookup"} 1' in lines
+        assert 'dht_messages_total{direction="received",type="reply"} 1' in lines
+        assert 'dht_lookup_duration_seconds_count 1' in lines
+        assert 'http_connections 1' in lines
+        assert 'store_keys 3' in lines
+
+
+def test_lookup_burst(webserver):
+    """
+    Test a burst of Lookups is answered completely, in batches larger than one
+    """
+
+    predecessor = dht.Peer(0xffff, '127.0.0.1', 4710)
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x1000, '127.0.0.1', 4712)
+
+    with dht.peer_socket(predecessor, timeout=2) as mock, webserver(
+        self.ip, f'{self.port}', f'{self.id}', env=_peer_env(predecessor, successor)
+    ):
+        # The Replies all arrive before the first is read
+        n_lookups = 500
+        try:
+            mock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUFFORCE, 1 << 21)
+        except (AttributeError, PermissionError):
+            mock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 21)
+        if mock.getsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF) < n_lookups * 2048:
+            pytest.skip('the receive buffer cannot hold the burst')
+        time.sleep(.2)
+
+        for i in range(n_lookups):
+            # The successor is responsible for all of them
+            lookup = dht.Message(dht.Flags.lookup, 1 + i % 0x0fff, predecessor)
+            mock.sendto(dht.serialize(lookup), (self.ip, self.port))
+
+        for _ in range(n_lookups):
+            reply = dht.deserialize(mock.recv(1024))
+            assert reply.flags == dht.Flags.reply
+            assert reply.id == self.id
+            assert reply.peer == successor
+
+
+def _receive(sock, flags):
+    """Receive messages until one of type `flags` arrives
+    """
+    while True:
+        msg = dht.deserialize(sock.recv(1024))
+        if msg.flags == flags:
+            return msg
+
+
+def test_stabilize(webserver):
+    """
+    Test a node stabilizes periodically and adopts a closer successor it is notified of
+    """
+
+    predecessor = dht.Peer(0xf000, '127.0.0.1', 4710)
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x1000, '127.0.0.1', 4712)
+    between = dht.Peer(0x0800, '127.0.0.1', 4713)
+
+    env = _peer_env(predecessor, successor)
+    del env['NO_STABILIZE']
+    with dht.peer_socket(successor, timeout=2) as succ_mock, dht.peer_socket(
+        between, timeout=2
+    ) as between_mock, webserver(
+        '-S', '100', self.ip, f'{self.port}', f'{self.id}', env=env
+    ):
+        stabilize = _receive(succ_mock, dht.Flags.stabilize)
+        assert stabilize.peer == self
+
+        notify = dht.Message(dht.Flags.notify, 0, between)
+        succ_mock.sendto(dht.serialize(notify), (self.ip, self.port))
+
+        stabilize = _receive(between_mock, dht.Flags.stabilize)
+        assert stabilize.peer == self
+
+
+def test_join(webserver):
+    """
+    Test a node joins through an anchor and stabilizes with the successor it is notified of
+    """
+
+    anchor = dht.Peer(0x1000, '127.0.0.1', 4710)
+    self = dht.Peer(0x0800, '127.0.0.1', 4711)
+
+    with dht.peer_socket(anchor, timeout=2) as mock, webserver(
+        '-S', '100', self.ip, f'{self.port}', f'{self.id}', anchor.ip, f'{anchor.port}'
+    ):
+        join = _receive(mock, dht.Flags.join)
+        assert join.peer == self
+
+        notify = dht.Message(dht.Flags.notify, 0, anchor)
+        mock.sendto(dht.serialize(notify), (self.ip, self.port))
+
+        stabilize = _receive(mock, dht.Flags.stabilize)
+        assert stabilize.peer == self
+
+
+def test_join_ring(webserver):
+    """
+    Test two nodes form a ring and agree on who is responsible for each key
+    """
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0xc000, '127.0.0.1', 4712)
+
+    with webserver('-S', '50', first.ip, f'{first.port}', f'{first.id}'), webserver(
+        '-S', '50', second.ip, f'{second.port}', f'{second.id}', first.ip, f'{first.port}'
+    ):
+        time.sleep(1)
+
+        for uri in ['/a', '/b', '/c', '/d', '/e', '/f']:
+            responsible = second if dht.hash(uri.encode()) in range(first.id + 1, second.id + 1) else first
+            for node in (first, second):
+                with contextlib.closing(HTTPConnection(node.ip, node.port, timeout=2)) as conn:
+                    conn.request('GET', uri)
+                    reply = conn.getresponse()
+                    reply.read()
+                    if node == responsible:
+                        assert reply.status == 404
+                    else:
+                        assert reply.status == 303
+                        assert reply.headers['Location'] == f'http://{responsible.ip}:{responsible.port}{uri}'
+
+
+def test_successor_list(webserver):
+    """
+    Test a Stabilize is answered with the predecessor and the successor list
+    """
+
+    predecessor = dht.Peer(0xf000, '127.0.0.1', 4710)
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x1000, '127.0.0.1', 4712)
+
+    with dht.peer_socket(predecessor, timeout=2) as mock, webserver(
+        self.ip, f'{self.port}', f'{self.id}', env=_peer_env(predecessor, successor)
+    ):
+        stabilize = dht.Message(dht.Flags.stabilize, 0, predecessor)
+        mock.sendto(dht.serialize(stabilize), (self.ip, self.port))
+
+        notify = dht.deserialize(mock.recv(1024))
+        assert notify.flags == dht.Flags.notify
+        assert notify.peer == predecessor
+
+        entry = dht.deserialize(mock.recv(1024))
+        assert entry.flags == dht.Flags.successor
+        assert entry.id == 0
+        assert entry.peer == successor
+
+
+def test_successor_failover(webserver):
+    """
+    Test a silent successor is replaced by the next one of the successor list
+    """
+
+    predecessor = dht.Peer(0xf000, '127.0.0.1', 4710)
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x1000, '127.0.0.1', 4712)
+    next_successor = dht.Peer(0x2000, '127.0.0.1', 4713)
+
+    env = _peer_env(predecessor, successor)
+    del env['NO_STABILIZE']
+    with dht.peer_socket(successor, timeout=2) as succ_mock, dht.peer_socket(
+        next_successor, timeout=2
+    ) as next_mock, webserver(
+        '-S', '100', self.ip, f'{self.port}', f'{self.id}', env=env
+    ):
+        _receive(succ_mock, dht.Flags.stabilize)
+        for msg in [
+            dht.Message(dht.Flags.notify, 0, self),
+            dht.Message(dht.Flags.successor, 0, next_successor),
+        ]:
+            succ_mock.sendto(dht.serialize(msg), (self.ip, self.port))
+
+        # The successor falls silent from now on
+        stabilize = _receive(next_mock, dht.Flags.stabilize)
+        assert stabilize.peer == self
+
+
+def _check_ring(nodes, uris):
+    """Assert every node either serves each URI or redirects to the responsible node
+    """
+    ids = sorted(node.id for node in nodes)
+    for uri in uris:
+        key = dht.hash(uri.encode())
+        responsible_id = next((id_ for id_ in ids if key <= id_), ids[0])
+        responsible = next(node for node in nodes if node.id == responsible_id)
+        for node in nodes:
+            with contextlib.closing(HTTPConnection(node.ip, node.port, timeout=2)) as conn:
+                conn.request('GET', uri)
+                reply = conn.getresponse()
+                reply.read()
+                if reply.status == 503:  # the lookup completes in the meantime
+                    time.sleep(.2)
+                    conn.request('GET', uri)
+                    reply = conn.getresponse()
+                    reply.read()
+                if node == responsible:
+                    assert reply.status == 404
+                else:
+                    assert reply.status == 303
+                    assert reply.headers['Location'] == f'http://{responsible.ip}:{responsible.port}{uri}'
+
+
+def test_ring_survives_failure(webserver):
+    """
+    Test the ring closes again after one of its nodes crashed
+    """
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0x8000, '127.0.0.1', 4712)
+    third = dht.Peer(0xc000, '127.0.0.1', 4713)
+    uris = ['/a', '/b', '/c', '/d', '/e', '/f']
+
+    def join(node):
+        return webserver('-S', '50', node.ip, f'{node.port}', f'{node.id}', first.ip, f'{first.port}')
+
+    with webserver('-S', '50', first.ip, f'{first.port}', f'{first.id}'), join(third):
+        with join(second):
+            time.sleep(1)
+            _check_ring([first, second, third], uris)
+
+        time.sleep(1)
+        _check_ring([first, third], uris)
+
+
+def _request(node, method, uri, body=None, headers={}):
+    with contextlib.closing(HTTPConnection(node.ip, node.port, timeout=2)) as conn:
+        conn.request(method, uri, body, headers=headers)
+        reply = conn.getresponse()
+        return reply.status, reply.headers, reply.read()
+
+
+@pytest.mark.parametrize('size', [16, 1 << 18])
+def test_replication(webserver, size):
+    """
+    Test writes reach the successor, which serves reads of its replicas
+    """
+
+    body = bytes(i % 251 for i in range(size))
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0xc000, '127.0.0.1', 4712)
+    uri = '/c'  # the first node is responsible
+    assert not 0x4000 < dht.hash(uri.encode()) <= 0xc000
+
+    # Large values are kept in files, on both nodes
+    with webserver('-r', '2', '-S', '50', '-s', '65536', first.ip, f'{first.port}', f'{first.id}'), webserver(
+        '-r', '2', '-S', '50', '-s', '65536', second.ip, f'{second.port}', f'{second.id}', first.ip, f'{first.port}'
+    ):
+        time.sleep(1)
+
+        status, _, _ = _request(first, 'PUT', uri, body)
+        assert status == 201
+        time.sleep(.2)
+        status, _, replica = _request(second, 'GET', uri)
+        assert status == 200
+        assert replica == body
+
+        status, _, _ = _request(first, 'DELETE', uri)
+        assert status == 204
+        time.sleep(.2)
+        status, headers, _ = _request(second, 'GET', uri)
+        assert status == 303
+        assert headers['Location'] == f'http://{first.ip}:{first.port}{uri}'
+
+
+def test_replication_coalesced(webserver):
+    """
+    Test repeated writes to a key are sent to the replica once per batch
+    """
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0xc000, '127.0.0.1', 4712)
+    uri = '/c'  # the first node is responsible
+    n_writes = 50
+
+    requests = b''.join(b'PUT %s HTTP/1.1\r\nContent-Length: 2\r\n\r\n%02d' % (uri.encode(), i) for i in range(n_writes))
+
+    with webserver('-r', '2', '-S', '50', first.ip, f'{first.port}', f'{first.id}'), webserver(
+        '-r', '2', '-S', '50', second.ip, f'{second.port}', f'{second.id}', first.ip, f'{first.port}'
+    ), contextlib.closing(socket.create_connection((first.ip, first.port), timeout=2)) as sock:
+        time.sleep(1)
+        applied = _metric(first, 'replica_writes_total{result="applied"}')
+
+        # Pipelined, so the writes are queued faster than a batch is sent
+        sock.sendall(requests)
+        received = b''
+        while received.count(b'HTTP/1.1 ') < n_writes:
+            chunk = sock.recv(65536)
+            assert chunk, "Connection closed before all replies were received"
+            received += chunk
+        time.sleep(.2)
+
+        assert _request(second, 'GET', uri)[2] == b'%02d' % (n_writes - 1)
+        assert _metric(first, 'replica_writes_total{result="applied"}') - applied <= 5
+
+
+def test_replica_resync(webserver):
+    """
+    Test a node becoming a replica receives the keys written before, and only it
+    """
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0x8000, '127.0.0.1', 4712)
+    third = dht.Peer(0xc000, '127.0.0.1', 4713)
+    uris = [uri for uri in (f'/key/{i}' for i in range(200)) if not 0x4000 < dht.hash(uri.encode()) <= 0xc000]
+
+    def node(peer, *args):
+        return webserver('-r', '3', '-S', '50', peer.ip, f'{peer.port}', f'{peer.id}', *args)
+
+    with node(first):
+        time.sleep(.5)
+        for uri in uris:
+            assert _request(first, 'PUT', uri, uri.encode())[0] == 201
+
+        with node(second, first.ip, f'{first.port}'):
+            time.sleep(2)
+            applied = _metric(first, 'replica_writes_total{result="applied"}')
+            assert applied >= len(uris)
+
+            with node(third, first.ip, f'{first.port}'):
+                time.sleep(2)
+
+                # The second node already held the keys, they are not sent again
+                resent = _metric(first, 'replica_writes_total{result="applied"}') - applied
+                assert len(uris) <= resent < 2 * len(uris)
+                for uri in uris:
+                    assert _request(third, 'GET', uri)[2] == uri.encode()
+
+
+def test_replica_header_from_client(webserver):
+    """
+    Test writes marked as replica writes by a client outside the ring are checked like any other
+    """
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0xc000, '127.0.0.1', 4712)
+    uri = '/c'  # the first node is responsible
+
+    with webserver('-r', '2', '-S', '50', first.ip, f'{first.port}', f'{first.id}'), webserver(
+        '-r', '2', '-S', '50', second.ip, f'{second.port}', f'{second.id}', first.ip, f'{first.port}'
+    ), contextlib.closing(
+        HTTPConnection(second.ip, second.port, timeout=2, source_address=('127.0.0.2', 0))
+    ) as conn:
+        time.sleep(1)
+
+        conn.request('PUT', uri, b'forged', headers={'X-Replica': '1'})
+        reply = conn.getresponse()
+        reply.read()
+        assert reply.status == 303
+        assert reply.headers['Location'] == f'http://{first.ip}:{first.port}{uri}'
+        assert _request(second, 'GET', uri)[0] == 303
+
+
+def test_replica_reads_outside_window(webserver):
+    """
+    Test a node serves only copies of keys it replicates, and redirects reads of others
+    """
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0x8000, '127.0.0.1', 4712)
+    third = dht.Peer(0xc000, '127.0.0.1', 4713)
+    uris = [f'/key/{i}' for i in range(100)]
+    replicated = next(uri for uri in uris if 0x4000 < dht.hash(uri.encode()) <= 0x8000)
+    foreign = next(uri for uri in uris if not 0x4000 < dht.hash(uri.encode()) <= 0xc000)
+
+    def join(peer):
+        return webserver('-r', '2', '-S', '50', peer.ip, f'{peer.port}', f'{peer.id}', first.ip, f'{first.port}')
+
+    with webserver('-r', '2', '-S', '50', first.ip, f'{first.port}', f'{first.id}'), join(second), join(third):
+        time.sleep(2)
+
+        # Left behind by an earlier ring, the first node owns the key and has no such value
+        for uri in [replicated, foreign]:
+            assert _request(third, 'PUT', uri, b'stale', headers={'X-Replica': '1'})[0] in (201, 204)
+
+        assert _request(third, 'GET', replicated)[2] == b'stale'
+        status, headers, _ = _request(third, 'GET', foreign)
+        assert status == 303
+        assert headers['Location'] == f'http://{first.ip}:{first.port}{foreign}'
+
+
+def test_replica_reads_when_busy(webserver):
+    """
+    Test a node short of connection slots redirects reads of its keys to a replica
+    """
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0xc000, '127.0.0.1', 4712)
+    uri = '/c'  # the first node is responsible
+
+    with webserver('-r', '2', '-S', '50', '-c', '4', first.ip, f'{first.port}', f'{first.id}'), webserver(
+        '-r', '2', '-S', '50', second.ip, f'{second.port}', f'{second.id}', first.ip, f'{first.port}'
+    ), contextlib.ExitStack() as contexts:
+        time.sleep(1)
+        status, _, _ = _request(first, 'PUT', uri, b'hot')
+        assert status == 201
+        time.sleep(.2)
+
+        conns = [
+            contexts.enter_context(contextlib.closing(HTTPConnection(first.ip, first.port, timeout=2)))
+            for _ in range(3)
+        ]
+        for conn in conns:
+            conn.connect()
+        conns[0].request('GET', uri)
+        reply = conns[0].getresponse()
+        reply.read()
+        assert reply.status == 303
+        assert reply.headers['Location'] == f'http://{second.ip}:{second.port}{uri}'
+
+
+def test_journal_restart(webserver, port, tmp_path):
+    """
+    Test the resources are restored from the journal after the server was killed
+    """
+
+    node = dht.Peer(None, '127.0.0.1', port)
+    large = bytes(i % 251 for i in range(1 << 18))
+
+    with webserver('-d', f'{tmp_path}', '-s', '65536', node.ip, f'{node.port}'):
+        assert _request(node, 'PUT', '/small', b'small')[0] == 201
+        assert _request(node, 'PUT', '/large', large)[0] == 201
+        assert _request(node, 'PUT', '/gone', b'gone')[0] == 201
+        assert _request(node, 'DELETE', '/gone')[0] == 204
+        time.sleep(.2)
+
+    with webserver('-d', f'{tmp_path}', '-s', '65536', node.ip, f'{node.port}'):
+        assert _request(node, 'GET', '/small')[2] == b'small'
+        assert _request(node, 'GET', '/large')[2] == large
+        assert _request(node, 'GET', '/gone')[0] == 404
+        assert _request(node, 'GET', '/static/foo')[2] == b'Foo'
+
+
+def test_journal_torn_value(webserver, port, tmp_path):
+    """
+    Test replay stops at a record whose value was not written completely, and appends continue before it
+    """
+
+    node = dht.Peer(None, '127.0.0.1', port)
+    large = bytes(i % 251 for i in range(1 << 18))
+
+    with webserver('-d', f'{tmp_path}', '-s', '65536', node.ip, f'{node.port}'):
+        assert _request(node, 'PUT', '/first', b'first')[0] == 201
+        assert _request(node, 'PUT', '/large', large)[0] == 201
+        assert _request(node, 'PUT', '/after', b'after')[0] == 201
+        time.sleep(.2)
+
+    # A crash left the header and key in place, but part of the value zeroed
+    journal = tmp_path / 'journal'
+    data = bytearray(journal.read_bytes())
+    start = data.find(large[:1024])
+    data[start + 4096:start + 8192] = bytes(4096)
+    journal.write_bytes(data)
+
+    with webserver('-d', f'{tmp_path}', '-s', '65536', node.ip, f'{node.port}'):
+        assert _request(node, 'GET', '/first')[2] == b'first'
+        assert _request(node, 'GET', '/large')[0] == 404
+        assert _request(node, 'GET', '/after')[0] == 404
+        assert _request(node, 'PUT', '/later', b'later')[0] == 201
+        time.sleep(.2)
+
+    with webserver('-d', f'{tmp_path}', '-s', '65536', node.ip, f'{node.port}'):
+        assert _request(node, 'GET', '/first')[2] == b'first'
+        assert _request(node, 'GET', '/later')[2] == b'later'
+
+
+def test_journal_compaction(webserver, port, tmp_path):
+    """
+    Test a long journal is replaced by a snapshot, from which the resources are restored
+    """
+
+    node = dht.Peer(None, '127.0.0.1', port)
+    value = bytes(range(256)) * (4 << 10)  # 1 MiB
+
+    with webserver('-d', f'{tmp_path}', node.ip, f'{node.port}'):
+        for i in range(20):
+            assert _request(node, 'PUT', '/value', value[i:] + value[:i])[0] in (201, 204)
+        time.sleep(1)
+        assert (tmp_path / 'snapshot').exists()
+        assert (tmp_path / 'journal').stat().st_size < 16 << 20
+
+    with webserver('-d', f'{tmp_path}', node.ip, f'{node.port}'):
+        assert _request(node, 'GET', '/value')[2] == value[19:] + value[:19]
+
+
+def test_catalog(request, webserver, tmp_path):
+    """
+    Test resources of a catalog are served by every node and cannot be written
+    """
+
+    site = tmp_path / 'site'
+    (site / 'static' / 'images').mkdir(parents=True)
+    (site / 'static' / 'foo').write_bytes(b'Catalog foo')
+    image = bytes(i % 251 for i in range(1 << 17))
+    (site / 'static' / 'images' / 'logo').write_bytes(image)
+    mkcatalog = os.path.join(os.path.dirname(request.config.getoption('executable')), 'mkcatalog')
+    subprocess.run([mkcatalog, f'{tmp_path / "catalog"}', f'{site}'], check=True, stdout=subprocess.DEVNULL)
+
+    # The successor is responsible for all other keys
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0xffff, '127.0.0.1', 4712)
+
+    with webserver('-C', f'{tmp_path / "catalog"}', self.ip, f'{self.port}', f'{self.id}',
+                   env=_peer_env(successor, successor)):
+        assert _request(self, 'GET', '/static/foo')[:3:2] == (200, b'Catalog foo')
+        assert _request(self, 'GET', '/static/images/logo')[:3:2] == (200, image)
+        assert _request(self, 'PUT', '/static/foo', b'Other')[0] == 403
+        assert _request(self, 'PUT', '/static/images/logo', image)[0] == 403
+        assert _request(self, 'DELETE', '/static/foo')[0] == 403
+        assert _request(self, 'GET', '/static/foo')[2] == b'Catalog foo'
+        assert _metric(self, 'http_request_duration_seconds_count{method="PUT",status="403"}') == 2
+        assert _metric(self, 'http_request_duration_seconds_count{method="DELETE",status="403"}') == 1
+
+        status, headers, _ = _request(self, 'GET', '/static/bar')
+        assert status == 303
+        assert headers['Location'] == f'http://{successor.ip}:{successor.port}/static/bar'
+
+
+def test_migration_on_join(webserver):
+    """
+    Test a joining node receives the keys it becomes responsible for from its successor
+    """
+
+    first = dht.Peer(0xc000, '127.0.0.1', 4711)
+    second = dht.Peer(0x4000, '127.0.0.1', 4712)
+    uris = [f'/key/{i}' for i in range(200)]
+    moved = [uri for uri in uris if not 0x4000 < dht.hash(uri.encode()) <= 0xc000]
+    assert 0 < len(moved) < len(uris)
+
+    with webserver('-S', '50', first.ip, f'{first.port}', f'{first.id}'):
+        time.sleep(.5)
+        for uri in uris:
+            assert _request(first, 'PUT', uri, uri.encode())[0] == 201
+
+        with webserver('-S', '50', second.ip, f'{second.port}', f'{second.id}', first.ip, f'{first.port}'):
+            time.sleep(2)
+
+            for uri in uris:
+                owner, other = (second, first) if uri in moved else (first, second)
+                status, _, body = _request(owner, 'GET', uri)
+                assert status == 200
+                assert body == uri.encode()
+
+                # The former owner no longer keeps the moved keys
+                status, headers, _ = _request(other, 'GET', uri)
+                if status == 503:
+                    time.sleep(.2)
+                    status, headers, _ = _request(other, 'GET', uri)
+                assert status == 303
+                assert headers['Location'] == f'http://{owner.ip}:{owner.port}{uri}'
+
+            metrics = _request(first, 'GET', '/_metrics')[2].decode()
+            # The built-in resources are handed over alike
+            static = [uri for uri in ['/static/foo', '/static/bar', '/static/baz']
+                      if not 0x4000 < dht.hash(uri.encode()) <= 0xc000]
+            assert f'keys_migrated_total {len(moved) + len(static)}\n' in metrics
+
+
+@pytest.mark.parametrize('size', [16, 1 << 18])
+def test_handover_keeps_local_writes(webserver, size):
+    """
+    Test keys handed over never replace values written to the new owner itself
+    """
+
+    node = dht.Peer(0x4000, '127.0.0.1', 4711)
+    handover = {'X-Replica': 'handover'}
+    old = bytes(i % 251 for i in range(size))
+
+    # The node is its own predecessor, so it accepts hand-overs from its address
+    with webserver('-S', '50', node.ip, f'{node.port}', f'{node.id}'), contextlib.closing(
+        HTTPConnection(node.ip, node.port, timeout=2)
+    ) as conn:
+        time.sleep(.5)
+
+        def write(method, uri, body=None, headers={}):
+            conn.request(method, uri, body, headers=headers)
+            reply = conn.getresponse()
+            reply.read()
+            return reply.status
+
+        assert write('PUT', '/written', b'new') == 201
+        assert write('PUT', '/written', old, handover) == 204
+        assert _request(node, 'GET', '/written')[2] == b'new'
+        assert write('DELETE', '/written', headers=handover) == 204
+        assert _request(node, 'GET', '/written')[2] == b'new'
+
+        # A hand-over repeated after a failure replaces the earlier one
+        assert write('PUT', '/moved', old, handover) == 204
+        assert _request(node, 'GET', '/moved')[2] == old
+        assert write('PUT', '/moved', b'again', handover) == 204
+        assert _request(node, 'GET', '/moved')[2] == b'again'
+        assert write('DELETE', '/moved', headers=handover) == 204
+        assert _request(node, 'GET', '/moved')[0] == 404
+
+        assert write('DELETE', '/missing', headers=handover) == 204
+
+
+def test_leave(webserver):
+    """
+    Test a node terminated with SIGTERM hands its keys to its successor before leaving
+    """
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0x8000, '127.0.0.1', 4712)
+    third = dht.Peer(0xc000, '127.0.0.1', 4713)
+    uris = [f'/key/{i}' for i in range(100)]
+
+    def owner(uri):
+        key = dht.hash(uri.encode())
+        return second if 0x4000 < key <= 0x8000 else third if 0x8000 < key <= 0xc000 else first
+
+    def join(node):
+        return webserver('-S', '50', node.ip, f'{node.port}', f'{node.id}', first.ip, f'{first.port}')
+
+    with webserver('-S', '50', first.ip, f'{first.port}', f'{first.id}'), join(third), join(second) as leaving:
+        time.sleep(1)
+        for uri in uris:
+            assert _request(owner(uri), 'PUT', uri, uri.encode())[0] == 201
+        assert any(owner(uri) == second for uri in uris)
+
+        leaving.terminate()
+        assert leaving.wait(timeout=5) == 0
+
+        # The successor is responsible once it noticed the node is gone
+        time.sleep(1.5)
+        for uri in uris:
+            status, _, body = _request(first if owner(uri) == first else third, 'GET', uri)
+            assert status == 200
+            assert body == uri.encode()
+
+
+def test_replicas_dropped_on_join(webserver):
+    """
+    Test nodes drop the keys they no longer hold as replica after a node joined
+    """
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0xc000, '127.0.0.1', 4712)
+    third = dht.Peer(0x8000, '127.0.0.1', 4713)
+    uris = [f'/key/{i}' for i in range(100)]
+
+    def owner(uri):
+        key = dht.hash(uri.encode())
+        return first if not 0x4000 < key <= 0xc000 else third if key <= 0x8000 else second
+
+    def node(peer, *args):
+        return webserver('-r', '2', '-S', '50', peer.ip, f'{peer.port}', f'{peer.id}', *args)
+
+    with node(first), node(second, first.ip, f'{first.port}'):
+        time.sleep(1)
+        for uri in uris:
+            responsible = second if owner(uri) == third else owner(uri)
+            assert _request(responsible, 'PUT', uri, uri.encode())[0] == 201
+
+        with node(third, first.ip, f'{first.port}'):
+            time.sleep(2)
+
+            # Each key is held by its owner and the owner's successor only
+            successor = {first: third, third: second, second: first}
+            for uri in uris:
+                for peer in [first, second, third]:
+                    status, headers, body = _request(peer, 'GET', uri)
+                    if peer in (owner(uri), successor[owner(uri)]):
+                        assert status == 200
+                        assert body == uri.encode()
+                    else:
+                        assert status in (303, 503)
+
+
+@pytest.mark.parametrize('size', [16, 1 << 18, (64 << 20) + 1])
+def test_proxy(webserver, size):
+    """
+    Test a node in proxy mode forwards requests for remote keys instead of redirecting
+    """
+
+    body = bytes(i % 251 for i in range(size))
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0xc000, '127.0.0.1', 4712)
+    uri = '/c'  # the first node is responsible
+    assert not 0x4000 < dht.hash(uri.encode()) <= 0xc000
+
+    with webserver('-p', '-S', '50', first.ip, f'{first.port}', f'{first.id}'), webserver(
+        '-p', '-S', '50', second.ip, f'{second.port}', f'{second.id}', first.ip, f'{first.port}'
+    ), contextlib.closing(HTTPConnection(second.ip, second.port, timeout=2)) as conn:
+        time.sleep(1)
+
+        # Requests are forwarded over the same connection, one after the other
+        for method, request_body, status, reply_body in [
+            ('GET', None, 404, b''),
+            ('PUT', body, 201, b''),
+            ('GET', None, 200, body),
+            ('DELETE', None, 204, b''),
+            ('GET', None, 404, b''),
+        ]:
+            conn.request(method, uri, request_body)
+            reply = conn.getresponse()
+            assert reply.status == status
+            assert reply.read() == reply_body
+
+        # The responsible node stored the value itself
+        assert _request(second, 'PUT', uri, b'forwarded')[0] == 201
+        assert _request(first, 'GET', uri)[2] == b'forwarded'
+
+
+def test_proxy_reply_truncated(webserver):
+    """
+    Test a reply whose body ends before its announced length fails the forwarded request, not the node
+    """
+
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0xffff, '127.0.0.1', 4712)  # responsible for all other keys
+
+    def serve(listener):
+        # Answers every request on every connection with a bogus length
+        while True:
+            try:
+                conn, _ = listener.accept()
+            except OSError:
+                return
+            with conn:
+                request = b''
+                while b'\r\n\r\n' not in request:
+                    chunk = conn.recv(4096)
+                    if not chunk:
+                        break
+                    request += chunk
+                else:
+                    conn.sendall(b'HTTP/1.1 200 OK\r\nContent-Length: 18446744073709551615\r\n\r\n')
+
+    with socket.create_server((successor.ip, successor.port)) as listener:
+        server = threading.Thread(target=serve, args=(listener,), daemon=True)
+        server.start()
+        with webserver('-p', self.ip, f'{self.port}', f'{self.id}', env=_peer_env(successor, successor)):
+            assert _request(self, 'GET', '/c')[0] == 502
+            assert _request(self, 'GET', '/c')[0] == 502
+            assert _metric(self, 'http_request_duration_seconds_count{method="GET",status="502"}') == 2
+
+        # Closing alone does not wake up accept(), the port would stay taken
+        listener.shutdown(socket.SHUT_RDWR)
+        server.join(timeout=2)
+
+
+def _metric(node, line):
+    metrics = _request(node, 'GET', '/_metrics')[2].decode()
+    return next(int(entry.rsplit(' ', 1)[1]) for entry in metrics.splitlines() if entry.startswith(line + ' '))
+
+
+def test_peer_pool(webserver):
+    """
+    Test connections to other nodes are opened ahead of time and reused
+    """
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0xc000, '127.0.0.1', 4712)
+    uri = '/c'  # the first node is responsible
+
+    with webserver('-p', '-S', '50', first.ip, f'{first.port}', f'{first.id}'), webserver(
+        '-p', '-S', '50', second.ip, f'{second.port}', f'{second.id}', first.ip, f'{first.port}'
+    ):
+        time.sleep(1.5)
+
+        # The successor was connected to before any request needed it
+        warmed = _metric(second, 'peer_connections_total{result="opened"}')
+        assert warmed >= 1
+        assert _metric(second, 'peer_connections_total{result="reused"}') == 0
+
+        for _ in range(20):
+            assert _request(second, 'GET', uri)[0] == 404
+
+        assert _metric(second, 'peer_connections_total{result="opened"}') == warmed
+        assert _metric(second, 'peer_connections_total{result="reused"}') == 20
@@ -0,0 +1,176 @@
+/**
+ * Build a catalog of static resources for `webserver -C`
+ *
+ * Every regular file below a directory becomes a resource, its key being
+ * the path relative to the directory with a leading slash, so the file
+ * `site/static/foo` is served as /static/foo from a catalog built of `site`.
+ * The catalog is written next to its destination and renamed into place,
+ * so servers still mapping an older version keep serving that one.
+ *
+ * Usage: mkcatalog catalog directory
+ */
+
+#define _GNU_SOURCE  // nftw()
+
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../catalog.h"
+
+
+/**
+ * A file to be added to the catalog
+ *
+ * `key`: the resource's key
+ * `path`: the file holding its value
+ * `length`: number of bytes of the file
+ */
+struct resource {
+    char* key;
+    char* path;
+    uint64_t length;
+};
+
+
+static struct resource* resources = NULL;
+static size_t n_resources = 0;
+static size_t capacity = 0;
+static size_t root_length;
+
+
+static int add_file(const char* path, const struct stat* status, int type, struct FTW* position) {
+    (void) position;
+    if (type != FTW_F || !S_ISREG(status->st_mode)) {
+        return 0;
+    }
+    if (n_resources == capacity) {
+        capacity = capacity ? 2 * capacity : 256;
+        resources = realloc(resources, capacity * sizeof(struct resource));
+        if (resources == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    const char* relative = path + root_length;
+    while (*relative == '/') {
+        relative += 1;
+    }
+    char* key = malloc(strlen(relative) + 2);
+    key[0] = '/';
+    strcpy(key + 1, relative);
+    resources[n_resources++] = (struct resource) {
+        .key = key,
+        .path = strdup(path),
+        .length = status->st_size,
+    };
+    return 0;
+}
+
+
+static int compare_keys(const void* a, const void* b) {
+    return strcmp(((const struct resource*) a)->key, ((const struct resource*) b)->key);
+}
+
+
+static void write_all(FILE* output, const void* data, size_t length) {
+    if (fwrite(data, 1, length, output) != length) {
+        perror("fwrite");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * Append the contents of the file at `path`, which must be `length` bytes long
+ */
+static void copy_file(FILE* output, const char* path, uint64_t length) {
+    FILE* input = fopen(path, "rb");
+    if (input == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    char buffer[1 << 16];
+    uint64_t copied = 0;
+    size_t n;
+    while (copied < length && (n = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+        n = n < length - copied ? n : length - copied;
+        write_all(output, buffer, n);
+        copied += n;
+    }
+    if (copied != length) {
+        fprintf(stderr, "%s: changed while building the catalog\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(input);
+}
+
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s catalog directory\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char* destination = argv[1];
+    const char* root = argv[2];
+
+    root_length = strlen(root);
+    if (nftw(root, add_file, 64, FTW_PHYS) == -1) {
+        perror(root);
+        return EXIT_FAILURE;
+    }
+    qsort(resources, n_resources, sizeof(struct resource), compare_keys);
+
+    // Lay out the entries, then the keys, then the aligned values
+    struct catalog_entry* entries = calloc(n_resources ? n_resources : 1, sizeof(struct catalog_entry));
+    uint64_t offset = sizeof(struct catalog_header) + n_resources * sizeof(struct catalog_entry);
+    for (size_t i = 0; i < n_resources; i += 1) {
+        entries[i].key = offset;
+        offset += strlen(resources[i].key) + 1;
+    }
+    struct catalog_header header = {
+        .magic = CATALOG_MAGIC,
+        .n_entries = n_resources,
+        .keys_end = offset,
+    };
+    for (size_t i = 0; i < n_resources; i += 1) {
+        offset = (offset + CATALOG_ALIGNMENT - 1) / CATALOG_ALIGNMENT * CATALOG_ALIGNMENT;
+        entries[i].value = offset;
+        entries[i].value_length = resources[i].length;
+        offset += resources[i].length;
+    }
+
+    char* temporary = malloc(strlen(destination) + sizeof(".tmp"));
+    sprintf(temporary, "%s.tmp", destination);
+    FILE* output = fopen(temporary, "wb");
+    if (output == NULL) {
+        perror(temporary);
+        return EXIT_FAILURE;
+    }
+    write_all(output, &header, sizeof(header));
+    write_all(output, entries, n_resources * sizeof(struct catalog_entry));
+    for (size_t i = 0; i < n_resources; i += 1) {
+        write_all(output, resources[i].key, strlen(resources[i].key) + 1);
+    }
+    static const char padding[CATALOG_ALIGNMENT];
+    for (size_t i = 0; i < n_resources; i += 1) {
+        write_all(output, padding, entries[i].value - ftell(output));
+        copy_file(output, resources[i].path, resources[i].length);
+    }
+    if (fflush(output) != 0 || fsync(fileno(output)) == -1 || fclose(output) != 0) {
+        perror(temporary);
+        return EXIT_FAILURE;
+    }
+    if (rename(temporary, destination) == -1) {
+        perror("rename");
+        return EXIT_FAILURE;
+    }
+
+    printf("%zu resources, %lu bytes\n", n_resources, (unsigned long) offset);
+    return EXIT_SUCCESS;
+}
@@ -1,19 +1,29 @@
 #include "util.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
 
 
 char* memstr(char* haystack, size_t n, string needle) {
-    char* end = haystack + n;
+    const size_t needle_length = strlen(needle);
+    if (needle_length == 0 || needle_length > n) {
+        return needle_length == 0 ? haystack : NULL;
+    }
+    // The needle has to start early enough to fit into the haystack
+    char* last = haystack + n - needle_length;
 
     // Iterate through the memory (haystack)
-    while ((haystack = memchr(haystack, needle[0], end - haystack)) != NULL) {
-        if (strncmp(haystack, needle, strlen(needle)) == 0) {
+    while ((haystack = memchr(haystack, needle[0], last - haystack + 1)) != NULL) {
+        if (memcmp(haystack, needle, needle_length) == 0) {
             return haystack;
         }
+        haystack += 1;
     }
 
     return NULL;
@@ -30,3 +40,108 @@ uint16_t safe_strtoul(const char *restrict nptr, char **restrict endptr, int bas
     }
     return result;
 }
+
+
+unsigned long long safe_strtoull(const char *restrict nptr, char **restrict endptr, int base, const string message) {
+    errno = 0;
+    unsigned long long result = strtoull(nptr, endptr, base);
+
+    if (errno != 0) {
+        fprintf(stderr, "%s\n", message);
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+
+unsigned long long safe_strtoull_range(const char* value, unsigned long long min, unsigned long long max,
+                                       const string message) {
+    char* end;
+    unsigned long long result = safe_strtoull(value, &end, 10, message);
+
+    // strtoull() accepts a sign and negates, "-1" would become the largest value
+    if (end == value || *end != '\0' || strchr(value, '-') || result < min || result > max) {
+        fprintf(stderr, "%s\n", message);
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+
+static void crc_table_init(void) {
+    for (uint32_t i = 0; i < 256; i += 1) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit += 1) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);  // Castagnoli polynomial, reflected
+        }
+        crc_table[i] = crc;
+    }
+}
+
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    pthread_once(&crc_table_once, crc_table_init);
+
+    const uint8_t* bytes = data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i += 1) {
+        crc = (crc >> 8) ^ crc_table[(crc ^ bytes[i]) & 0xff];
+    }
+    return ~crc;
+}
+
+
+uint64_t fnv1a(const char* str) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const unsigned char* c = (const unsigned char*) str; *c; c += 1) {
+        hash ^= *c;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+
+uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+uint64_t monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+bool send_all(int sock, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(sock, data, length, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+
+bool send_file(int sock, int file, size_t length) {
+    off_t offset = 0;
+    while ((size_t) offset < length) {
+        ssize_t sent = sendfile(sock, file, &offset, length - offset);
+        if (sent == 0 || (sent == -1 && errno != EINTR)) {
+            return false;  // the file is shorter than expected, or the connection failed
+        }
+    }
+    return true;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 
@@ -18,3 +19,49 @@ char* memstr(char* haystack, size_t n, string needle);
  * In that case, the given message will be printed before exiting the program.
  */
 uint16_t safe_strtoul(const char *restrict nptr, char **restrict endptr, int base, const string message);
+
+/**
+ * Like `safe_strtoul()`, for values that do not fit into 16 bits, e.g. sizes
+ */
+unsigned long long safe_strtoull(const char *restrict nptr, char **restrict endptr, int base, const string message);
+
+/**
+ * Parse a whole decimal option value within [`min`, `max`]
+ *
+ * Prints the given message and exits the program on anything else,
+ * including values that would wrap around.
+ */
+unsigned long long safe_strtoull_range(const char* value, unsigned long long min, unsigned long long max,
+                                       const string message);
+
+/**
+ * 64-bit FNV-1a hash of a C-string, for hash tables
+ */
+uint64_t fnv1a(const char* str);
+
+/**
+ * Continue the CRC-32C `crc` of preceding bytes over `length` more bytes
+ *
+ * The CRC of no bytes is 0, so a checksum can be updated as data arrives.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+/**
+ * Milliseconds on a monotonic clock, for deadlines and timeouts
+ */
+uint64_t monotonic_ms(void);
+
+/**
+ * Microseconds on a monotonic clock, for measuring latencies
+ */
+uint64_t monotonic_us(void);
+
+/**
+ * Write all of `data` to a blocking socket, returns false if the connection failed
+ */
+bool send_all(int sock, const char* data, size_t length);
+
+/**
+ * Send `length` bytes of `file` from its start, returns false if the connection failed
+ */
+bool send_file(int sock, int file, size_t length);
@@ -1,50 +1,51 @@
-#include <assert.h>
+#define _GNU_SOURCE  // accept4()
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
-#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
-#include <openssl/sha.h>
 
+#include "catalog.h"
 #include "data.h"
+#include "dht.h"
 #include "http.h"
+#include "journal.h"
+#include "logger.h"
+#include "metrics.h"
+#include "migration.h"
+#include "pool.h"
+#include "proxy.h"
+#include "replica.h"
 #include "util.h"
 
-#define MAX_RESOURCES 100
-
-
-struct tuple resources[MAX_RESOURCES] = {
-        {"/static/foo", "Foo", sizeof "Foo" - 1},
-        {"/static/bar", "Bar", sizeof "Bar" - 1},
-        {"/static/baz", "Baz", sizeof "Baz" - 1}
-};
-
-typedef struct Node{
-    int id;
-    char *ip;
-    int port;
-    struct Node* pred;
-    struct Node* succ;
-}__attribute__((packed)) Node;
-
-
-
+#define INITIAL_RESOURCES 100
+#define DEFAULT_BACKLOG 128
+#define DEFAULT_MAX_CONNECTIONS 1024
+#define MAX_WORKERS 1024  // upper bound of -w, each worker is a thread with a listening socket
+#define MAX_EVENTS 64
+#define METRICS_URI "/_metrics"
 
-typedef struct Message{
-    uint8_t flag;
-    uint16_t hash;
-    uint16_t id;
-    uint32_t ip;
-    uint16_t port;
-}__attribute__((packed)) Message;
 
+struct store resources;
+struct catalog catalog;
 
 
 /**
@@ -76,400 +77,741 @@ static struct sockaddr_in derive_sockaddr(const char* host, const char* port) {
     return result;
 }
 
-int udp_node_socket(struct sockaddr_in addr){
-    const int enable = 1;
-
-
-    // Create a socket
-    int sockDgram = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockDgram == -1) {
-        perror("socket");
-        exit(EXIT_FAILURE);
-    }
-
-    // Set the SO_REUSEADDR socket option to allow reuse of local addresses
-    if (setsockopt(sockDgram, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1) {
-        perror("setsockopt");
-        exit(EXIT_FAILURE);
-    }
-
-    // Bind socket to the provided address
-    if (bind(sockDgram, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
-        perror("bind");
-        close(sockDgram);
-        exit(EXIT_FAILURE);
-    }
+/**
+ * Kinds of descriptors registered with the event loop
+ *
+ * The kind is kept in the upper half of `epoll_event.data.u64`, the
+ * descriptor in the lower half, see `event_data()`.
+ */
+enum event_source {
+    SOURCE_LISTENER,
+    SOURCE_CONNECTION,
+    SOURCE_SIGNAL,
+    SOURCE_DHT,
+    SOURCE_TIMER,
+    SOURCE_MAINTENANCE,
+    SOURCE_MAILBOX,
+};
 
 
-    return sockDgram;
+static uint64_t event_data(enum event_source source, int fd) {
+    return ((uint64_t) source << 32) | (uint32_t) fd;
 }
 
 
+/**
+ * State of the event loop
+ *
+ * `epoll`: the epoll instance all descriptors are registered with
+ * `listener`: the listening TCP socket
+ * `accepting`: whether `listener` is currently registered for events
+ * `max_connections`: upper bound for concurrently open client connections
+ * `n_connections`: number of currently open client connections
+ * `connections`: per-connection state, indexed by socket descriptor. Entries
+ *                are allocated on first use and reused when the descriptor
+ *                number is handed out again.
+ * `table_size`: number of entries in `connections`
+ * `dht`: DHT state shared by all workers, its socket and timer are only
+ *        watched by the first worker
+ * `park_lookups`: whether requests for remote keys wait for the lookup to
+ *                 complete instead of being answered with 503 right away
+ * `replicator`: passes writes of local keys on to their replicas, NULL
+ *               without replication
+ * `proxy`: forwards requests for remote keys to the responsible node
+ *          instead of redirecting the client, NULL unless in proxy mode
+ * `signals`: signalfd receiving SIGUSR1, which requests a statistics dump,
+ *            and SIGTERM, which makes the node leave the ring. Only watched
+ *            by the first worker, -1 for all others.
+ * `migrator`: hands the local keys over when leaving, NULL when running
+ *             standalone or for workers not watching `signals`
+ * `generation`: counter distinguishing connections reusing a descriptor
+ * `mailbox`: eventfd signalling that `completed` is non-empty
+ * `completed`: waiters of parked connections whose lookup completed,
+ *              guarded by `mailbox_lock`
+ * `forwarded`: forwarded requests of parked connections whose reply
+ *              arrived, guarded by `mailbox_lock`
+ * `thread`: the thread running this server's event loop
+ *
+ * Every worker thread runs a server of its own, with a separate listening
+ * socket bound to the same address (SO_REUSEPORT), so the kernel balances
+ * incoming connections and workers share nothing but the resource store.
+ */
+struct server {
+    int epoll;
+    int listener;
+    int signals;
+    bool accepting;
+    size_t max_connections;
+    size_t n_connections;
+    struct connection_state** connections;
+    size_t table_size;
+    struct dht* dht;
+    bool park_lookups;
+    struct replicator* replicator;
+    struct proxy* proxy;
+    struct migrator* migrator;
+    uint64_t generation;
+    int mailbox;
+    pthread_mutex_t mailbox_lock;
+    struct lookup_waiter* completed;
+    struct proxy_request* forwarded;
+    pthread_t thread;
+};
 
-void lookup_reply(struct Node* node) {
-
-    struct sockaddr_in serveraddr;
-    char port[6];
-    snprintf(port, sizeof(port), "%d", node->port);
 
-    serveraddr = derive_sockaddr(node->ip, port);
+/**
+ * Queues the reply to the current request.
+ *
+ * The status line and header fields are formatted into the connection's
+ * output, a body may be attached to the returned reply, see `send_reply()`.
+ * There is room for at least one more reply whenever a request is
+ * processed, see `output_full()`.
+ *
+ * @return Returns NULL if the header is longer than HTTP_MAX_SIZE.
+ */
+static struct reply* reply_prepare(struct connection_state* state, const char* format, ...) {
+    struct output* output = &(state->output);
+    char* header = output->headers + output->headers_length;
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(header, HTTP_MAX_SIZE, format, args);
+    va_end(args);
+    if (length < 0 || length >= HTTP_MAX_SIZE) {
+        return NULL;
+    }
 
-    int sock = udp_node_socket(serveraddr);
+    struct reply* reply = &(output->replies[output->n_replies]);
+    *reply = (struct reply) {
+        .header = output->headers_length,
+        .header_length = length,
+        .body = NULL,
+        .file = -1,
+    };
+    output->headers_length += length;
+    output->n_replies += 1;
 
-    struct sockaddr_in clientaddr;
-    socklen_t addr_len = sizeof(clientaddr);
-    bzero(&clientaddr, sizeof(clientaddr));
-    struct Message *msg = malloc(sizeof(struct Message));
-    ssize_t recvm = recvfrom(sock, msg, sizeof(Message), 0, (struct sockaddr*)&clientaddr, &addr_len);
-    if(recvm == -1){
-        perror("recvfrom");
-        close(sock);
-        exit(EXIT_FAILURE);
-    }
+    int status = atoi(header + sizeof("HTTP/1.1"));
+    metrics_request(state->request_method, status, monotonic_us() - state->request_start);
+    return reply;
+}
 
-    if(htons(msg->hash) > node->id && htons(msg->hash) <= node->succ->id){ //lookup_reply
 
-        struct in_addr self_addr;
-        inet_pton(AF_INET, node->succ->ip, &self_addr.s_addr);
+/**
+ * Whether queued replies have not been sent completely yet.
+ */
+static bool output_pending(const struct output* output) {
+    return output->first < output->n_replies;
+}
 
-        struct Message* reply = malloc(sizeof(Message));
-        reply->flag = 1;
-        reply->hash = htons(node->id);
-        reply->id = htons(node->succ->id);
-        reply->ip = self_addr.s_addr;
-        reply->port = htons(node->succ->port);
 
+/**
+ * Whether the output may not have room for the reply to another request.
+ */
+static bool output_full(const struct output* output) {
+    return output->n_replies == HTTP_MAX_REPLIES || sizeof(output->headers) - output->headers_length < HTTP_MAX_SIZE;
+}
 
-        sendto(sock, reply, sizeof(Message), 0, (struct sockaddr*) &clientaddr, sizeof(clientaddr));
 
+/**
+ * Frees the body of a reply, or hands it back to the store.
+ */
+static void reply_release(struct reply* reply) {
+    if (reply->owned) {
+        free((char*) reply->body);
+    } else if (reply->body && !reply->borrowed) {
+        release(&resources, reply->body);
     }
-    else{ //lookup_forward
-
+}
 
-        struct sockaddr_in succaddr;
-        char succport[6];
-        snprintf(succport, sizeof(succport), "%d", node->succ->port);
 
-        succaddr = derive_sockaddr(node->succ->ip, succport);
+/**
+ * Drops all queued replies and their bodies.
+ */
+static void output_clear(struct output* output) {
+    for (size_t i = output->first; i < output->n_replies; i += 1) {
+        reply_release(&(output->replies[i]));
+    }
+    output->first = 0;
+    output->n_replies = 0;
+    output->headers_length = 0;
+}
 
-        sendto(sock, msg, sizeof(Message), 0, (struct sockaddr*) &succaddr, sizeof(succaddr));
 
+/**
+ * Marks `n` more bytes of the queued replies as sent.
+ */
+static void output_advance(struct output* output, size_t n) {
+    while (n > 0) {
+        struct reply* reply = &(output->replies[output->first]);
+        size_t remaining = reply->header_length + reply->body_length - reply->sent;
+        if (n < remaining) {
+            reply->sent += n;
+            return;
+        }
 
+        n -= remaining;
+        reply_release(reply);
+        output->first += 1;
     }
-
 }
 
-void dht_reply(struct Node* node, int sock) {
-
 
+/**
+ * Sends as many of the queued replies as the socket accepts.
+ *
+ * Headers and bodies in memory of all replies are passed to the kernel in
+ * a single call. A file-backed body is sent with sendfile() after its
+ * header, which is held back with MSG_MORE to share packets with the body.
+ *
+ * @return Returns false if the connection failed.
+ */
+static bool output_flush(struct connection_state* state) {
+    struct output* output = &(state->output);
+
+    while (output_pending(output)) {
+        struct reply* first = &(output->replies[output->first]);
+        ssize_t sent;
+        if (first->file != -1 && first->sent >= first->header_length) {
+            off_t offset = first->offset + (first->sent - first->header_length);
+            sent = sendfile(state->sock, first->file, &offset, first->header_length + first->body_length - first->sent);
+            if (sent == 0) {
+                // Nothing more to read, the file is shorter than the body
+                fprintf(stderr, "sendfile: value file ends before its length\n");
+                return false;
+            }
+        } else {
+            struct iovec parts[2 * HTTP_MAX_REPLIES];
+            int n_parts = 0;
+            int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+            for (size_t i = output->first; i < output->n_replies; i += 1) {
+                struct reply* reply = &(output->replies[i]);
+                if (reply->sent < reply->header_length) {
+                    parts[n_parts++] = (struct iovec) {
+                        .iov_base = output->headers + reply->header + reply->sent,
+                        .iov_len = reply->header_length - reply->sent,
+                    };
+                }
+                if (reply->file != -1) {
+                    flags |= MSG_MORE;  // The body follows
+                    break;
+                }
+                size_t body_sent = reply->sent > reply->header_length ? reply->sent - reply->header_length : 0;
+                if (reply->body_length > body_sent) {
+                    parts[n_parts++] = (struct iovec) {
+                        .iov_base = (char*) reply->body + body_sent,
+                        .iov_len = reply->body_length - body_sent,
+                    };
+                }
+            }
+            struct msghdr message = {
+                .msg_iov = parts,
+                .msg_iovlen = n_parts,
+            };
+            sent = sendmsg(state->sock, &message, flags);
+        }
 
-    struct sockaddr_in clientaddr;
-    socklen_t addr_len = sizeof(clientaddr);
-    bzero(&clientaddr, sizeof(clientaddr));
-    struct Message *msg = malloc(sizeof(struct Message));
-    ssize_t recvm = recvfrom(sock, msg, sizeof(Message), 0, (struct sockaddr*)&clientaddr, &addr_len);
-    if(recvm == -1){
-        perror("recvfrom");
-        close(sock);
-        exit(EXIT_FAILURE);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;  // Continued once the socket is writable again
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            return false;
+        }
+        output_advance(output, sent);
     }
-    struct Node* tmp = node;
-
 
-    if(msg->hash > node->id && msg->hash <= node->succ->id){ //lookup_reply
-
-        struct in_addr self_addr;
-        inet_pton(AF_INET, node->succ->ip, &self_addr.s_addr);
+    output_clear(output);
+    return true;
+}
 
-        struct Message* reply = malloc(sizeof(Message));
-        reply->flag = 1;
-        reply->hash = htons(node->id);
-        reply->id = htons(node->succ->id);
-        reply->ip = self_addr.s_addr;
-        reply->port = htons(node->succ->port);
 
-        sendto(sock, reply, sizeof(Message), 0, (struct sockaddr*) &clientaddr, sizeof(clientaddr));
+/**
+ * Hash of a requested URI, selecting the node responsible for it.
+ *
+ * Computing `hash()` is costly, so hashes are taken from the thread's memo
+ * of recent URIs or from the store, which records them for all its keys.
+ * The fast hash is cheaper than either lookup.
+ */
+static uint16_t uri_hash(const string uri) {
+#ifdef DHT_FAST_HASH
+    return hash(uri);
+#else
+    uint16_t value;
+    if (hash_memo_find(uri, &value)) {
+        return value;
     }
-    while(!(msg->hash > tmp->id && msg->hash <= tmp->succ->id)){ //lookup_forward
-
-        struct sockaddr_in succaddr;
-        char succport[6];
-        snprintf(succport, sizeof(succport), "%d", tmp->succ->port);
-        succaddr = derive_sockaddr(tmp->succ->ip, succport);
-        sendto(sock, msg, sizeof(Message), 0, (struct sockaddr*) &succaddr, sizeof(succaddr));
-        tmp = node->succ;
-
+    if (!get_position(uri, &resources, &value)) {
+        value = hash(uri);
     }
-
+    hash_memo_insert(uri, value);
+    return value;
+#endif
 }
 
-int lookup_send(struct Node* node, unsigned short hash_value){
-    struct sockaddr_in addr;
-    int node_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(node->succ->port);
-    inet_pton(AF_INET, node->succ->ip, &addr.sin_addr);
 
-    if(connect(node_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-    {
-        printf("\n Error : Connect Failed \n");
-        close(node_socket);
-        exit(EXIT_FAILURE);
+/**
+ * Prepares a redirect to the node responsible for the requested URI.
+ *
+ * @param state The state of the client connection.
+ * @param to The node to redirect to.
+ * @param uri The requested URI.
+ */
+static void send_redirect(struct connection_state* state, const Node* to, const string uri) {
+    if (!reply_prepare(state, "HTTP/1.1 303 See Other\r\nLocation: http://%s%s\r\nContent-Length: 0\r\n\r\n",
+                       to->authority, uri)) {
+        reply_prepare(state, "HTTP/1.1 414 URI Too Long\r\nContent-Length: 0\r\n\r\n");
     }
-
-    struct in_addr self_addr;
-    inet_pton(AF_INET, node->ip, &self_addr.s_addr);
-
-    struct Message* msg = malloc(sizeof(Message));
-    msg->flag = htons(0);
-    msg->hash = htons(hash_value);
-    msg->id = htons(node->id);
-    msg->ip = self_addr.s_addr;
-    msg->port = htons(node->port);
-    sendto(node_socket, msg, sizeof(Message), 0, (struct sockaddr*) &addr, sizeof(addr));
-    return node_socket;
-
 }
 
-struct Node* reply_check(int sock){
 
-    struct sockaddr_in clientaddr;
-    socklen_t addr_len = sizeof(clientaddr);
-    bzero(&clientaddr, sizeof(clientaddr));
-    struct Message *msg = malloc(sizeof(struct Message));
-    ssize_t recvm = recvfrom(sock, msg, sizeof(Message), 0, (struct sockaddr*)&clientaddr, &addr_len);
-    if(recvm == -1){
-        perror("recvfrom");
-        close(sock);
-        exit(EXIT_FAILURE);
+/**
+ * Registers the connection for the events it currently waits for.
+ *
+ * Parked connections wait for their lookup and are not watched at all,
+ * connections with partially sent replies wait until the socket is
+ * writable, all others wait for the next request.
+ */
+static void connection_watch(struct server* server, struct connection_state* state) {
+    uint32_t events = EPOLLIN | EPOLLRDHUP;
+    if (output_pending(&(state->output))) {
+        events = EPOLLOUT;
+    } else if (state->parked) {
+        events = 0;
+    }
+    if (events == state->events) {
+        return;
+    }
+
+    struct epoll_event event = {
+        .events = events,
+        .data.u64 = event_data(SOURCE_CONNECTION, state->sock),
+    };
+    if (epoll_ctl(server->epoll, EPOLL_CTL_MOD, state->sock, &event) == -1) {
+        perror("epoll_ctl");
     }
-    struct Node* responsible = malloc(sizeof(Node));
-    responsible->id = msg->id;
-    char ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &msg->ip, ip, INET_ADDRSTRLEN);
-    responsible->ip = calloc(sizeof(ip), sizeof(char));
-    memcpy(responsible->ip, ip, strlen(ip));
-    responsible->port = ntohs(msg->port);
-    return responsible;
+    state->events = events;
 }
 
 
 /**
- * Sends an HTTP reply to the client based on the received request.
+ * Defers the reply to a request until the lookup of the responsible node completes.
  *
- * @param conn      The file descriptor of the client connection socket.
- * @param request   A pointer to the struct containing the parsed request information.
+ * The connection stops reading, later requests are processed once the
+ * deferred reply was sent, see `server_resume()`.
  */
-void send_reply(int conn, struct request* request, struct Node* node, unsigned short hash_value) {
-
-    // Create a buffer to hold the HTTP reply
-    char buffer[HTTP_MAX_SIZE];
-    char *reply = buffer;
-    char *rep = buffer;
-
-    fprintf(stderr, "Handling %s request for %s (%lu byte payload)\n", request->method, request->uri, request->payload_length);
+static void park_connection(struct connection_state* state, const string uri) {
+    state->parked = true;
+    state->parked_uri = strdup(uri);
+}
 
-    if(node != NULL){
-        if(node->pred->id == node->succ->id){
-            if(hash_value > node->id && hash_value <= node->succ->id){
-                sprintf(reply, "HTTP/1.1 303 See Other\r\nLocation: http://%.*s:%d%.*s\r\nContent-Length: 0\r\n\r\n", (int) strlen(node->succ->ip), node->succ->ip, node->succ->port,(int) strlen(request->uri), request->uri);
-            }else{
-                reply = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-            }
-        }
 
-        if(node->pred->id != node->succ->id){
+/**
+ * Queues the resource stored under `uri` as reply, returns false if there is none.
+ */
+static bool send_resource(struct connection_state* state, const string uri) {
+    size_t resource_length;
+    const char* resource = get(uri, &resources, &resource_length);
+    if (!resource) {
+        return false;
+    }
 
+    // The reply keeps the reference until the body is sent
+    struct reply* reply = reply_prepare(state, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", resource_length);
+    reply->body = resource;
+    reply->file = value_file(resource);
+    reply->body_length = resource_length;
+    return true;
+}
 
-            if (hash_value > node->id && hash_value > node->succ->id) {
 
-                rep = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
-                send(conn, rep, strlen(rep), 0);
+/**
+ * Whether the catalog has a resource under `uri`.
+ */
+static bool is_static(const string uri) {
+    size_t resource_length;
+    return catalog_find(&catalog, uri, &resource_length) != NULL;
+}
 
-                int sock = lookup_send(node, hash_value);
 
-                if(hash_value > node->succ->id && hash_value <= node->succ->succ->id){
-                    struct sockaddr_in node_addr;
-                    char node_port[6];
-                    snprintf(node_port, sizeof(node_port), "%d", node->port);
+/**
+ * Queues the resource of the catalog under `uri` as reply, returns false if there is none.
+ */
+static bool send_static(struct connection_state* state, const string uri) {
+    size_t resource_length;
+    const char* resource = catalog_find(&catalog, uri, &resource_length);
+    if (!resource) {
+        return false;
+    }
 
-                    node_addr = derive_sockaddr(node->ip, node_port);
+    // Sent straight from the mapped catalog
+    struct reply* reply = reply_prepare(state, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", resource_length);
+    reply->body = resource;
+    reply->borrowed = true;
+    reply->body_length = resource_length;
+    return true;
+}
 
-                    int node_sock = udp_node_socket(node_addr);
-                    struct Node *res = reply_check(node_sock);
-                    sprintf(reply, "HTTP/1.1 303 See Other\r\nLocation: http://%.*s:%d%.*s\r\nContent-Length: 0\r\n\r\n",
-                            (int) strlen(res->ip), res->ip, res->port, (int) strlen(request->uri), request->uri);
-                    send(conn, reply, strlen(reply), 0);
-                }
-                else{
-                    reply = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-                }
-            } else{
-                if (strcmp(request->method, "GET") == 0) {
-                    if(htons(hash_value) > node->id && htons(hash_value) <= node->succ->id){
-                        sprintf(reply, "HTTP/1.1 303 See Other\r\nLocation: http://%.*s:%d%.*s\r\nContent-Length: 0\r\n\r\n", (int) strlen(node->succ->ip), node->succ->ip, node->succ->port,(int) strlen(request->uri), request->uri);
 
-                    }
+/**
+ * Whether a request is a write passed on by the node responsible for the
+ * key, to a replica or to a node taking the key over.
+ *
+ * The REPLICA_HEADER is internal to the ring: it is only honored on
+ * connections from the predecessor or a successor, a client sending it is
+ * treated like any other.
+ */
+static bool is_replica_write(struct server* server, const struct connection_state* state,
+                             const struct request* request) {
+    return strcmp(request->method, "GET") != 0 && get_header(request, REPLICA_HEADER)
+           && dht_is_neighbor(server->dht, &(state->client.sin_addr));
+}
 
-                    if((htons(hash_value) > node->id && htons(hash_value) > node->succ->id)){
 
-                        struct sockaddr_in serveraddr;
-                        char port[6];
-                        snprintf(port, sizeof(port), "%d", node->succ->port);
+/**
+ * Whether a request is a write handing the key over from the node that was
+ * responsible for it before the local one joined
+ */
+static bool is_handover(struct server* server, const struct connection_state* state, const struct request* request) {
+    return is_replica_write(server, state, request)
+           && strcmp(get_header(request, REPLICA_HEADER), REPLICA_HANDOVER) == 0;
+}
 
-                        serveraddr = derive_sockaddr(node->succ->ip, port);
 
-                        int sock = udp_node_socket(serveraddr);
+/**
+ * Passes a write of a local key on to the replicas, unless it came from
+ * another node's replication.
+ */
+static void replicate(struct server* server, const struct connection_state* state, const struct request* request) {
+    if (!is_replica_write(server, state, request) && server->replicator) {
+        replicator_queue(server->replicator, request->uri);
+    }
+}
 
-                        int node_socket = lookup_send(node, hash_value);
 
+/**
+ * Whether the server has few connection slots left, so reads are better
+ * served by replicas.
+ */
+static bool server_busy(const struct server* server) {
+    return server->n_connections * 4 >= server->max_connections * 3;
+}
 
-                        dht_reply(node->succ, sock);
 
-                        struct Node* resp = reply_check(node_socket);
+/**
+ * Forwards a request for a remote key to the responsible node, parking the
+ * connection until its reply arrives.
+ *
+ * A request whose responsible node is not known yet waits for the lookup
+ * first, see `server_resume()`.
+ */
+static void forward_request(struct server* server, struct connection_state* state, struct proxy_request* forwarded,
+                            uint16_t hash_value) {
+    forwarded->owner = server;
+    forwarded->sock = state->sock;
+    forwarded->generation = state->generation;
+
+    struct lookup_waiter* waiter = malloc(sizeof(struct lookup_waiter));
+    *waiter = (struct lookup_waiter) {
+        .owner = server,
+        .sock = state->sock,
+        .generation = state->generation,
+    };
+    park_connection(state, forwarded->uri);
+    if (dht_lookup(server->dht, hash_value, &(forwarded->peer), waiter)) {
+        free(waiter);
+        proxy_submit(server->proxy, forwarded);
+    } else {
+        state->forward = forwarded;
+    }
+}
 
-                        sprintf(reply, "HTTP/1.1 303 See Other\r\nLocation: http://%.*s:%d%.*s\r\nContent-Length: 0\r\n\r\n",
-                                (int) strlen(resp->ip), resp->ip, resp->port, (int) strlen(request->uri), request->uri);
 
-                    }
-                    if((htons(hash_value) < node->id && htons(hash_value) < node->succ->id)){
-                        if(htons(hash_value) < node->pred->id){
-                            sprintf(reply, "HTTP/1.1 303 See Other\r\nLocation: http://%.*s:%d%.*s\r\nContent-Length: 0\r\n\r\n", (int) strlen(node->succ->ip), node->succ->ip, node->succ->port,(int) strlen(request->uri), request->uri);
-                            send(conn, reply, strlen(reply), 0);
-                        }
-                        else{
-                            sprintf(reply, "HTTP/1.1 303 See Other\r\nLocation: http://%.*s:%d%.*s\r\nContent-Length: 0\r\n\r\n", (int) strlen(node->succ->ip), node->succ->ip, node->succ->port,(int) strlen(request->uri), request->uri);
-                            send(conn, reply, strlen(reply), 0);
-                        }
-                    }
-                    if((htons(hash_value) < node->id && htons(hash_value) > node->succ->id)){
-                        sprintf(reply, "HTTP/1.1 303 See Other\r\nLocation: http://%.*s:%d%.*s\r\nContent-Length: 0\r\n\r\n", (int) strlen(node->succ->ip), node->succ->ip, node->succ->port,(int) strlen(request->uri), request->uri);
-                        send(conn, reply, strlen(reply), 0);
+/**
+ * Prepares an HTTP reply to the client based on the received request.
+ *
+ * Requests for keys the local node is not responsible for are redirected to
+ * the responsible node. If it is not known yet, a lookup is started and the
+ * client is asked to retry, or the connection is parked until the lookup
+ * completes if `park_lookups` is set. In proxy mode, they are forwarded to
+ * the responsible node instead, unless another node forwarded them.
+ *
+ * Every node has the catalog, so its resources are served by whichever node
+ * is asked, and cannot be written.
+ *
+ * Writes marked with the REPLICA_HEADER, by a neighbor replicating or
+ * handing over its keys, are applied as they come. Hand-overs never replace
+ * a value written to the local node itself, and are acknowledged either
+ * way. With replication, writes of local keys are passed on to the
+ * replicas, keys of the predecessors the node replicates are read locally,
+ * and a busy node redirects reads of its own keys to the least loaded
+ * replica. Copies of other keys may be outdated and are never served.
+ *
+ * @param server    The server the client is connected to.
+ * @param state     The state of the client connection.
+ * @param request   A pointer to the struct containing the parsed request information.
+ * @param hash_value The hash of the requested URI.
+ */
+void send_reply(struct server* server, struct connection_state* state, struct request* request, uint16_t hash_value) {
+    logger_printf("Handling %s request for %s (%lu byte payload)\n", request->method, request->uri, request->payload_length);
+
+    if (strcmp(request->uri, METRICS_URI) == 0 && strcmp(request->method, "GET") == 0) {
+        // Served by every node, regardless of which one is responsible for the URI
+        size_t length;
+        char* body = metrics_render(&resources, server->dht, &length);
+        struct reply* reply = reply_prepare(state, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                                   "Content-Length: %zu\r\n\r\n", length);
+        reply->body = body;
+        reply->owned = true;
+        reply->body_length = length;
+    } else if (strcmp(request->method, "GET") == 0 && send_static(state, request->uri)) {
+        return;
+    } else if (is_static(request->uri)) {
+        reply_prepare(state, "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n");
+    } else if (!is_replica_write(server, state, request) && !dht_responsible(server->dht, hash_value)) {
+        if (server->replicator && strcmp(request->method, "GET") == 0
+            && dht_replicates(server->dht, hash_value, server->replicator->n_replicas)
+            && send_resource(state, request->uri)) {
+            return;
+        }
+        if (server->proxy && !get_header(request, PROXY_HEADER)) {
+            forward_request(server, state,
+                            proxy_request_new(request->method, request->uri, request->payload,
+                                              request->payload_length, NULL),
+                            hash_value);
+            return;
+        }
 
-                    }
+        struct lookup_waiter* waiter = NULL;
+        if (server->park_lookups) {
+            waiter = malloc(sizeof(struct lookup_waiter));
+            *waiter = (struct lookup_waiter) {
+                .owner = server,
+                .sock = state->sock,
+                .generation = state->generation,
+            };
+        }
 
+        Node responsible;
+        if (dht_lookup(server->dht, hash_value, &responsible, waiter)) {
+            free(waiter);
+            send_redirect(state, &responsible, request->uri);
+            return;
+        }
+        if (waiter) {
+            park_connection(state, request->uri);
+            return;
+        }
+        reply_prepare(state, "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n");
+    } else if (strcmp(request->method, "GET") == 0) {
+        Node replica;
+        if (server->replicator && server_busy(server) && replicator_pick(server->replicator, &replica)) {
+            send_redirect(state, &replica, request->uri);
+        } else if (!send_resource(state, request->uri)) {
+            reply_prepare(state, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        }
+    } else if (strcmp(request->method, "PUT") == 0) {
+        // Try to set the requested resource with the given payload in the 'resources' store.
+        if (is_handover(server, state, request)) {
+            set_handed_over(request->uri, request->payload, request->payload_length, &resources);
+            reply_prepare(state, "HTTP/1.1 204 No Content\r\n\r\n");
+        } else if (set(request->uri, request->payload, request->payload_length, &resources)) {
+            reply_prepare(state, "HTTP/1.1 204 No Content\r\n\r\n");
+        } else {
+            reply_prepare(state, "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n");
+        }
+        replicate(server, state, request);
+    } else if (strcmp(request->method, "DELETE") == 0) {
+        // Try to delete the requested resource from the 'resources' store
+        if (is_handover(server, state, request)) {
+            delete_handed_over(request->uri, &resources);
+            reply_prepare(state, "HTTP/1.1 204 No Content\r\n\r\n");
+        } else if (delete(request->uri, &resources)) {
+            reply_prepare(state, "HTTP/1.1 204 No Content\r\n\r\n");
+        } else {
+            reply_prepare(state, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        }
+        replicate(server, state, request);
+    } else {
+        reply_prepare(state, "HTTP/1.1 501 Method Not Supported\r\nContent-Length: 0\r\n\r\n");
+    }
+}
 
-                    // Find the resource with the given URI in the 'resources' array.
 
+/**
+ * Appends received bytes to the body of the current upload.
+ *
+ * @return Returns false if writing to the file backing the value failed.
+ */
+static bool upload_write(struct connection_state* state, const char* data, size_t n) {
+    struct value* value = state->upload;
+    if (value->file == -1) {
+        memcpy(value->data + state->upload_received, data, n);
+        state->upload_received += n;
+        return true;
+    }
 
-                    size_t resource_length;
-                    const char* resource = get(request->uri, resources, MAX_RESOURCES, &resource_length);
+    while (n > 0) {
+        ssize_t written = pwrite(value->file, data, n, state->upload_received);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite");
+            return false;
+        }
+        data += written;
+        n -= written;
+        state->upload_received += written;
+    }
+    return true;
+}
 
-                    if (resource) {
-                        sprintf(reply, "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n%.*s", resource_length, (int) resource_length, resource);
-                    } else {
-                        reply = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-                    }
-                } else if (strcmp(request->method, "PUT") == 0) {
-
-                    // Try to set the requested resource with the given payload in the 'resources' array.
-                    if (set(request->uri, request->payload, request->payload_length, resources, MAX_RESOURCES
-                    )) {
-                        reply = "HTTP/1.1 204 No Content\r\n\r\n";
-                    } else {
-                        reply = "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
-                    }
-                }
 
+/**
+ * Drops the current upload, if any.
+ */
+static void upload_clear(struct connection_state* state) {
+    if (state->upload) {
+        release(&resources, state->upload->data);
+    }
+    free(state->upload_uri);
+    state->upload = NULL;
+    state->upload_uri = NULL;
+    state->upload_received = 0;
+}
 
-                else if (strcmp(request->method, "DELETE") == 0) {
 
-                    // Try to delete the requested resource from the 'resources' array
-                    if (delete(request->uri, resources, MAX_RESOURCES)) {
-                        reply = "HTTP/1.1 204 No Content\r\n\r\n";
-                    } else {
-                        reply = "HTTP/1.1 404 Not Found\r\n\r\n";
-                    }
-                }
-            }
+/**
+ * Stores the completely received body of the current upload and prepares
+ * the reply, or forwards it to the responsible node.
+ */
+static void upload_finish(struct server* server, struct connection_state* state) {
+    if (state->upload_proxy) {
+        forward_request(server, state, proxy_request_new("PUT", state->upload_uri, NULL, 0, state->upload),
+                        uri_hash(state->upload_uri));
+        state->close_after_reply = state->upload_close;
+
+        // The forwarded request took over the reference
+        state->upload = NULL;
+        upload_clear(state);
+        return;
+    }
 
+    if (state->upload_handover) {
+        set_value_handed_over(state->upload_uri, state->upload, &resources);
+        reply_prepare(state, "HTTP/1.1 204 No Content\r\n\r\n");
+    } else if (set_value(state->upload_uri, state->upload, &resources)) {
+        reply_prepare(state, "HTTP/1.1 204 No Content\r\n\r\n");
+    } else {
+        reply_prepare(state, "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n");
+    }
+    state->close_after_reply = state->upload_close;
+    if (state->upload_replicate) {
+        replicator_queue(server->replicator, state->upload_uri);
+    }
 
+    // The store took over the reference
+    state->upload = NULL;
+    upload_clear(state);
+}
 
-        }
-    }
-    else if (strcmp(request->method, "GET") == 0) {
-        // Find the resource with the given URI in the 'resources' array.
-        size_t resource_length;
-        const char* resource = get(request->uri, resources, MAX_RESOURCES, &resource_length);
 
-        if (resource) {
-            sprintf(reply, "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n%.*s", resource_length, (int) resource_length, resource);
-        } else {
-            reply = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-        }
-    } else if (strcmp(request->method, "PUT") == 0) {
-        // Try to set the requested resource with the given payload in the 'resources' array.
-        if (set(request->uri, request->payload, request->payload_length, resources, MAX_RESOURCES
-        )) {
-            reply = "HTTP/1.1 204 No Content\r\n\r\n";
-        } else {
-            reply = "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
-        }
-    } else if (strcmp(request->method, "DELETE") == 0) {
-        // Try to delete the requested resource from the 'resources' array
-        if (delete(request->uri, resources, MAX_RESOURCES)) {
-            reply = "HTTP/1.1 204 No Content\r\n\r\n";
+/**
+ * Handles a request whose body was not received together with its header.
+ *
+ * Bodies of PUT requests for local keys, or for remote keys in proxy mode,
+ * are received directly into a value of the right size, which large bodies
+ * keep in a temporary file, instead of the connection's buffer. All other
+ * requests are answered right away and their body is dropped as it arrives.
+ *
+ * @param received The number of bytes of the body already in the buffer, at `request->payload`.
+ */
+static void upload_start(struct server* server, struct connection_state* state, struct request* request,
+                         size_t received, bool close_requested) {
+    uint16_t hash_value = uri_hash(request->uri);
+    size_t length = request->payload_length;
+
+    bool replica_write = is_replica_write(server, state, request);
+    bool local = replica_write || dht_responsible(server->dht, hash_value);
+    bool proxied = !local && server->proxy && !get_header(request, PROXY_HEADER);
+    if (strcmp(request->method, "PUT") == 0 && (local || proxied) && !is_static(request->uri)) {
+        state->upload = value_alloc(request->uri, length, &resources);
+        if (state->upload) {
+            state->upload_uri = strdup(request->uri);
+            state->upload_close = close_requested;
+            state->upload_replicate = server->replicator && local && !replica_write;
+            state->upload_proxy = proxied;
+            state->upload_handover = is_handover(server, state, request);
+            if (!upload_write(state, request->payload, received)) {
+                upload_clear(state);
+                reply_prepare(state, "HTTP/1.1 507 Insufficient Storage\r\nContent-Length: 0\r\n\r\n");
+            } else {
+                return;
+            }
         } else {
-            reply = "HTTP/1.1 404 Not Found\r\n\r\n";
+            reply_prepare(state, "HTTP/1.1 507 Insufficient Storage\r\nContent-Length: 0\r\n\r\n");
         }
     } else {
-        reply = "HTTP/1.1 501 Method Not Supported\r\n\r\n";
-    }
-
-    // Send the reply back to the client
-    if (send(conn, reply, strlen(reply), 0) == -1) {
-        perror("send");
-        close(conn);
+        send_reply(server, state, request, hash_value);
     }
-}
 
-
-uint16_t hash(const char* str){ //Copied from Aufgabenblatt
-    uint8_t digest[SHA256_DIGEST_LENGTH];
-    SHA256((uint8_t *)str, strlen(str), digest);
-    return htons(*((uint16_t *)digest)); // We only use the first two bytes here
+    state->skip = length - received;
+    state->close_after_reply = close_requested;
 }
 
 
 /**
  * Processes an incoming packet from the client.
  *
- * @param conn The socket descriptor representing the connection to the client.
+ * @param server The server the client is connected to.
+ * @param state The state of the client connection.
  * @param buffer A pointer to the incoming packet's buffer.
  * @param n The size of the incoming packet.
  *
- * @return Returns the number of bytes processed from the packet.
- *         If the packet is successfully processed and a reply is sent, the return value indicates the number of bytes processed.
- *         If the packet is malformed or an error occurs during processing, the return value is -1.
+ * @return Returns the number of bytes processed from the packet, zero if no complete request was received yet.
+ *         If the request asks to close the connection, or is malformed and answered with 400, the connection
+ *         is closed once the reply is sent. A malformed request consumes all of the buffered data.
  *
  */
-size_t process_packet(int conn, char* buffer, size_t n, struct Node* node) {
+ssize_t process_packet(struct server* server, struct connection_state* state, char* buffer, size_t n) {
     struct request request = {
             .method = NULL,
             .uri = NULL,
             .payload = NULL,
             .payload_length = -1
     };
-    ssize_t bytes_processed = parse_request(buffer, n, &request);
+    ssize_t bytes_processed = parse_request(buffer, n, &request, &(state->parser));
 
     if (bytes_processed > 0) {
-        unsigned short hash_value;
-        hash_value = hash(request.uri);
-        send_reply(conn, &request, node, hash_value);
+        state->request_start = monotonic_us();
+        state->request_method = metrics_method(request.method);
 
         // Check the "Connection" header in the request to determine if the connection should be kept alive or closed.
         const string connection_header = get_header(&request, "Connection");
-        if (connection_header && strcmp(connection_header, "close")) {
-            return -1;
+        bool close_requested = connection_header && strcasecmp(connection_header, "close") == 0;
+
+        size_t received = n - bytes_processed;
+        if ((size_t) request.payload_length > received) {
+            upload_start(server, state, &request, received, close_requested);
+            return n;
         }
+
+        uint16_t hash_value = uri_hash(request.uri);
+        send_reply(server, state, &request, hash_value);
+        state->close_after_reply = close_requested;
+        bytes_processed += request.payload_length;
     } else if (bytes_processed == -1) {
         // If the request is malformed or an error occurs during processing, send a 400 Bad Request response to the client.
-        const string bad_request = "HTTP/1.1 400 Bad Request\r\n\r\n";
-        send(conn, bad_request, strlen(bad_request), 0);
-        printf("Received malformed request, terminating connection.\n");
-        close(conn);
-        return -1;
+        state->request_start = monotonic_us();
+        state->request_method = METHOD_OTHER;
+        reply_prepare(state, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n");
+        state->close_after_reply = true;
+        logger_printf("Received malformed request, terminating connection.\n");
+        return n;
     }
 
     return bytes_processed;
@@ -480,11 +822,26 @@ size_t process_packet(int conn, char* buffer, size_t n, struct Node* node) {
  *
  * @param state A pointer to the connection_state structure to be initialized.
  * @param sock The socket descriptor representing the new connection.
+ * @param generation Distinguishes this connection from earlier ones using the same descriptor.
  *
  */
-static void connection_setup(struct connection_state* state, int sock) {
+static void connection_setup(struct connection_state* state, int sock, uint64_t generation) {
     // Set the socket descriptor for the new connection in the connection_state structure.
     state->sock = sock;
+    state->generation = generation;
+    state->parked = false;
+    state->parked_uri = NULL;
+    state->forward = NULL;
+    state->close_after_reply = false;
+    state->events = EPOLLIN | EPOLLRDHUP;
+    state->output.first = 0;
+    state->output.n_replies = 0;
+    state->output.headers_length = 0;
+    state->upload = NULL;
+    state->upload_uri = NULL;
+    state->upload_received = 0;
+    state->skip = 0;
+    parser_reset(&(state->parser));
 
     // Set the 'end' pointer of the state to the beginning of the buffer.
     state->end = state->buffer;
@@ -512,53 +869,139 @@ char* buffer_discard(char* buffer, size_t discard, size_t keep) {
 }
 
 /**
- * Handles incoming connections and processes data received over the socket.
+ * Processes all complete requests in the connection's buffer and sends the replies.
  *
- * @param state A pointer to the connection_state structure containing the connection state.
- * @return Returns true if the connection and data processing were successful, false otherwise.
- *         If an error occurs while receiving data from the socket, the function exits the program.
+ * Replies are queued and sent together once no complete request is left.
+ * Processing stops while a reply is deferred or the output is full and
+ * cannot be sent completely, the remaining requests stay in the buffer until
+ * the connection is resumed or writable again.
+ *
+ * @return Returns false if the connection is to be closed.
  */
-bool handle_connection(struct connection_state* state, struct  Node* node) {
-    // Calculate the pointer to the end of the buffer to avoid buffer overflow
-    const char* buffer_end = state->buffer + HTTP_MAX_SIZE;
+static bool process_buffer(struct server* server, struct connection_state* state) {
+    char* window_start = state->buffer;
+    char* window_end = state->end;
+    bool open = true;
+
+    while (!state->parked && !state->upload && !state->close_after_reply) {
+        if (output_full(&(state->output))) {
+            if (!output_flush(state)) {
+                open = false;
+                break;
+            }
+            if (output_pending(&(state->output))) {
+                break;
+            }
+        }
+
+        ssize_t bytes_processed = process_packet(server, state, window_start, window_end - window_start);
+        if (bytes_processed == 0) {
+            break;
+        }
+        window_start += bytes_processed;
+    }
+
+    state->end = buffer_discard(state->buffer, window_start - state->buffer, window_end - window_start);
 
-    // Check if an error occurred while receiving data from the socket
-    ssize_t bytes_read = recv(state->sock, state->end, buffer_end - state->end, 0);
+    if (open && !output_flush(state)) {
+        open = false;
+    }
+    if (open && state->close_after_reply && !state->parked && !output_pending(&(state->output))) {
+        open = false;
+    }
+    if (open) {
+        connection_watch(server, state);
+    }
+    return open;
+}
+
+/**
+ * Receives the next part of the body of the current upload.
+ *
+ * Bodies held in memory are received in place, those backed by a file
+ * pass through the connection's buffer, which is empty meanwhile.
+ *
+ * @return Returns false if the connection is to be closed.
+ */
+static bool upload_receive(struct server* server, struct connection_state* state) {
+    struct value* value = state->upload;
+    size_t remaining = value->length - state->upload_received;
+
+    char* destination = state->buffer;
+    if (value->file == -1) {
+        destination = value->data + state->upload_received;
+    } else if (remaining > HTTP_MAX_SIZE) {
+        remaining = HTTP_MAX_SIZE;
+    }
+
+    ssize_t bytes_read = recv(state->sock, destination, remaining, MSG_DONTWAIT);
     if (bytes_read == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return true;
+        }
         perror("recv");
-        close(state->sock);
-        exit(EXIT_FAILURE);
+        return false;
     } else if (bytes_read == 0) {
         return false;
     }
 
-    char* window_start = state->buffer;
-    char* window_end = state->end + bytes_read;
-
-    ssize_t bytes_processed = 0;
-    while((bytes_processed = process_packet(state->sock, window_start, window_end - window_start, node)) > 0) {
-        window_start += bytes_processed;
-    }
-    if (bytes_processed == -1) {
+    if (value->file == -1) {
+        state->upload_received += bytes_read;
+    } else if (!upload_write(state, state->buffer, bytes_read)) {
         return false;
     }
 
-    state->end = buffer_discard(state->buffer, window_start - state->buffer, window_end - window_start);
-    return true;
+    if (state->upload_received < value->length) {
+        return true;
+    }
+    upload_finish(server, state);
+    return process_buffer(server, state);
 }
 
 
-Node* initialize(char* ip, int port, int id){
-    Node* node = (Node*)malloc(sizeof(Node));
-    if(node != NULL){
-        node->ip = calloc(sizeof(ip), sizeof(char));
-        memcpy(node->ip, ip, strlen(ip));
-        node->port = port;
-        node->id = id;
-        node->pred = NULL;
-        node->succ = NULL;
+/**
+ * Handles incoming connections and processes data received over the socket.
+ *
+ * @param server The server the client is connected to.
+ * @param state A pointer to the connection_state structure containing the connection state.
+ * @return Returns true if the connection should be kept open, false if it
+ *         was closed by the peer, failed, or is to be closed after the reply.
+ */
+bool handle_connection(struct server* server, struct connection_state* state) {
+    if (output_pending(&(state->output))) {
+        // Writable again, the queued replies go first
+        return process_buffer(server, state);
+    }
+
+    if (state->upload) {
+        return upload_receive(server, state);
+    }
+
+    // Calculate the pointer to the end of the buffer to avoid buffer overflow
+    const char* buffer_end = state->buffer + HTTP_MAX_SIZE;
+
+    // Never block the event loop: readiness may be spurious
+    ssize_t bytes_read = recv(state->sock, state->end, buffer_end - state->end, MSG_DONTWAIT);
+    if (bytes_read == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return true;
+        }
+        perror("recv");
+        return false;
+    } else if (bytes_read == 0) {
+        return false;
+    }
+
+    // Drop the rest of a body nobody is interested in, the buffer is empty meanwhile
+    size_t skipped = state->skip < (size_t) bytes_read ? state->skip : (size_t) bytes_read;
+    if (skipped > 0) {
+        memmove(state->end, state->end + skipped, bytes_read - skipped);
+        state->skip -= skipped;
+        bytes_read -= skipped;
     }
-    return node;
+
+    state->end += bytes_read;
+    return process_buffer(server, state);
 }
 
 
@@ -566,12 +1009,13 @@ Node* initialize(char* ip, int port, int id){
  * Sets up a TCP server socket and binds it to the provided sockaddr_in address.
  *
  * @param addr The sockaddr_in structure representing the IP address and port of the server.
+ * @param backlog The maximum number of pending connections not yet accepted.
+ * @param reuse_port Whether further sockets may be bound to the same address, one per worker.
  *
  * @return The file descriptor of the created TCP server socket.
  */
-static int setup_server_socket(struct sockaddr_in addr) {
+static int setup_server_socket(struct sockaddr_in addr, int backlog, bool reuse_port) {
     const int enable = 1;
-    const int backlog = 1;
 
     // Create a socket
     int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -592,6 +1036,12 @@ static int setup_server_socket(struct sockaddr_in addr) {
         exit(EXIT_FAILURE);
     }
 
+    // Let the kernel distribute connections among the listening sockets of all workers
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
     // Bind socket to the provided address
     if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
         perror("bind");
@@ -599,7 +1049,7 @@ static int setup_server_socket(struct sockaddr_in addr) {
         exit(EXIT_FAILURE);
     }
 
-    // Start listening on the socket with maximum backlog of 1 pending connection
+    // Start listening on the socket with the configured backlog of pending connections
     if (listen(sock, backlog)) {
         perror("listen");
         exit(EXIT_FAILURE);
@@ -610,100 +1060,673 @@ static int setup_server_socket(struct sockaddr_in addr) {
 
 
 /**
-*  The program expects 3; otherwise, it returns EXIT_FAILURE.
-*
-*  Call as:
-*
-*  ./build/webserver self.ip self.port
-*/
-int main(int argc, char** argv) {
+ * Registers or deregisters the listening socket with the event loop.
+ *
+ * Used to stop accepting new clients while `max_connections` are open; the
+ * kernel keeps queueing them in the listen backlog meanwhile.
+ */
+static void server_set_accepting(struct server* server, bool accepting) {
+    if (server->accepting == accepting) {
+        return;
+    }
 
-    if (argc < 3) {
-        return EXIT_FAILURE;
+    struct epoll_event event = {
+        .events = accepting ? EPOLLIN : 0,
+        .data.u64 = event_data(SOURCE_LISTENER, server->listener),
+    };
+    if (epoll_ctl(server->epoll, EPOLL_CTL_MOD, server->listener, &event) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
     }
+    server->accepting = accepting;
+}
 
-    struct connection_state state = {0};
 
-    struct sockaddr_in addr = derive_sockaddr(argv[1], argv[2]);
+/**
+ * Creates the event loop and registers the listening socket.
+ *
+ * @param server The server state to be initialized.
+ * @param listener The listening TCP socket.
+ * @param max_connections The maximum number of concurrently open client connections.
+ * @param dht The DHT state of this node.
+ * @param park_lookups Whether requests wait for lookups instead of being answered with 503.
+ * @param replicator The replication of writes to other nodes, or NULL.
+ * @param proxy The forwarding of requests to other nodes, or NULL.
+ */
+static void server_init(struct server* server, int listener, size_t max_connections, struct dht* dht, bool park_lookups,
+                        struct replicator* replicator, struct proxy* proxy) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("getrlimit");
+        exit(EXIT_FAILURE);
+    }
 
-    // Set up a server socket.
-    int server_socket = setup_server_socket(addr);
-
-    Node* node;
-    if(argc == 4) {
-        node = initialize(argv[1], atoi(argv[2]), atoi(argv[3]));
-        Node* succ = initialize(getenv("SUCC_IP"), atoi(getenv("SUCC_PORT")), atoi(getenv("SUCC_ID")));
-        Node* pred = initialize(getenv("PRED_IP"), atoi(getenv("PRED_PORT")), atoi(getenv("PRED_ID")));
-        pred->pred= succ;
-        succ->succ = pred;
-        node->succ = succ;
-        node->pred = pred;
-
-        if(node->pred->id == 0){
-            lookup_reply(node);
-        }
+    *server = (struct server) {
+        .listener = listener,
+        .accepting = true,
+        .max_connections = max_connections,
+        .table_size = limit.rlim_cur == RLIM_INFINITY ? 65536 : limit.rlim_cur,
+        .dht = dht,
+        .park_lookups = park_lookups,
+        .replicator = replicator,
+        .proxy = proxy,
+        .signals = -1,
+    };
+    pthread_mutex_init(&(server->mailbox_lock), NULL);
 
+    server->connections = calloc(server->table_size, sizeof(struct connection_state*));
+    if (server->connections == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
     }
-    if(argc == 3){
-        node = NULL;
+
+    server->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epoll == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
     }
 
-    //udp_socket
-    int sockDgram = udp_node_socket(addr);
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u64 = event_data(SOURCE_LISTENER, listener),
+    };
+    if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, listener, &event) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
 
-    // Create an array of pollfd structures to monitor sockets.
-    struct pollfd sockets[2] = {
-            { .fd = server_socket, .events = POLLIN },
+    server->mailbox = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->mailbox == -1) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    event = (struct epoll_event) {
+        .events = EPOLLIN,
+        .data.u64 = event_data(SOURCE_MAILBOX, server->mailbox),
     };
+    if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->mailbox, &event) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
 
-    while (true) {
 
+/**
+ * Handles DHT messages and lookup timeouts in this server's event loop.
+ */
+static void server_watch_dht(struct server* server) {
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u64 = event_data(SOURCE_DHT, server->dht->sock),
+    };
+    if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->dht->sock, &event) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
 
-        // Use poll() to wait for events on the monitored sockets.
-        int ready = poll(sockets, sizeof(sockets) / sizeof(sockets[0]), -1);
-        if (ready == -1) {
-            perror("poll");
+    event.data.u64 = event_data(SOURCE_TIMER, server->dht->timer);
+    if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->dht->timer, &event) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    event.data.u64 = event_data(SOURCE_MAINTENANCE, server->dht->maintenance);
+    if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->dht->maintenance, &event) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * Blocks SIGUSR1 and SIGTERM, so they are only delivered through `server_watch_signals()`.
+ *
+ * Must be called before any worker thread is started, threads inherit the mask.
+ */
+static void block_signals(sigset_t* mask) {
+    sigemptyset(mask);
+    sigaddset(mask, SIGUSR1);
+    sigaddset(mask, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, mask, NULL) != 0) {
+        perror("pthread_sigmask");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * Delivers the blocked signals through this server's event loop.
+ */
+static void server_watch_signals(struct server* server, const sigset_t* mask, struct migrator* migrator) {
+    server->migrator = migrator;
+    server->signals = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (server->signals == -1) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u64 = event_data(SOURCE_SIGNAL, server->signals),
+    };
+    if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->signals, &event) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * Prints statistics of the resource store and the DHT, requested by SIGUSR1,
+ * or leaves the ring on SIGTERM, handing the local keys to the successor.
+ */
+static void server_handle_signal(struct server* server) {
+    struct signalfd_siginfo info;
+    while (read(server->signals, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGTERM) {
+            if (server->migrator) {
+                migrator_leave(server->migrator);
+            }
+            exit(EXIT_SUCCESS);
+        }
+
+        struct slab_stats stats = store_stats(&resources);
+        fprintf(stderr, "Store: %zu resources, %zu bytes live, %zu bytes wasted, %zu slabs, %zu bytes in large allocations\n",
+                store_size(&resources), stats.bytes_live, stats.bytes_wasted, stats.n_slabs, stats.bytes_large);
+        fprintf(stderr, "DHT: %zu lookups sent, %zu forwarded, %zu answered\n",
+                atomic_load(&(server->dht->n_sent)), atomic_load(&(server->dht->n_forwarded)),
+                atomic_load(&(server->dht->n_answered)));
+    }
+}
+
+
+/**
+ * Closes a client connection and releases its slot in the connection table.
+ */
+static void server_close_connection(struct server* server, int sock) {
+    struct connection_state* state = server->connections[sock];
+    output_clear(&(state->output));
+    upload_clear(state);
+    free(state->parked_uri);
+    state->parked_uri = NULL;
+    state->parked = false;
+    if (state->forward) {
+        proxy_request_free(server->proxy, state->forward);
+        state->forward = NULL;
+    }
+
+    epoll_ctl(server->epoll, EPOLL_CTL_DEL, sock, NULL);
+    close(sock);
+    server->n_connections -= 1;
+    atomic_fetch_sub(&(metrics.connections), 1);
+
+    server_set_accepting(server, server->n_connections < server->max_connections);
+}
+
+
+/**
+ * Accepts all pending connections on the listening socket.
+ *
+ * Stops once the backlog is drained or `max_connections` is reached.
+ */
+static void server_accept(struct server* server) {
+    while (server->n_connections < server->max_connections) {
+        struct sockaddr_in client;
+        socklen_t client_length = sizeof(client);
+        int connection = accept4(server->listener, (struct sockaddr*) &client, &client_length, SOCK_NONBLOCK);
+        if (connection == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+                break;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                // Out of descriptors: leave the remaining clients in the backlog
+                perror("accept");
+                break;
+            }
+            close(server->listener);
+            perror("accept");
             exit(EXIT_FAILURE);
         }
 
-        // Process events on the monitored sockets.
-        for (size_t i = 0; i < sizeof(sockets) / sizeof(sockets[0]); i += 1) {
-            if (sockets[i].revents != POLLIN) {
-                // If there are no POLLIN events on the socket, continue to the next iteration.
+        if ((size_t) connection >= server->table_size) {
+            close(connection);
+            continue;
+        }
+
+        struct connection_state* state = server->connections[connection];
+        if (state == NULL) {
+            state = malloc(sizeof(struct connection_state));
+            if (state == NULL) {
+                perror("malloc");
+                close(connection);
                 continue;
             }
-            int s = sockets[i].fd;
-
-            if (s == server_socket) {
-
-                // If the event is on the server_socket, accept a new connection from a client.
-                int connection = accept(server_socket, NULL, NULL);
-                if (connection == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                    close(server_socket);
-                    perror("accept");
-                    exit(EXIT_FAILURE);
-                } else {
-                    connection_setup(&state, connection);
-
-                    // limit to one connection at a time
-                    sockets[0].events = 0;
-                    sockets[1].fd = connection;
-                    sockets[1].events = POLLIN;
-                }
-            } else {
-                assert(s == state.sock);
-
-                // Call the 'handle_connection' function to process the incoming data on the socket.
-                bool cont = handle_connection(&state, node);
-                if (!cont) {  // get ready for a new connection
-                    sockets[0].events = POLLIN;
-                    sockets[1].fd = -1;
-                    sockets[1].events = 0;
-                }
+            server->connections[connection] = state;
+        }
+        server->generation += 1;
+        connection_setup(state, connection, server->generation);
+        state->client = client;
+
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLRDHUP,
+            .data.u64 = event_data(SOURCE_CONNECTION, connection),
+        };
+        if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, connection, &event) == -1) {
+            perror("epoll_ctl");
+            close(connection);
+            continue;
+        }
+        server->n_connections += 1;
+        atomic_fetch_add(&(metrics.connections), 1);
+    }
+
+    server_set_accepting(server, server->n_connections < server->max_connections);
+}
+
+
+/**
+ * Called by the DHT once the lookup of a parked connection completed.
+ *
+ * May run on any worker, so the waiter is handed to the worker owning the
+ * connection through its mailbox.
+ */
+static void lookup_completed(struct lookup_waiter* waiter) {
+    struct server* server = waiter->owner;
+
+    pthread_mutex_lock(&(server->mailbox_lock));
+    waiter->next = server->completed;
+    server->completed = waiter;
+    pthread_mutex_unlock(&(server->mailbox_lock));
+
+    uint64_t one = 1;
+    if (write(server->mailbox, &one, sizeof(one)) == -1) {
+        perror("write");
+    }
+}
+
+
+/**
+ * Called by the proxy once the reply to a forwarded request arrived, or
+ * forwarding failed.
+ *
+ * Runs on a thread of the proxy, so the request is handed to the worker
+ * owning the connection through its mailbox.
+ */
+static void proxy_completed(struct proxy_request* request) {
+    struct server* server = request->owner;
+
+    pthread_mutex_lock(&(server->mailbox_lock));
+    request->next = server->forwarded;
+    server->forwarded = request;
+    pthread_mutex_unlock(&(server->mailbox_lock));
+
+    uint64_t one = 1;
+    if (write(server->mailbox, &one, sizeof(one)) == -1) {
+        perror("write");
+    }
+}
+
+
+/**
+ * Ends the parking of a connection and continues with the requests received meanwhile.
+ */
+static void server_unpark(struct server* server, struct connection_state* state) {
+    free(state->parked_uri);
+    state->parked_uri = NULL;
+    state->parked = false;
+
+    if (!process_buffer(server, state)) {
+        server_close_connection(server, state->sock);
+    }
+}
+
+
+/**
+ * Sends the deferred reply of a parked connection whose lookup completed,
+ * or forwards its request to the node found responsible.
+ */
+static void server_resume(struct server* server, struct connection_state* state, const struct lookup_waiter* waiter) {
+    struct proxy_request* forwarded = state->forward;
+    state->forward = NULL;
+    if (forwarded && waiter->found) {
+        // Stays parked until the reply arrives
+        forwarded->peer = waiter->responsible;
+        proxy_submit(server->proxy, forwarded);
+        return;
+    }
+
+    if (forwarded) {
+        proxy_request_free(server->proxy, forwarded);
+    }
+    if (waiter->found) {
+        send_redirect(state, &(waiter->responsible), state->parked_uri);
+    } else {
+        reply_prepare(state, "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n");
+    }
+    server_unpark(server, state);
+}
+
+
+/**
+ * Passes the reply to a forwarded request on to the client, unchanged.
+ */
+static void server_forwarded(struct server* server, struct connection_state* state, struct proxy_request* forwarded) {
+    struct reply* reply = NULL;
+    if (!forwarded->failed) {
+        reply = reply_prepare(state, "%.*s", (int) forwarded->reply_length, forwarded->reply);
+    }
+    if (reply) {
+        // The reply keeps the reference until the body is sent
+        reply->body = forwarded->reply_body->data;
+        reply->file = forwarded->reply_body->file;
+        reply->body_length = forwarded->reply_body->length;
+        forwarded->reply_body = NULL;
+    } else {
+        reply_prepare(state, "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n");
+    }
+    server_unpark(server, state);
+}
+
+
+/**
+ * Resumes all parked connections whose lookup completed, or the reply to
+ * whose forwarded request arrived.
+ */
+static void server_handle_mailbox(struct server* server) {
+    uint64_t count;
+    if (read(server->mailbox, &count, sizeof(count)) == -1) {
+        return;
+    }
+
+    pthread_mutex_lock(&(server->mailbox_lock));
+    struct lookup_waiter* waiter = server->completed;
+    server->completed = NULL;
+    struct proxy_request* forwarded = server->forwarded;
+    server->forwarded = NULL;
+    pthread_mutex_unlock(&(server->mailbox_lock));
+
+    while (waiter) {
+        struct lookup_waiter* next = waiter->next;
+        struct connection_state* state = server->connections[waiter->sock];
+        // The client may have disconnected meanwhile, and its descriptor been reused
+        if (state && state->parked && state->generation == waiter->generation) {
+            server_resume(server, state, waiter);
+        }
+        free(waiter);
+        waiter = next;
+    }
+
+    while (forwarded) {
+        struct proxy_request* next = forwarded->next;
+        struct connection_state* state = server->connections[forwarded->sock];
+        if (state && state->parked && state->forward == NULL && state->generation == forwarded->generation) {
+            server_forwarded(server, state, forwarded);
+        }
+        proxy_request_free(server->proxy, forwarded);
+        forwarded = next;
+    }
+}
+
+
+/**
+ * Runs the event loop, never returns.
+ */
+static void* server_run(void* arg) {
+    struct server* server = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        int ready = epoll_wait(server->epoll, events, MAX_EVENTS, -1);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
             }
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
         }
 
+        for (int i = 0; i < ready; i += 1) {
+            enum event_source source = events[i].data.u64 >> 32;
+            int fd = (int) (uint32_t) events[i].data.u64;
+
+            switch (source) {
+                case SOURCE_LISTENER:
+                    server_accept(server);
+                    break;
+                case SOURCE_CONNECTION:
+                    // Call the 'handle_connection' function to process the incoming data on the socket.
+                    if ((events[i].events & (EPOLLHUP | EPOLLERR))
+                        || !handle_connection(server, server->connections[fd])) {
+                        server_close_connection(server, fd);
+                    }
+                    break;
+                case SOURCE_SIGNAL:
+                    server_handle_signal(server);
+                    break;
+                case SOURCE_DHT:
+                    dht_handle_messages(server->dht);
+                    break;
+                case SOURCE_TIMER:
+                    dht_tick(server->dht);
+                    break;
+                case SOURCE_MAINTENANCE:
+                    dht_maintain(server->dht);
+                    break;
+                case SOURCE_MAILBOX:
+                    server_handle_mailbox(server);
+                    break;
+            }
+        }
+    }
+}
+
+
+/**
+ * Prints how to invoke the program.
+ */
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [-b backlog] [-c max_connections] [-w workers] [-s spill_threshold] [-S stabilize_ms]\n"
+            "       [-r replication] [-d directory] [-C catalog] [-P] [-p] [-v]\n"
+            "       self.ip self.port [self.id [anchor.ip anchor.port]]\n"
+            "\n"
+            "  -b backlog          pending connections queued by the kernel, per worker (default %d)\n"
+            "  -c max_connections  concurrently served clients, per worker (default %d)\n"
+            "  -w workers          threads serving clients (default 1)\n"
+            "  -s spill_threshold  bodies of uploads larger than this many bytes are stored\n"
+            "                      in temporary files in $TMPDIR (default %d)\n"
+            "  -S stabilize_ms     mean interval of ring stabilization (default %d)\n"
+            "  -r replication      copies of every key, kept by the responsible node and\n"
+            "                      its successors, at most %d (default 1)\n"
+            "  -d directory        keep the resources in a journal and snapshots in this\n"
+            "                      directory, and restore them from there on startup\n"
+            "  -C catalog          serve the read-only resources of this file built by\n"
+            "                      mkcatalog, mapped into memory\n"
+            "  -P                  hold requests for remote keys until the lookup completes\n"
+            "                      instead of answering 503 and asking the client to retry\n"
+            "  -p                  forward requests for remote keys to the responsible node\n"
+            "                      and pass its reply on, instead of redirecting the client\n"
+            "  -v                  log every request to stderr\n",
+            program, DEFAULT_BACKLOG, DEFAULT_MAX_CONNECTIONS, DEFAULT_SPILL_THRESHOLD, DHT_MAINTENANCE_MS,
+            DHT_SUCCESSORS + 1);
+}
+
+
+/**
+*  The program expects 2, 3 or 5 positional arguments; otherwise, it returns EXIT_FAILURE.
+*
+*  Call as:
+*
+*  ./build/webserver [-b backlog] [-c max_connections] [-w workers] [-s spill_threshold] [-S stabilize_ms]
+*                    [-r replication] [-d directory] [-C catalog] [-P] [-p] [-v]
+*                    self.ip self.port [self.id [anchor.ip anchor.port]]
+*
+*  Given an ID, the node is part of a DHT. It joins the ring of the anchor if
+*  given, or takes its neighbors from the environment variables PRED_ID,
+*  PRED_IP, PRED_PORT and SUCC_ID, SUCC_IP, SUCC_PORT if set, or starts a
+*  ring of its own. Setting NO_STABILIZE disables all background DHT traffic.
+*  All nodes of a ring must be started with the same replication factor.
+*
+*  Resources of a catalog given with -C are served by every node, see
+*  `struct catalog`. With -p, requests for keys of other nodes are forwarded
+*  to them, see `struct proxy`.
+*
+*  Every node serves counters and latency histograms in the Prometheus text
+*  format at /_metrics.
+*/
+int main(int argc, char** argv) {
+    const char* program = argv[0];
+    int backlog = DEFAULT_BACKLOG;
+    size_t max_connections = DEFAULT_MAX_CONNECTIONS;
+    size_t n_workers = 1;
+    bool park_lookups = false;
+    bool proxy_mode = false;
+    size_t spill_threshold = DEFAULT_SPILL_THRESHOLD;
+    unsigned stabilize_ms = DHT_MAINTENANCE_MS;
+    size_t replication = 1;
+    const char* directory = NULL;
+    const char* catalog_path = NULL;
+
+    // Before any thread is started, they inherit the mask
+    sigset_t signals;
+    block_signals(&signals);
+
+    int option;
+    while ((option = getopt(argc, argv, "b:c:w:s:S:r:d:C:Ppv")) != -1) {
+        switch (option) {
+            case 'b':
+                backlog = safe_strtoull_range(optarg, 0, INT_MAX, "Invalid backlog");
+                break;
+            case 'c':
+                max_connections = safe_strtoull_range(optarg, 1, INT_MAX, "Invalid connection limit");
+                break;
+            case 'w':
+                n_workers = safe_strtoull_range(optarg, 1, MAX_WORKERS, "Invalid number of workers");
+                break;
+            case 's':
+                spill_threshold = safe_strtoull(optarg, NULL, 10, "Invalid spill threshold");
+                break;
+            case 'S':
+                // The maintenance timer scales the interval by up to 5/4
+                stabilize_ms = safe_strtoull_range(optarg, 1, UINT_MAX / 4, "Invalid stabilization interval");
+                break;
+            case 'r':
+                replication = safe_strtoull_range(optarg, 1, DHT_SUCCESSORS + 1, "Invalid replication factor");
+                break;
+            case 'd':
+                directory = optarg;
+                break;
+            case 'C':
+                catalog_path = optarg;
+                break;
+            case 'P':
+                park_lookups = true;
+                break;
+            case 'p':
+                proxy_mode = true;
+                break;
+            case 'v':
+                logger_start();
+                break;
+            default:
+                usage(program);
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 3 || argc == 5 || argc > 6) {
+        usage(program);
+        return EXIT_FAILURE;
+    }
+
+    store_init(&resources, INITIAL_RESOURCES);
+    resources.position = hash_cached;
+    resources.spill_threshold = spill_threshold;
+    if (getenv("TMPDIR")) {
+        resources.spill_directory = getenv("TMPDIR");
+    }
+    set("/static/foo", "Foo", sizeof "Foo" - 1, &resources);
+    set("/static/bar", "Bar", sizeof "Bar" - 1, &resources);
+    set("/static/baz", "Baz", sizeof "Baz" - 1, &resources);
+    if (directory) {
+        journal_open(&resources, directory);
+    }
+    if (catalog_path) {
+        catalog_open(&catalog, catalog_path);
+    }
+
+    struct sockaddr_in addr = derive_sockaddr(argv[1], argv[2]);
+
+    // Set up one server socket per worker.
+    struct server* servers = calloc(n_workers, sizeof(struct server));
+    int server_socket = setup_server_socket(addr, backlog, n_workers > 1);
+
+    Node* node = NULL;
+    Node* anchor = NULL;
+    if (argc >= 4) {
+        node = initialize(argv[1], safe_strtoul(argv[2], NULL, 10, "Invalid port"), safe_strtoul(argv[3], NULL, 10, "Invalid ID"));
+        if (argc == 6) {
+            // Neighbors are learned when joining
+            anchor = initialize(argv[4], safe_strtoul(argv[5], NULL, 10, "Invalid anchor port"), 0);
+        } else if (getenv("SUCC_ID")) {
+            node->succ = initialize(getenv("SUCC_IP"), atoi(getenv("SUCC_PORT")), atoi(getenv("SUCC_ID")));
+            node->pred = initialize(getenv("PRED_IP"), atoi(getenv("PRED_PORT")), atoi(getenv("PRED_ID")));
+        } else {
+            // The first node of a ring is its own neighbor
+            node->succ = initialize(node->ip, node->port, node->id);
+            node->pred = initialize(node->ip, node->port, node->id);
+        }
+    }
+
+    // The DHT socket is bound even when running standalone
+    struct dht* dht = malloc(sizeof(struct dht));
+    dht_init(dht, node, udp_node_socket(addr), lookup_completed);
+    if (node && !getenv("NO_STABILIZE")) {
+        dht_start_maintenance(dht, stabilize_ms);
+    }
+    if (anchor) {
+        dht_join(dht, anchor);
+    }
+
+    // All node-to-node HTTP shares one pool, kept warm towards the replicas, or all successors for forwarding
+    struct peer_pool* pool = NULL;
+    if (node) {
+        pool = malloc(sizeof(struct peer_pool));
+        pool_start(pool, dht, proxy_mode ? DHT_SUCCESSORS : replication - 1);
+    }
+
+    struct replicator* replicator = NULL;
+    if (node && replication > 1) {
+        replicator = malloc(sizeof(struct replicator));
+        replicator_start(replicator, &resources, dht, pool, replication - 1);
+    }
+    struct proxy* proxy = NULL;
+    if (node && proxy_mode) {
+        proxy = malloc(sizeof(struct proxy));
+        proxy_start(proxy, &resources, pool, proxy_completed);
+    }
+    struct migrator* migrator = NULL;
+    if (node) {
+        migrator = malloc(sizeof(struct migrator));
+        migrator_start(migrator, &resources, dht, pool, replicator);
+    }
+
+    // Clients closing early must not kill the server while a body is sent with sendfile()
+    signal(SIGPIPE, SIG_IGN);
+
+    server_init(&servers[0], server_socket, max_connections, dht, park_lookups, replicator, proxy);
+    server_watch_signals(&servers[0], &signals, migrator);
+    server_watch_dht(&servers[0]);
+    for (size_t i = 1; i < n_workers; i += 1) {
+        server_init(&servers[i], setup_server_socket(addr, backlog, true), max_connections, dht, park_lookups,
+                    replicator, proxy);
+        if (pthread_create(&(servers[i].thread), NULL, server_run, &servers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
     }
+    server_run(&servers[0]);
 
     return EXIT_SUCCESS;
 }